@@ -15,13 +15,33 @@
  * If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE			/* nftw() and other POSIX functions*/
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
 #include "ps3mca-ps1-driver.h"
 
+#if FUSE
+  #define FUSE_USE_VERSION 26
+  #include <fuse.h>
+#endif
+
 #if __APPLE__
   #include <TargetConditionals.h>
   #if TARGET_OS_MAC
@@ -32,6 +52,31 @@
 #endif
 
 void processMessage(const uint8_t*);
+int load_card_profile();
+int image_check_before_write(const char *filename, uint8_t *image);
+int image_validate(uint8_t *image, int *fixable);
+int simulated_open();
+int simulated_transfer(unsigned char endpoint, uint8_t *data, int length);
+int run_command(int argc, char* argv[]);
+void scheduler_preempt();
+const char *library_selector(const char *filename, char *path, size_t path_size);
+FILE *library_open_read(const char *filename);
+FILE *library_open_append(const char *filename);
+int library_commit(FILE *library, int complete);
+int library_load(const char *filename, uint8_t *image);
+const uint8_t *library_map_image(const char *filename, void **mapping, size_t *mapping_size);
+int library_list(const char *filename);
+int write_order(uint16_t *order, int first, int last, const uint8_t *selected);
+int journal_begin(const uint16_t *order, int count, const uint8_t *data, int data_first, int stride);
+void journal_mark(int i);
+void journal_end(int good, int started);
+FILE *shm_image_open(const char *filename, int output);
+uint8_t *shm_image_map(FILE *image, int output, void **mapping);
+int shm_image_close(FILE *image, int complete);
+struct read_pipeline *pipeline_start(FILE *output);
+uint8_t *pipeline_slot(struct read_pipeline *pipeline);
+void pipeline_push(struct read_pipeline *pipeline, uint16_t frame_number, const uint8_t *data, int status);
+int pipeline_finish(struct read_pipeline *pipeline, int complete);
 
 int res = 0;				/* Return codes from libusb functions */
 int ret = 0;				/* Return codes from libusb functions */
@@ -53,9 +98,209 @@ void delay(int milliseconds)		/* Delay definition*/
         now = clock();
 }
 
+long long time_us()			/* Monotonic time in microseconds, for measures*/
+{
+
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec*1000000 + now.tv_nsec/1000;
+
+}
+
+/* Adaptive timeout: the timeout of every transfer is the mean round-trip time plus USB_TIMEOUT_DEVIATIONS times the mean
+ * deviation, between USB_TIMEOUT_MIN and USB_TIMEOUT. After USB_MAX_TIMEOUTS timeouts in sequence (or if the ps3mca is
+ * unplugged) all the next transfers fail immediately, so a dead card fails in seconds instead of 5 seconds for every frame.*/
+long rtt_average = 0;			/* Mean round-trip time (microseconds), 0 if no transfer yet*/
+long rtt_deviation = 0;			/* Mean deviation of round-trip time (microseconds)*/
+int consecutive_timeouts = 0;		/* Timeouts in sequence*/
+int ps3mca_aborted = 0;			/* Set to 1 when the card or the ps3mca don't reply anymore*/
+int session_depth = 0;			/* Commands using the opened ps3mca, it is closed when the last one end*/
+char *simulate = NULL;			/* Image of the simulated ps3mca (PS3MCA_SIMULATE), NULL with the USB device*/
+
+/* Counters of the process, exposed by the daemon in Prometheus text format (see Metrics). The worker of the daemon
+   updates them while the requests are served, so they are changed and read only with metrics_lock*/
+struct driver_metrics
+{
+  unsigned long long transfers;
+  unsigned long long timeouts;
+  unsigned long long aborts;
+  unsigned long long bytes_out;
+  unsigned long long bytes_in;
+  unsigned long long auth_failures;
+  unsigned long long pacing_wait;			/* Microseconds waited after the writes (writing_delay)*/
+  unsigned long long frames[2];			/* 0 read, 1 write*/
+  unsigned long long frame_errors[2][FRAME_ERRORS];
+  unsigned long long meb[2][256];			/* Replies by Memory End Byte*/
+  unsigned long long latency[2][METRICS_BUCKETS+1];	/* Frames by latency bucket, last is over the last bound*/
+  unsigned long long latency_sum[2];			/* Microseconds*/
+  unsigned long long jobs[2];				/* Daemon jobs done, 0 normal, 1 urgent*/
+  unsigned long long preemptions;			/* Urgent jobs run between the frames of another job*/
+  unsigned long long pipeline_stalls;			/* Reads waiting for the sinks (queue of the read pipeline full)*/
+  int jobs_queued;
+  long round_trip;					/* Copy of rtt_average (microseconds)*/
+  int writing_delay;					/* Copy of writing_delay in use (milliseconds)*/
+};
+
+struct driver_metrics metrics;
+pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void metrics_count (unsigned long long *counter, unsigned long long value)
+{
+  pthread_mutex_lock(&metrics_lock);
+  *counter += value;
+  pthread_mutex_unlock(&metrics_lock);
+}
+
+/* Card cache of the session: type and id are asked once, forgotten if the ps3mca is removed or the autentication fail*/
+int cached_card_type = 0;		/* RESPONSE_PS1_CARD or RESPONSE_PS2_CARD, 0 if unknown*/
+int cached_card_id_valid = 0;		/* 1 if cached_card_id is the id of the card in the ps3mca*/
+uint8_t cached_card_id[8];
+
+void card_cache_invalidate()
+{
+  cached_card_type = 0;
+  cached_card_id_valid = 0;
+}
+
+unsigned int ps3mca_timeout()		/* Timeout for the next transfer (milliseconds)*/
+{
+
+  long timeout;
+
+  if (rtt_average == 0)
+  {
+    return USB_TIMEOUT_FIRST;
+  }
+
+  timeout = (rtt_average + USB_TIMEOUT_DEVIATIONS*rtt_deviation)/1000 + 1;
+  if (timeout < USB_TIMEOUT_MIN)
+  {
+    timeout = USB_TIMEOUT_MIN;
+  }
+  if (timeout > USB_TIMEOUT)
+  {
+    timeout = USB_TIMEOUT;
+  }
+  return (unsigned int)timeout;
+
+}
+
+int ps3mca_bulk_transfer(unsigned char endpoint, uint8_t *data, int length)
+{
+
+  long long start;
+  long elapsed;
+  long error;
+  int result;
+
+  if (ps3mca_aborted)
+  {
+    numBytes = 0;
+    return LIBUSB_ERROR_NO_DEVICE;
+  }
+
+  start = time_us();
+  if (simulate != NULL)
+  {
+    result = simulated_transfer(endpoint, data, length);
+  }
+  else
+  {
+    result = libusb_bulk_transfer(handle, endpoint, data, length, &numBytes, ps3mca_timeout());
+  }
+  elapsed = (long)(time_us() - start);
+
+  pthread_mutex_lock(&metrics_lock);
+  metrics.transfers++;
+  if (result == 0)
+  {
+    if (endpoint == BULK_WRITE_ENDPOINT)
+    {
+      metrics.bytes_out += numBytes;
+    }
+    else
+    {
+      metrics.bytes_in += numBytes;
+    }
+  }
+
+  if (result == 0)
+  {
+    consecutive_timeouts = 0;
+    /* Same estimator of TCP (RFC 6298), gain 1/8 for mean and 1/4 for deviation*/
+    if (rtt_average == 0)
+    {
+      rtt_average = elapsed > 0 ? elapsed : 1;
+      rtt_deviation = rtt_average/2;
+    }
+    else
+    {
+      error = elapsed - rtt_average;
+      rtt_average += error/8;
+      rtt_deviation += ((error < 0 ? -error : error) - rtt_deviation)/4;
+    }
+  }
+  else if (result == LIBUSB_ERROR_TIMEOUT)
+  {
+    metrics.timeouts++;
+    consecutive_timeouts++;
+    if (consecutive_timeouts >= USB_MAX_TIMEOUTS)
+    {
+      fprintf(stderr, "No reply from the memory card after %d timeouts in sequence, aborting.\n", consecutive_timeouts);
+      metrics.aborts++;
+      ps3mca_aborted = 1;
+      card_cache_invalidate();
+    }
+  }
+  else if (result == LIBUSB_ERROR_NO_DEVICE)
+  {
+    fprintf(stderr, "PS3mca disconnected, aborting.\n");
+    metrics.aborts++;
+    ps3mca_aborted = 1;
+    card_cache_invalidate();
+  }
+  metrics.round_trip = rtt_average;
+  pthread_mutex_unlock(&metrics_lock);
+
+  return result;
+
+}
+
 int open_ps3mca()
 {
 
+  /* Already opened by a batch script, use the same session*/
+  if (session_depth > 0)
+  {
+    session_depth++;
+    return 0;
+  }
+
+  /* New session, forget the round-trip time of the previous card*/
+  rtt_average = 0;
+  rtt_deviation = 0;
+  pthread_mutex_lock(&metrics_lock);
+  metrics.round_trip = 0;
+  metrics.writing_delay = writing_delay;
+  pthread_mutex_unlock(&metrics_lock);
+  consecutive_timeouts = 0;
+  ps3mca_aborted = 0;
+  card_cache_invalidate();
+
+  /* Simulated ps3mca, without USB device*/
+  simulate = getenv(SIMULATE_VARIABLE);
+  if (simulate != NULL && *simulate != '\0')
+  {
+    if (simulated_open() != 0)
+    {
+      return 1;
+    }
+    session_depth = 1;
+    return 0;
+  }
+  simulate = NULL;
+
   /* Initialise libusb. */
   res = libusb_init(0);
   if (res != 0)
@@ -110,6 +355,7 @@ int open_ps3mca()
     return 1;
   }
 
+  session_depth = 1;
   return 0;
 
 }
@@ -117,6 +363,19 @@ int open_ps3mca()
 void close_ps3mca()			/* Unmount the ps3mca*/
 {
 
+  /* Other commands of the session still use the ps3mca*/
+  if (session_depth > 1)
+  {
+    session_depth--;
+    return;
+  }
+  session_depth = 0;
+
+  if (simulate != NULL)
+  {
+    return;
+  }
+
   /* Release interface #0. */
   res = libusb_release_interface(handle, 0);
   if (0 != res)
@@ -146,6 +405,22 @@ int PS3mca_verify_card ()
     return 1;
   }
 
+  /* Already asked in this session*/
+  if (cached_card_type != 0)
+  {
+    printf("\nType of Memory Card:\n");
+    if (cached_card_type == RESPONSE_PS1_CARD)
+    {
+      printf("PS1 Memory Card.\n\n");
+    }
+    else
+    {
+      printf("PS2 Memory Card.\nFor the moment isn't in roadmap to support it (see FAQ).\n\n");
+    }
+    close_ps3mca();
+    return 0;
+  }
+
   uint8_t cmd_card_verification[2];
   uint8_t response_card_verification[2];
 
@@ -157,8 +432,8 @@ int PS3mca_verify_card ()
 
 
   
-  /* Send the message to endpoint with a 5000ms timeout. */
-  res = libusb_bulk_transfer(handle, BULK_WRITE_ENDPOINT, cmd_card_verification, sizeof(cmd_card_verification), &numBytes, USB_TIMEOUT);
+  /* Send the message to endpoint with the adaptive timeout. */
+  res = ps3mca_bulk_transfer(BULK_WRITE_ENDPOINT, cmd_card_verification, sizeof(cmd_card_verification));
   if (res == 0)
   {
     printf("\nType of Memory Card:\n");
@@ -180,8 +455,8 @@ int PS3mca_verify_card ()
   memset(response_card_verification, 0, sizeof(response_card_verification));
 
   /* Listen for a message.*/
-  /* Wait up to 5 seconds for a message to arrive on endpoint*/
-  res = libusb_bulk_transfer(handle, BULK_READ_ENDPOINT, response_card_verification, sizeof(response_card_verification), &numBytes, USB_TIMEOUT);
+  /* Wait up to the adaptive timeout (max 5 seconds) for a message to arrive on endpoint*/
+  res = ps3mca_bulk_transfer(BULK_READ_ENDPOINT, response_card_verification, sizeof(response_card_verification));
   if (0 == res)
   {
     if (numBytes == sizeof(response_card_verification))
@@ -198,12 +473,14 @@ int PS3mca_verify_card ()
         if (response_card_verification[0] == RESPONSE_CODE & response_card_verification[1] == RESPONSE_PS1_CARD)
         {
           printf("PS1 Memory Card.\n\n");
+          cached_card_type = RESPONSE_PS1_CARD;
         } 
 
         /* Verify if there is a PS2 card*/
         else if (response_card_verification[0] == RESPONSE_CODE & response_card_verification[1] == RESPONSE_PS2_CARD)    
         {
           printf("PS2 Memory Card.\nFor the moment isn't in roadmap to support it (see FAQ).\n\n");
+          cached_card_type = RESPONSE_PS2_CARD;
         }
 
         /* Other unknown PS3mca error*/
@@ -228,6 +505,60 @@ int PS3mca_verify_card ()
 
   return 0;
 }
+
+/* Type of the card on an opened ps3mca without messages (RESPONSE_PS1_CARD or RESPONSE_PS2_CARD), 0 if unknown.
+   The ps3mca is asked only the first time in the session.*/
+int ps3mca_card_type ()
+{
+
+  uint8_t cmd_card_verification[2];
+  uint8_t response_card_verification[2];
+
+  if (cached_card_type != 0 || ps3mca_aborted)
+  {
+    return cached_card_type;
+  }
+
+  cmd_card_verification[0] = PS3MCA_CMD_FIRST;			/* First command for ps3mca protocol*/
+  cmd_card_verification[1] = PS3MCA_CMD_VERIFY_CARD_TYPE;	/* Verify what type of card (PS1 or PS2)*/
+
+  res = ps3mca_bulk_transfer(BULK_WRITE_ENDPOINT, cmd_card_verification, sizeof(cmd_card_verification));
+  if (res != 0)
+  {
+    return 0;
+  }
+
+  memset(response_card_verification, 0, sizeof(response_card_verification));
+  res = ps3mca_bulk_transfer(BULK_READ_ENDPOINT, response_card_verification, sizeof(response_card_verification));
+  if (res == 0 && numBytes == sizeof(response_card_verification) && response_card_verification[0] == RESPONSE_CODE &&
+      (response_card_verification[1] == RESPONSE_PS1_CARD || response_card_verification[1] == RESPONSE_PS2_CARD))
+  {
+    cached_card_type = response_card_verification[1];
+  }
+
+  return cached_card_type;
+
+}
+
+/* Open the ps3mca only if there is a PS1 card, for all the commands that read or write frames*/
+int open_ps1_card ()
+{
+
+  if (open_ps3mca() != 0)
+  {
+    return 1;
+  }
+
+  if (ps3mca_card_type() != RESPONSE_PS1_CARD)
+  {
+    fprintf(stderr, "There isn't a PS1 memory card in the ps3mca.\n");
+    close_ps3mca();
+    return 1;
+  }
+
+  return 0;
+
+}
 /* -----------------------------------------End of PS3mca verification of card (PS1 or PS2)-----------------------------------------*/
 
 
@@ -238,6 +569,24 @@ int PS3mca_verify_card ()
 
 
 /* -------------------------------------------------------PS1 command get id--------------------------------------------------------*/
+void PS1_print_id (const uint8_t *id)		/* id is the 8 bytes of reply (ID1, ID2, ACK1, ACK2, frames, frame size)*/
+{
+
+  /* Verify if is a memory card (SCPH-1020) or a PocketStation (SCPH-4000)*/
+  if (id[0] == PS1CARD_REPLY_MC_ID_1 & id[1] == PS1CARD_REPLY_MC_ID_2 & id[2] == PS1CARD_REPLY_COMMAND_ACKNOWLEDGE_1 & id[3] == PS1CARD_REPLY_COMMAND_ACKNOWLEDGE_2 & id[4] ==  PS1CARD_REPLY_NUMBER_FRAME_1 & id[5] == PS1CARD_REPLY_NUMBER_FRAME_2 & id[6] == PS1CARD_REPLY_FRAME_SIZE_1 & id[7] == PS1CARD_REPLY_FRAME_SIZE_2)
+  {
+    printf("This card seems to be a original PS memory card (SCPH-1020), (SCPH-1170), (SCPH-119X) or a PocketStation (SCPH-4000).\n\n");
+  }
+
+  /* Other unknown memorycard*/
+  else
+  {
+    printf("This seems to be a unofficial memorycard.\n");
+    printf("See FAQ for PS1 get id command.\n\n");
+  }
+
+}
+
 int PS1_get_id ()
 {
 
@@ -246,6 +595,15 @@ int PS1_get_id ()
     return 1;
   }
 
+  /* Already asked in this session*/
+  if (cached_card_id_valid)
+  {
+    printf("\nPS1 GET ID of this session\n");
+    PS1_print_id(cached_card_id);
+    close_ps3mca();
+    return 0;
+  }
+
   uint8_t cmd_get_id[14];
 
   /* This is the command get id for memory card (SCPH-1020) or PocketStation (SCPH-4000)*/
@@ -269,8 +627,8 @@ int PS1_get_id ()
 
 
   
-  /* Send the message to endpoint with a 5000ms timeout. */
-  res = libusb_bulk_transfer(handle, BULK_WRITE_ENDPOINT, cmd_get_id, sizeof(cmd_get_id), &numBytes, USB_TIMEOUT);
+  /* Send the message to endpoint with the adaptive timeout. */
+  res = ps3mca_bulk_transfer(BULK_WRITE_ENDPOINT, cmd_get_id, sizeof(cmd_get_id));
   if (res == 0)
   {
     printf("\nSend PS1 GET ID COMMAND\n");
@@ -303,8 +661,8 @@ int PS1_get_id ()
   memset(bulk_buffer, 0, sizeof(bulk_buffer));
 
   /* Listen for a message.*/
-  /* Wait up to 5 seconds for a message to arrive on endpoint*/
-  res = libusb_bulk_transfer(handle, BULK_READ_ENDPOINT, bulk_buffer, sizeof(bulk_buffer), &numBytes, USB_TIMEOUT);
+  /* Wait up to the adaptive timeout (max 5 seconds) for a message to arrive on endpoint*/
+  res = ps3mca_bulk_transfer(BULK_READ_ENDPOINT, bulk_buffer, sizeof(bulk_buffer));
   if (0 == res)
   {
     if (numBytes <= sizeof(bulk_buffer))
@@ -386,18 +744,9 @@ int PS1_get_id ()
           printf("Autentication verified.\n\n");
           #endif
 
-          /* Verify if is a memory card (SCPH-1020) or a PocketStation (SCPH-4000)*/
-          if (bulk_buffer[6] == PS1CARD_REPLY_MC_ID_1 & bulk_buffer[7] == PS1CARD_REPLY_MC_ID_2 & bulk_buffer[8] == PS1CARD_REPLY_COMMAND_ACKNOWLEDGE_1 & bulk_buffer[9] == PS1CARD_REPLY_COMMAND_ACKNOWLEDGE_2 & bulk_buffer[10] ==  PS1CARD_REPLY_NUMBER_FRAME_1 & bulk_buffer[11] == PS1CARD_REPLY_NUMBER_FRAME_2 & bulk_buffer[12] == PS1CARD_REPLY_FRAME_SIZE_1 & bulk_buffer[13] == PS1CARD_REPLY_FRAME_SIZE_2)
-          {
-            printf("This card seems to be a original PS memory card (SCPH-1020), (SCPH-1170), (SCPH-119X) or a PocketStation (SCPH-4000).\n\n");
-          } 
-
-          /* Other unknown memorycard*/
-          else   
-          {
-            printf("This seems to be a unofficial memorycard.\n");
-            printf("See FAQ for PS1 get id command.\n\n");
-          }
+          memcpy(cached_card_id, &bulk_buffer[6], 8);
+          cached_card_id_valid = 1;
+          PS1_print_id(cached_card_id);
 
         } 
 
@@ -405,6 +754,8 @@ int PS1_get_id ()
         else if (bulk_buffer[0] == RESPONSE_CODE & bulk_buffer[1] == RESPONSE_WRONG)    
         {
           fprintf(stderr, "Autentication failed.\n");
+          metrics_count(&metrics.auth_failures, 1);
+          card_cache_invalidate();
         }
 
         /* Other unknown PS3mca error*/
@@ -429,6 +780,49 @@ int PS1_get_id ()
 
   return 0;
 
+}
+/* Send get id on an opened ps3mca without messages, id is the 8 bytes of reply (ID1, ID2, ACK1, ACK2, frames, frame size)*/
+int PS1_read_id (uint8_t *id)
+{
+
+  uint8_t cmd_get_id[14];
+
+  if (cached_card_id_valid)
+  {
+    memcpy(id, cached_card_id, 8);
+    return 0;
+  }
+
+  memset(cmd_get_id, 0, sizeof(cmd_get_id));
+  cmd_get_id[0] = PS3MCA_CMD_FIRST;			/* First command for ps3mca protocol*/
+  cmd_get_id[1] = PS3MCA_CMD_TYPE_LONG;			/* PS1 type of command*/
+  cmd_get_id[2] = 0x0a;					/* 14-4=10=0ah lenght of command*/
+  cmd_get_id[4] = PS1CARD_CMD_MEMORY_CARD_ACCESS;	/* Memory Card Access, principal command for any action with any memory card*/
+  cmd_get_id[5] = PS1CARD_CMD_GET_ID;			/* Send Get ID Command (ASCII "S")*/
+
+  res = ps3mca_bulk_transfer(BULK_WRITE_ENDPOINT, cmd_get_id, sizeof(cmd_get_id));
+  if (res != 0)
+  {
+    return 1;
+  }
+
+  memset(bulk_buffer, 0, sizeof(bulk_buffer));
+  res = ps3mca_bulk_transfer(BULK_READ_ENDPOINT, bulk_buffer, sizeof(bulk_buffer));
+  if (res != 0 || !(bulk_buffer[0] == RESPONSE_CODE & bulk_buffer[1] == RESPONSE_STATUS_SUCCES))
+  {
+    if (res == 0 && bulk_buffer[1] == RESPONSE_WRONG)
+    {
+      metrics_count(&metrics.auth_failures, 1);
+      card_cache_invalidate();
+    }
+    return 1;
+  }
+
+  memcpy(cached_card_id, &bulk_buffer[6], 8);
+  cached_card_id_valid = 1;
+  memcpy(id, cached_card_id, 8);
+  return 0;
+
 }
 /* ----------------------------------------------------End of PS1 command get id----------------------------------------------------*/
 
@@ -437,357 +831,1384 @@ int PS1_get_id ()
 
 
 
-/* -------------------------------------------------------PS1 command read----------------------------------------------------------*/
-/* Command for read every single frame*/
-/* Reading Data from Memory Card
-   Send Reply Comment
-   81h  N/A   Memory Card Access (unlike 01h=Controller access), dummy response
-   52h  FLAG  Send Read Command (ASCII "R"), Receive FLAG Byte
-   00h  5Ah   Receive Memory Card ID1
-   00h  5Dh   Receive Memory Card ID2
-   MSB  (00h) Send Address MSB  ;\frame number (0..3FFh)
-   LSB  (pre) Send Address LSB  ;/
-   00h  5Ch   Receive Command Acknowledge 1  ;<-- late /ACK after this byte-pair
-   00h  5Dh   Receive Command Acknowledge 2
-   00h  MSB   Receive Confirmed Address MSB
-   00h  LSB   Receive Confirmed Address LSB
-   00h  ...   Receive Data Frame (128 bytes)
-   00h  CHK   Receive Checksum (MSB xor LSB xor Data bytes)
-   00h  47h   Receive Memory End Byte (should be always 47h="G"=Good for Read)
-*/
-int PS1_read ()
+/* ------------------------------------------------------------Image formats-------------------------------------------------------*/
+/* Images with a header (VgsM, PSX) are converted on the fly: the header is skipped in reading and created in writing,
+   so read, write and every other command can use them directly without intermediate files.*/
+
+/* Format of the image from the extension of the file name, raw image if unknown*/
+int image_format_from_name (const char *filename)
 {
 
-  if (open_ps3mca() != 0)
+  const char *extension = strrchr(filename, '.');
+
+  /* shm, shm:slot or shm:/name*/
+  if (strcmp(filename, "shm") == 0 || strncmp(filename, "shm:", 4) == 0)
   {
-    return 1;
+    return IMAGE_FORMAT_SHM;
+  }
+  /* library.mcl or library.mcl@selector*/
+  if (library_selector(filename, NULL, 0) != NULL || (extension != NULL && strcasecmp(extension, ".mcl") == 0))
+  {
+    return IMAGE_FORMAT_LIBRARY;
+  }
+  if (extension != NULL && strcasecmp(extension, ".mem") == 0)
+  {
+    return IMAGE_FORMAT_VGS;
+  }
+  if (extension != NULL && (strcasecmp(extension, ".psx") == 0 || strcasecmp(extension, ".psv") == 0))
+  {
+    return IMAGE_FORMAT_PSX;
+  }
+  if (extension != NULL && strcasecmp(extension, ".vm1") == 0)
+  {
+    return IMAGE_FORMAT_VM1;
   }
 
-  // get the timestamp for file saving.
-  char filename[70];
-  time_t t = time(NULL);
-  struct tm tm = *localtime(&t);
-  sprintf(filename, "memory_card_out_%d-%02d-%02d_%02d-%02d-%02d.mcd", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
-
-  uint8_t cmd_read[144];
-  FILE *output=fopen( filename, "wb" );	/* Open and create a binary file output in writing*/
+  return IMAGE_FORMAT_RAW;
 
+}
 
+/* Format of the image from the header and the size of the file, -1 if it isn't a memory card image*/
+int image_format_detect (const uint8_t *header, long size)
+{
 
-  /* Start of frame to frame loop*/
-  for (frame = PS1CARD_MIN_FRAME; frame <= PS1CARD_MAX_FRAME; frame++)
+  if (size == 131072+IMAGE_HEADER_SIZE[IMAGE_FORMAT_VGS] && memcmp(header, IMAGE_MAGIC[IMAGE_FORMAT_VGS], 4) == 0)
+  {
+    return IMAGE_FORMAT_VGS;
+  }
+  if (size == 131072+IMAGE_HEADER_SIZE[IMAGE_FORMAT_PSX] && memcmp(header, IMAGE_MAGIC[IMAGE_FORMAT_PSX], 3) == 0)
+  {
+    return IMAGE_FORMAT_PSX;
+  }
+  if (size == 131072)
   {
+    return IMAGE_FORMAT_RAW;
+  }
 
-  /* Split frame value in two*/
-  msb = (uint8_t)((frame & 0xFF00) >> 8);
-  lsb = (uint8_t)(frame & 0x00FF);
-  /* Clean command read*/
-  memset(cmd_read, 0, sizeof(cmd_read));
-  /* This is the write command for memory card (SCPH-1020) or PocketStation (SCPH-4000)*/
-  /* first 4 byte are about ps3 memory card adapter protocol*/
-  cmd_read[0] = PS3MCA_CMD_FIRST;			/* First command for ps3mca protocol*/
-  cmd_read[1] = PS3MCA_CMD_TYPE_LONG;			/* PS1 type of command*/
-  cmd_read[2] = 0x8c;					/* 144-4=140=8ch lenght of command. Can be cmd_read[2]=sizeof(cmd_read)-4*/
-  cmd_read[3] = 0x00;					/* memset set all to 0x00, but I prefer to specify it a second time ;)*/
-  /* this is the real command read with lenght of 140=0x8c*/
-  cmd_read[4] = PS1CARD_CMD_MEMORY_CARD_ACCESS;		/* Memory Card Access, principal command for any action with any memory card*/
-  cmd_read[5] = PS1CARD_CMD_READ;			/* Send Read Command (ASCII "R")*/
-  cmd_read[6] = 0x00;					/* Ask Memory Card ID1*/
-  cmd_read[7] = 0x00;					/* Ask Memory Card ID2*/
-  cmd_read[8] = msb;					/* First two significant digits of the frame value*/
-  cmd_read[9] = lsb;					/* Last two significant digits of the frame value*/
-  /* Send 0x00 134 times (2 Command Acknowledge + 2 Confirmed Address + 128 Data Frame + 1 Checksum + 1 Memory End Byte)*/
+  return -1;
 
+}
 
-  
-  /* Send the message to endpoint with a 5000ms timeout. */
-  res = libusb_bulk_transfer(handle, BULK_WRITE_ENDPOINT, cmd_read, sizeof(cmd_read), &numBytes, USB_TIMEOUT);
-  if (res == 0)
+/* Open an image in reading, positioned on the first Data Frame*/
+FILE *image_open_read (const char *filename, int *format)
+{
+
+  uint8_t header[4];
+  long size;
+
+  if (image_format_from_name(filename) == IMAGE_FORMAT_LIBRARY)
   {
-    /* See on screen what is transmitted for debug purpose*/
-    #if DEBUG
-    printf("\n%d bytes transmitted successfully on frame %d:\n", numBytes, frame);
-    printf("Send:\n");
-    printf("%x \n", cmd_read[0]);
-    printf("%x \n", cmd_read[1]);
-    printf("%x \n", cmd_read[2]);
-    printf("%x \n", cmd_read[3]);
-    printf("%x \n", cmd_read[4]);
-    printf("%x \n", cmd_read[5]);
-    printf("%x \n", cmd_read[6]);
-    printf("%x \n", cmd_read[7]);
-    printf("%x \n", cmd_read[8]);
-    printf("%x \n", cmd_read[9]);
-    printf("%x \n", cmd_read[10]);
-    printf("%x \n", cmd_read[11]);
-    printf("%x \n", cmd_read[12]);
-    printf("%x \n", cmd_read[13]);
-    printf("%x \n", cmd_read[142]);
-    printf("%x \n", cmd_read[143]);
-    printf("\n");
-    #endif
+    *format = IMAGE_FORMAT_LIBRARY;
+    return library_open_read(filename);
   }
-  else
+  if (image_format_from_name(filename) == IMAGE_FORMAT_SHM)
   {
-    fprintf(stderr, "Error sending message to device.\n");
+    *format = IMAGE_FORMAT_SHM;
+    return shm_image_open(filename, 0);
   }
 
-  /* Clean buffer.*/
-  memset(ps1_ram_buffer, 0, sizeof(ps1_ram_buffer));
+  FILE *input=fopen( filename, "rb" );
+  if (input == NULL)
+  {
+    fprintf(stderr, "Unable to open %s.\n", filename);
+    return NULL;
+  }
 
-  /* Listen for a message.*/
-  /* Wait up to 5 seconds for a message to arrive on endpoint*/
-  res = libusb_bulk_transfer(handle, BULK_READ_ENDPOINT, ps1_ram_buffer, sizeof(ps1_ram_buffer), &numBytes, USB_TIMEOUT);
-  if (0 == res)
+  memset(header, 0, sizeof(header));
+  fread(header, 1, sizeof(header), input);
+  fseek(input, 0, SEEK_END);
+  size = ftell(input);
+
+  *format = image_format_detect(header, size);
+  if (*format < 0)
   {
-    if (numBytes <= sizeof(ps1_ram_buffer))
-    {
-        /* Verify if PS3mca send status succes code*/
-        if (ps1_ram_buffer[0] == RESPONSE_CODE & ps1_ram_buffer[1] == RESPONSE_STATUS_SUCCES)
-        {
-	  #if DEBUG
-          printf("Autentication verified on frame %d.\n", frame);
-          #endif
-	  #if VERBOSE
-	  printf("Reading frame %d.\n", frame);
-	  #endif
-        }
+    fprintf(stderr, "%s isn't a memory card image (raw, VgsM or PSX).\n", filename);
+    fclose(input);
+    return NULL;
+  }
 
-        /* Verify if PS3mca send status wrong code*/
-        else if (ps1_ram_buffer[0] == RESPONSE_CODE & ps1_ram_buffer[1] == RESPONSE_WRONG)    
-        {
-          fprintf(stderr, "Autentication failed on frame %d.\n", frame);
-        }
+  fseek(input, IMAGE_HEADER_SIZE[*format], SEEK_SET);
+  return input;
 
-        /* Other unknown PS3mca error*/
-        else   
-        {
-          fprintf(stderr, "Unknown error on PS3mca protocol on frame %d.\n", frame);
-        }
+}
 
-        /* Verify command acknowledge*/
-        if (ps1_ram_buffer[10] == PS1CARD_REPLY_COMMAND_ACKNOWLEDGE_1 & ps1_ram_buffer[11] == PS1CARD_REPLY_COMMAND_ACKNOWLEDGE_2)
-        {
-	  #if DEBUG
-          printf("Good command acknowledge on frame %d.\n", frame);
-          #endif
-        }
+/* Create an image with the format given by the extension, positioned on the first Data Frame*/
+FILE *image_open_write (const char *filename, int *format)
+{
 
-        /* Unknown command acknowledge error*/
-        else   
-        {
-          fprintf(stderr, "Unknown command acknowledge error on frame %d.\n", frame);
-        }
+  uint8_t header[256];
 
-        /* Verify msb and lsb*/
-        if (ps1_ram_buffer[12] == msb & ps1_ram_buffer[13] == lsb)
-        {
-	  #if DEBUG
-          printf("Confirmed frame number on frame %d.\n", frame);
-          #endif
-        }
+  *format = image_format_from_name(filename);
+  if (*format == IMAGE_FORMAT_LIBRARY)
+  {
+    return library_open_append(filename);
+  }
+  if (*format == IMAGE_FORMAT_SHM)
+  {
+    return shm_image_open(filename, 1);
+  }
 
-        /* Unknown frame error*/
-        else   
-        {
-          fprintf(stderr, "Unknown frame number error on frame %d.\n", frame);
-          fprintf(stderr, "Return frame number %d %d.\n\n", ps1_ram_buffer[12], ps1_ram_buffer[13]);
-        }
+  FILE *output=fopen( filename, "wb" );	/* Open and create a binary file output in writing*/
+  if (output == NULL)
+  {
+    fprintf(stderr, "Unable to create %s.\n", filename);
+    return NULL;
+  }
 
-	/* This permit to select and save only the received Data Frame (PS1CARD_FRAME_SIZE=128 bytes).*/
-	/* First 14 bytes are about PS3mca (4 bytes) and PS1 (10 bytes) protocol.*/
-	/* Last 2 bytes are Checksum & Memory End Byte.*/
-	fwrite(&ps1_ram_buffer[14], 1, PS1CARD_FRAME_SIZE, output);
+  if (IMAGE_HEADER_SIZE[*format] > 0)
+  {
+    memset(header, 0, sizeof(header));
+    memcpy(header, IMAGE_MAGIC[*format], strlen(IMAGE_MAGIC[*format]));
+    /* Connectix Virtual Game Station header: "VgsM", 1, 1, 1, 200h (little endian)*/
+    if (*format == IMAGE_FORMAT_VGS)
+    {
+      header[4] = 0x01;
+      header[8] = 0x01;
+      header[12] = 0x01;
+      header[17] = 0x02;
+    }
+    fwrite(header, 1, IMAGE_HEADER_SIZE[*format], output);
+  }
 
-	/* Clean checksum.*/
-	checksum = 0x00;
+  return output;
 
-	/* Calc supposed checksum.*/
-	for (c = 12; c < 12+2+PS1CARD_FRAME_SIZE; c++)		/* Loop of msb + lsb + all data bytes*/
-	{
-	checksum = checksum ^ ps1_ram_buffer[c];		/* Checksum = MSB xor LSB xor all Data bytes*/
-	}
+}
 
-        /* Verify checksum*/
-        if (ps1_ram_buffer[142] == checksum)
-        {
-	#if DEBUG
-	printf("Good checksum on frame %d.\n", frame);
-        #endif
-        }
+/* Close an image created by image_open_write, a library add the image only if it is complete. Return 0 if saved*/
+int image_close_write (FILE *output, int format, int complete)
+{
 
-        /* Checksum error*/
-        else   
-        {
-          fprintf(stderr, "Incorrect checksum on frame %d.\n", frame);
-          fprintf(stderr, "Received %x, should be %x.\n\n", ps1_ram_buffer[142], checksum);
-        }
+  int error;
 
+  if (format == IMAGE_FORMAT_LIBRARY)
+  {
+    return library_commit(output, complete);
+  }
+  if (format == IMAGE_FORMAT_SHM)
+  {
+    return shm_image_close(output, complete);
+  }
 
-        /* Verify MEB*/
-        if (ps1_ram_buffer[143] == PS1CARD_REPLY_MEB_GOOD)
-        {
-	#if DEBUG
-	printf("Good Memory End Byte on frame %d.\n", frame);
-        #endif
-        }
+  fflush(output);
+  error = ferror(output);
+  fclose(output);
 
-        /* Other unknown MEB error*/
-        else   
-        {
-          fprintf(stderr, "Unknown Memory End Byte on frame %d.\n", frame);
-          fprintf(stderr, "Received %x, should be 47.\n\n", ps1_ram_buffer[143]);
-        }
+  return error != 0 || !complete;
 
+}
 
-    }
-    else
-    {
-      fprintf(stderr, "Received %d bytes, expected a maximum of %lu bytes on frame %d.\n", numBytes, sizeof(ps1_ram_buffer), frame);
-    }
+/* Convert an image frame by frame, without intermediate files*/
+int image_convert (const char *input_name, const char *output_name)
+{
+
+  uint8_t data_frame[128];
+  int input_format;
+  int output_format;
+  int frames = 0;
+
+  FILE *input = image_open_read(input_name, &input_format);
+  if (input == NULL)
+  {
+    return 1;
+  }
+  FILE *output = image_open_write(output_name, &output_format);
+  if (output == NULL)
+  {
+    fclose(input);
+    return 1;
   }
 
+  while (frames <= PS1CARD_MAX_FRAME && fread(data_frame, 1, PS1CARD_FRAME_SIZE, input) == PS1CARD_FRAME_SIZE)
+  {
+    fwrite(data_frame, 1, PS1CARD_FRAME_SIZE, output);
+    frames++;
+  }
 
-  else
+  fclose(input);
+  if (image_close_write(output, output_format, frames == PS1CARD_MAX_FRAME+1) != 0)
   {
-    fprintf(stderr, "Error receiving message.\n");
+    fprintf(stderr, "Error converting %s to %s.\n", input_name, output_name);
+    return 1;
   }
 
+  return 0;
+
+}
+/* --------------------------------------------------------End of Image formats----------------------------------------------------*/
+
+
+
+
+
+
+
+
+
+/* ------------------------------------------------------------Packet builder------------------------------------------------------*/
+/* Read and write packets start from the templates, only the frame value, the data and the checksum change from frame to
+   frame. The checksum (MSB xor LSB xor all Data bytes) is computed while the data is copied, 8 bytes at a time.*/
+uint8_t read_packet[PS1CARD_READ_PACKET_SIZE];		/* The trailing 00h never change*/
+int read_packet_ready = 0;
+
+uint8_t *packet_read_build (uint16_t frame_number)	/* Return the read packet of the frame*/
+{
+
+  if (!read_packet_ready)
+  {
+    memset(read_packet, 0, sizeof(read_packet));
+    memcpy(read_packet, PS1CARD_READ_PACKET_HEADER, sizeof(PS1CARD_READ_PACKET_HEADER));
+    read_packet_ready = 1;
   }
 
-  /* Clean and close the file output*/
-  fflush(output);
-  fclose(output);
+  read_packet[8] = (uint8_t)(frame_number >> 8);
+  read_packet[9] = (uint8_t)(frame_number & 0xFF);
 
-  /* Unmount the ps3mca*/
-  close_ps3mca();
+  return read_packet;
 
-  return 0;
+}
+
+/* Build the write packet (PS1CARD_WRITE_PACKET_SIZE bytes) of the frame*/
+void packet_write_build (uint8_t *packet, uint16_t frame_number, const uint8_t *data)
+{
+
+  uint64_t word;
+  uint64_t xor = 0;
+  int i;
+
+  memcpy(packet, PS1CARD_WRITE_PACKET_HEADER, sizeof(PS1CARD_WRITE_PACKET_HEADER));
+  packet[8] = (uint8_t)(frame_number >> 8);
+  packet[9] = (uint8_t)(frame_number & 0xFF);
+
+  for (i = 0; i < 16; i++)
+  {
+    memcpy(&word, &data[i*8], 8);			/* Frames in images can be unaligned*/
+    memcpy(&packet[10 + i*8], &word, 8);
+    xor = xor ^ word;
+  }
+  xor = xor ^ (xor >> 32);
+  xor = xor ^ (xor >> 16);
+  xor = xor ^ (xor >> 8);
+
+  packet[138] = (uint8_t)(xor & 0xFF) ^ packet[8] ^ packet[9];	/* Send Checksum*/
+  packet[139] = 0x00;					/* Receive Command Acknowledge 1*/
+  packet[140] = 0x00;					/* Receive Command Acknowledge 2*/
+  packet[141] = 0x00;					/* Receive Memory End Byte (47h=Good, 4Eh=BadChecksum, FFh=BadSector)*/
 
 }
-/* ----------------------------------------------------End of PS1 command read------------------------------------------------------*/
 
+/* Build the write packets of frames first to last in one pass, data has the frames from first*/
+void packet_write_build_range (uint8_t *packets, uint16_t first, uint16_t last, const uint8_t *data)
+{
 
+  int f;
 
+  for (f = first; f <= last; f++)
+  {
+    packet_write_build(&packets[(f - first)*PS1CARD_WRITE_PACKET_SIZE], f, &data[(f - first)*PS1CARD_FRAME_SIZE]);
+  }
 
+}
+/* --------------------------------------------------------End of Packet builder---------------------------------------------------*/
 
 
 
 
-/* -------------------------------------------------------PS1 command write----------------------------------------------------------*/
-/* Command for start writing every single frame*/
-/* Writing Data to Memory Card
-   Send Reply Comment
-   81h  N/A   Memory Card Access (unlike 01h=Controller access), dummy response
-   57h  FLAG  Send Write Command (ASCII "W"), Receive FLAG Byte
-   00h  5Ah   Receive Memory Card ID1
-   00h  5Dh   Receive Memory Card ID2
-   MSB  (00h) Send Address MSB  ;\frame number (0..3FFh)
-   LSB  (pre) Send Address LSB  ;/
-   ...  (pre) Send Data Sector (128 bytes)
-   CHK  (pre) Send Checksum (MSB xor LSB xor Data bytes)
-   00h  5Ch   Receive Command Acknowledge 1
-   00h  5Dh   Receive Command Acknowledge 2
-   00h  4xh   Receive Memory End Byte (47h=Good, 4Eh=BadChecksum, FFh=BadSector)
-*/
-int PS1_write ()
+
+
+
+
+
+/* ----------------------------------------------------------Simulated ps3mca------------------------------------------------------*/
+/* Answer the ps3mca commands as a PS3mca with an official PS1 card: the command sent on BULK_WRITE_ENDPOINT prepare the
+   reply, that is received on BULK_READ_ENDPOINT.*/
+uint8_t simulated_card[131072];
+int simulated_card_ready = 0;
+uint8_t simulated_reply[256];
+int simulated_reply_size = 0;
+long simulated_latency = 0;
+long simulated_errors = 0;
+long simulated_drift = 0;
+long simulated_transfers = 0;
+
+void simulated_format_card ()			/* Formatted card without saves*/
 {
 
-  if (open_ps3mca() != 0)
+  uint8_t *entry;
+  int f;
+  int b;
+
+  memset(simulated_card, 0, sizeof(simulated_card));
+  for (f = PS1CARD_MIN_FRAME; f <= PS1CARD_BROKEN_LAST_FRAME; f++)
   {
-    return 1;
+    entry = &simulated_card[f*PS1CARD_FRAME_SIZE];
+    if (f == 0)
+    {
+      entry[0] = 'M';
+      entry[1] = 'C';
+    }
+    else if (f <= PS1CARD_DIRECTORY_LAST_FRAME)
+    {
+      entry[0] = PS1CARD_DIR_FREE_BLOCK;
+      entry[PS1CARD_DIR_NEXT_OFFSET] = 0xff;
+      entry[PS1CARD_DIR_NEXT_OFFSET+1] = 0xff;
+    }
+    else
+    {
+      memset(entry, 0xff, 4);
+      entry[PS1CARD_DIR_NEXT_OFFSET] = 0xff;
+      entry[PS1CARD_DIR_NEXT_OFFSET+1] = 0xff;
+    }
+    for (b = 0; b < PS1CARD_CHECKSUM_OFFSET; b++)
+    {
+      entry[PS1CARD_CHECKSUM_OFFSET] ^= entry[b];
+    }
   }
 
-  uint8_t cmd_write[142];
-  FILE *input=fopen( "write.mcd", "rb" );		/* Open write.mcd in reading*/
+}
 
-  /* Verify first frame and last frame value, if impossible overwrite it*/
-  if (!((first_frame >= PS1CARD_MIN_FRAME) && (first_frame <= PS1CARD_MAX_FRAME) && (last_frame >= PS1CARD_MIN_FRAME) && (last_frame <= PS1CARD_MAX_FRAME) && (first_frame <= last_frame)))
-	{
-	fprintf(stderr, "Error on number of sector, possible values are 0 to 1023.\n");
-	fprintf(stderr, "First frame must be minor or equal of last frame.\n");
-	fprintf(stderr, "Overwrite the frame sector by selecting all the memory card.\n");
-	fprintf(stderr, "The original first_frame was %d, overwrited to 0\n", first_frame);
-	fprintf(stderr, "The original last_frame was %d, overwrited to 1023\n", last_frame);
-	first_frame = PS1CARD_MIN_FRAME;
-	last_frame = PS1CARD_MAX_FRAME;
-	}
+int simulated_open ()
+{
 
-  /* Start of frame to frame loop*/
-  for (frame = first_frame; frame <= last_frame; frame++)
+  const char *value;
+  int format;
+  FILE *image;
+
+  value = getenv(SIMULATE_LATENCY_VARIABLE);
+  simulated_latency = value ? atol(value) : 0;
+  value = getenv(SIMULATE_ERRORS_VARIABLE);
+  simulated_errors = value ? atol(value) : 0;
+  value = getenv(SIMULATE_DRIFT_VARIABLE);
+  simulated_drift = value ? atol(value) : 0;
+
+  /* The card is loaded once, the writes of a session are seen by the next sessions*/
+  if (simulated_card_ready)
   {
+    return 0;
+  }
 
-  /* Split frame value in two*/
-  msb = (uint8_t)((frame & 0xFF00) >> 8);
-  lsb = (uint8_t)(frame & 0x00FF);
-  /* Clean command write*/
-  memset(cmd_write, 0, sizeof(cmd_write));
-  /* This is the write command for memory card (SCPH-1020) or PocketStation (SCPH-4000)*/
-  /* first 4 byte are about ps3 memory card adapter protocol*/
-  cmd_write[0] = PS3MCA_CMD_FIRST;			/* First command for ps3mca protocol*/
-  cmd_write[1] = PS3MCA_CMD_TYPE_LONG;			/* PS1 type of command*/
-  cmd_write[2] = 0x8a;					/* 142-4=138=8ah lenght of command. Can be cmd_write[2]=sizeof(cmd_write)-4*/
-  cmd_write[3] = 0x00;					/* memset set all to 0x00, but I prefer to specify it a second time ;)*/
-  /* this is the real command write with lenght of 138=0x8a*/
-  cmd_write[4] = PS1CARD_CMD_MEMORY_CARD_ACCESS;	/* Memory Card Access, principal command for any action with any memory card*/
-  cmd_write[5] = PS1CARD_CMD_WRITE;			/* Send write Command (ASCII "W")*/
-  cmd_write[6] = 0x00;					/* Ask Memory Card ID1*/
-  cmd_write[7] = 0x00;					/* Ask Memory Card ID2*/
-  cmd_write[8] = msb;					/* First two significant digits of the frame value*/
-  cmd_write[9] = lsb;					/* Last two significant digits of the frame value*/
-  fseek ( input, frame*PS1CARD_FRAME_SIZE, SEEK_SET);	/* Read the file since frame value, needed for start on frame different to 0*/
-  fread ( &cmd_write[10], 1, PS1CARD_FRAME_SIZE, input);/* Send Data Sector (128 bytes)*/
-  cmd_write[139] = 0x00;				/* Receive Command Acknowledge 1*/
-  cmd_write[140] = 0x00;				/* Receive Command Acknowledge 2*/
-  cmd_write[141] = 0x00;				/* Receive Memory End Byte (47h=Good, 4Eh=BadChecksum, FFh=BadSector)*/
+  if (strcmp(simulate, "blank") == 0)
+  {
+    simulated_format_card();
+  }
+  else
+  {
+    image = image_open_read(simulate, &format);
+    if (image == NULL)
+    {
+      return 1;
+    }
+    if (fread(simulated_card, 1, sizeof(simulated_card), image) != sizeof(simulated_card))
+    {
+      fprintf(stderr, "%s isn't a 128 KiB memory card image.\n", simulate);
+      fclose(image);
+      return 1;
+    }
+    fclose(image);
+  }
+
+  simulated_card_ready = 1;
+  return 0;
 
+}
 
-  
-  /* Send the message to endpoint with a 5000ms timeout. */
-  res = libusb_bulk_transfer(handle, BULK_WRITE_ENDPOINT, cmd_write, sizeof(cmd_write), &numBytes, USB_TIMEOUT);
-  if (res == 0)
+int simulated_transfer (unsigned char endpoint, uint8_t *data, int length)
+{
+
+  uint16_t frame_number;
+  uint8_t chk;
+  int i;
+
+  simulated_transfers++;
+
+  /* Reply*/
+  if (endpoint == BULK_READ_ENDPOINT)
   {
-    /* See on screen what is transmitted for debug purpose*/
-    #if DEBUG
-    printf("%d bytes transmitted successfully  on frame %d.\n", numBytes, frame);
-    printf("Send:\n");
-    printf("%x \n", cmd_write[0]);
-    printf("%x \n", cmd_write[1]);
-    printf("%x \n", cmd_write[2]);
-    printf("%x \n", cmd_write[3]);
-    printf("%x \n", cmd_write[4]);
-    printf("%x \n", cmd_write[5]);
-    printf("%x \n", cmd_write[6]);
-    printf("%x \n", cmd_write[7]);
-    printf("%x \n", cmd_write[8]);
-    printf("%x \n", cmd_write[9]);
-    printf("%x \n", cmd_write[10]);
-    printf("%x \n", cmd_write[11]);
-    printf("%x \n", cmd_write[12]);
-    printf("%x \n", cmd_write[13]);
-    printf("%x \n", cmd_write[14]);
-    printf("%x \n", cmd_write[15]);
-    printf("%x \n", cmd_write[16]);
-    printf("%x \n", cmd_write[17]);
-    printf("%x \n", cmd_write[18]);
-    printf("%x \n", cmd_write[19]);
-    printf("%x \n", cmd_write[20]);
-    printf("%x \n", cmd_write[21]);
-    printf("%x \n", cmd_write[22]);
-    printf("%x \n", cmd_write[23]);
-    printf("%x \n", cmd_write[24]);
-    printf("%x \n", cmd_write[25]);
-    printf("%x \n", cmd_write[26]);
-    printf("%x \n", cmd_write[27]);
-    printf("%x \n", cmd_write[28]);
-    printf("%x \n", cmd_write[29]);
-    printf("%x \n", cmd_write[30]);
-    printf("%x \n", cmd_write[31]);
-    printf("%x \n", cmd_write[32]);
-    printf("%x \n", cmd_write[33]);
-    printf("%x \n", cmd_write[34]);
-    printf("%x \n", cmd_write[35]);
-    printf("%x \n", cmd_write[36]);
+    if (simulated_latency + simulated_drift*(simulated_transfers/1000) > 0)
+    {
+      usleep(simulated_latency + simulated_drift*(simulated_transfers/1000));
+    }
+    if (simulated_reply_size == 0)
+    {
+      numBytes = 0;
+      return LIBUSB_ERROR_TIMEOUT;
+    }
+    numBytes = simulated_reply_size < length ? simulated_reply_size : length;
+    memcpy(data, simulated_reply, numBytes);
+    simulated_reply_size = 0;
+    return 0;
+  }
+
+  /* Command*/
+  memset(simulated_reply, 0, sizeof(simulated_reply));
+  simulated_reply[0] = RESPONSE_CODE;
+  numBytes = length;
+
+  if (length == 2 && data[1] == PS3MCA_CMD_VERIFY_CARD_TYPE)
+  {
+    simulated_reply[1] = RESPONSE_PS1_CARD;
+    simulated_reply_size = 2;
+    return 0;
+  }
+
+  if (length < 10 || data[1] != PS3MCA_CMD_TYPE_LONG || data[4] != PS1CARD_CMD_MEMORY_CARD_ACCESS)
+  {
+    simulated_reply[1] = RESPONSE_WRONG;
+    simulated_reply_size = 2;
+    return 0;
+  }
+
+  simulated_reply[1] = RESPONSE_STATUS_SUCCES;
+  frame_number = (uint16_t)(((data[8] << 8) | data[9]) & PS1CARD_MAX_FRAME);
+
+  if (data[5] == PS1CARD_CMD_GET_ID)
+  {
+    simulated_reply[6] = PS1CARD_REPLY_MC_ID_1;
+    simulated_reply[7] = PS1CARD_REPLY_MC_ID_2;
+    simulated_reply[8] = PS1CARD_REPLY_COMMAND_ACKNOWLEDGE_1;
+    simulated_reply[9] = PS1CARD_REPLY_COMMAND_ACKNOWLEDGE_2;
+    simulated_reply[10] = PS1CARD_REPLY_NUMBER_FRAME_1;
+    simulated_reply[11] = PS1CARD_REPLY_NUMBER_FRAME_2;
+    simulated_reply[12] = PS1CARD_REPLY_FRAME_SIZE_1;
+    simulated_reply[13] = PS1CARD_REPLY_FRAME_SIZE_2;
+    simulated_reply_size = 64;
+  }
+  else if (data[5] == PS1CARD_CMD_READ && length == PS1CARD_READ_PACKET_SIZE)
+  {
+    simulated_reply[10] = PS1CARD_REPLY_COMMAND_ACKNOWLEDGE_1;
+    simulated_reply[11] = PS1CARD_REPLY_COMMAND_ACKNOWLEDGE_2;
+    simulated_reply[12] = data[8];
+    simulated_reply[13] = data[9];
+    memcpy(&simulated_reply[14], &simulated_card[frame_number*PS1CARD_FRAME_SIZE], PS1CARD_FRAME_SIZE);
+    chk = data[8] ^ data[9];
+    for (i = 0; i < PS1CARD_FRAME_SIZE; i++)
+    {
+      chk = chk ^ simulated_reply[14 + i];
+    }
+    simulated_reply[142] = chk;
+    simulated_reply[143] = PS1CARD_REPLY_MEB_GOOD;
+    /* Transmission error*/
+    if (simulated_errors > 0 && rand() % 10000 < simulated_errors)
+    {
+      simulated_reply[14 + rand() % PS1CARD_FRAME_SIZE] ^= 0x10;
+    }
+    simulated_reply_size = PS1CARD_READ_PACKET_SIZE;
+  }
+  else if (data[5] == PS1CARD_CMD_WRITE && length == PS1CARD_WRITE_PACKET_SIZE)
+  {
+    simulated_reply[139] = PS1CARD_REPLY_COMMAND_ACKNOWLEDGE_1;
+    simulated_reply[140] = PS1CARD_REPLY_COMMAND_ACKNOWLEDGE_2;
+    chk = data[8] ^ data[9];
+    for (i = 0; i < PS1CARD_FRAME_SIZE; i++)
+    {
+      chk = chk ^ data[10 + i];
+    }
+    if (chk == data[138])
+    {
+      memcpy(&simulated_card[frame_number*PS1CARD_FRAME_SIZE], &data[10], PS1CARD_FRAME_SIZE);
+      simulated_reply[141] = PS1CARD_REPLY_MEB_GOOD;
+    }
+    else
+    {
+      simulated_reply[141] = PS1CARD_REPLY_MEB_BAD_CHECKSUM;
+    }
+    simulated_reply_size = PS1CARD_WRITE_PACKET_SIZE;
+  }
+  else
+  {
+    simulated_reply[1] = RESPONSE_WRONG;
+    simulated_reply_size = 2;
+  }
+
+  return 0;
+
+}
+/* ------------------------------------------------------End of Simulated ps3mca---------------------------------------------------*/
+
+
+
+
+
+
+
+
+
+/* ----------------------------------------------------------------Metrics---------------------------------------------------------*/
+/* Counters of frames, errors, Memory End Bytes and latency, updated by every frame read or written (see frame_result_record)
+   and written in Prometheus text format by the daemon.*/
+void metrics_frame (int operation, uint16_t errors, uint8_t meb, uint32_t time)	/* operation 0 read, 1 write*/
+{
+
+  int e;
+  int b;
+
+  pthread_mutex_lock(&metrics_lock);
+  metrics.frames[operation]++;
+  for (e = 0; e < FRAME_ERRORS; e++)
+  {
+    if (errors & (1 << e))
+    {
+      metrics.frame_errors[operation][e]++;
+    }
+  }
+  if (!(errors & (FRAME_ERROR_SEND | FRAME_ERROR_NO_REPLY | FRAME_ERROR_SIZE | FRAME_ERROR_NO_CARD)))
+  {
+    metrics.meb[operation][meb]++;
+  }
+
+  b = 0;
+  while (b < METRICS_BUCKETS && time > METRICS_LATENCY_BUCKETS[b])
+  {
+    b++;
+  }
+  metrics.latency[operation][b]++;
+  metrics.latency_sum[operation] += time;
+  pthread_mutex_unlock(&metrics_lock);
+
+}
+
+void metrics_write (FILE *out)
+{
+
+  const char *operations[2] = { "read", "write" };
+  struct driver_metrics snapshot;
+  unsigned long long cumulative;
+  int o;
+  int e;
+  int b;
+  int m;
+
+  /* All the counters of the same moment, the histogram agree with its count*/
+  pthread_mutex_lock(&metrics_lock);
+  snapshot = metrics;
+  pthread_mutex_unlock(&metrics_lock);
+
+  fprintf(out, "# HELP ps3mca_frames_total Frames read or written.\n# TYPE ps3mca_frames_total counter\n");
+  for (o = 0; o < 2; o++)
+  {
+    fprintf(out, "ps3mca_frames_total{operation=\"%s\"} %llu\n", operations[o], snapshot.frames[o]);
+  }
+
+  fprintf(out, "# HELP ps3mca_frame_errors_total Frames with errors by error.\n# TYPE ps3mca_frame_errors_total counter\n");
+  for (o = 0; o < 2; o++)
+  {
+    for (e = 0; e < FRAME_ERRORS; e++)
+    {
+      fprintf(out, "ps3mca_frame_errors_total{operation=\"%s\",error=\"%s\"} %llu\n", operations[o], FRAME_ERROR_NAMES[e], snapshot.frame_errors[o][e]);
+    }
+  }
+
+  fprintf(out, "# HELP ps3mca_memory_end_byte_total Replies by Memory End Byte.\n# TYPE ps3mca_memory_end_byte_total counter\n");
+  for (o = 0; o < 2; o++)
+  {
+    for (m = 0; m < 256; m++)
+    {
+      if (snapshot.meb[o][m] > 0)
+      {
+        fprintf(out, "ps3mca_memory_end_byte_total{operation=\"%s\",code=\"%02x\"} %llu\n", operations[o], m, snapshot.meb[o][m]);
+      }
+    }
+  }
+
+  fprintf(out, "# HELP ps3mca_frame_latency_seconds Time of a frame read or write, without the writing delay.\n# TYPE ps3mca_frame_latency_seconds histogram\n");
+  for (o = 0; o < 2; o++)
+  {
+    cumulative = 0;
+    for (b = 0; b < METRICS_BUCKETS; b++)
+    {
+      cumulative += snapshot.latency[o][b];
+      fprintf(out, "ps3mca_frame_latency_seconds_bucket{operation=\"%s\",le=\"%g\"} %llu\n", operations[o], METRICS_LATENCY_BUCKETS[b] / 1000000.0, cumulative);
+    }
+    cumulative += snapshot.latency[o][METRICS_BUCKETS];
+    fprintf(out, "ps3mca_frame_latency_seconds_bucket{operation=\"%s\",le=\"+Inf\"} %llu\n", operations[o], cumulative);
+    fprintf(out, "ps3mca_frame_latency_seconds_sum{operation=\"%s\"} %.6f\n", operations[o], snapshot.latency_sum[o] / 1000000.0);
+    fprintf(out, "ps3mca_frame_latency_seconds_count{operation=\"%s\"} %llu\n", operations[o], cumulative);
+  }
+
+  fprintf(out, "# HELP ps3mca_bytes_total Bytes transferred with the ps3mca.\n# TYPE ps3mca_bytes_total counter\n");
+  fprintf(out, "ps3mca_bytes_total{direction=\"out\"} %llu\nps3mca_bytes_total{direction=\"in\"} %llu\n", snapshot.bytes_out, snapshot.bytes_in);
+  fprintf(out, "# HELP ps3mca_transfers_total USB bulk transfers.\n# TYPE ps3mca_transfers_total counter\nps3mca_transfers_total %llu\n", snapshot.transfers);
+  fprintf(out, "# HELP ps3mca_timeouts_total USB transfers without reply.\n# TYPE ps3mca_timeouts_total counter\nps3mca_timeouts_total %llu\n", snapshot.timeouts);
+  fprintf(out, "# HELP ps3mca_aborts_total Sessions aborted (dead card or ps3mca disconnected).\n# TYPE ps3mca_aborts_total counter\nps3mca_aborts_total %llu\n", snapshot.aborts);
+  fprintf(out, "# HELP ps3mca_auth_failures_total Replies with autentication failed (RESPONSE_WRONG).\n# TYPE ps3mca_auth_failures_total counter\nps3mca_auth_failures_total %llu\n", snapshot.auth_failures);
+  fprintf(out, "# HELP ps3mca_pacing_wait_seconds_total Time waited after the writes (writing delay).\n# TYPE ps3mca_pacing_wait_seconds_total counter\nps3mca_pacing_wait_seconds_total %.3f\n", snapshot.pacing_wait / 1000000.0);
+  fprintf(out, "# HELP ps3mca_round_trip_seconds Mean round-trip time of the session.\n# TYPE ps3mca_round_trip_seconds gauge\nps3mca_round_trip_seconds %.6f\n", snapshot.round_trip / 1000000.0);
+  fprintf(out, "# HELP ps3mca_writing_delay_seconds Writing delay in use.\n# TYPE ps3mca_writing_delay_seconds gauge\nps3mca_writing_delay_seconds %.3f\n", snapshot.writing_delay / 1000.0);
+  fprintf(out, "# HELP ps3mca_jobs_total Jobs done by the daemon.\n# TYPE ps3mca_jobs_total counter\n");
+  fprintf(out, "ps3mca_jobs_total{priority=\"normal\"} %llu\nps3mca_jobs_total{priority=\"urgent\"} %llu\n", snapshot.jobs[0], snapshot.jobs[1]);
+  fprintf(out, "# HELP ps3mca_jobs_queued Jobs waiting in the daemon.\n# TYPE ps3mca_jobs_queued gauge\nps3mca_jobs_queued %d\n", snapshot.jobs_queued);
+  fprintf(out, "# HELP ps3mca_preemptions_total Urgent jobs run between the frames of another job.\n# TYPE ps3mca_preemptions_total counter\nps3mca_preemptions_total %llu\n", snapshot.preemptions);
+  fprintf(out, "# HELP ps3mca_pipeline_stalls_total Frames read waiting for the sinks of the read pipeline.\n# TYPE ps3mca_pipeline_stalls_total counter\nps3mca_pipeline_stalls_total %llu\n", snapshot.pipeline_stalls);
+
+}
+/* ------------------------------------------------------------End of Metrics------------------------------------------------------*/
+
+
+
+
+
+
+
+
+
+/* --------------------------------------------------------------Frame results-----------------------------------------------------*/
+/* Every frame read or written by a command has a fixed size record, at the end of the command the failed frames make
+   the exit code not zero and, if PS3MCA_REPORT is set, a JSON line with the totals and the failed frames is appended
+   to the report file.*/
+struct frame_result
+{
+  uint16_t frame;
+  uint16_t errors;			/* FRAME_ERROR_* bits of the last attempt*/
+  uint8_t operation;			/* 'R' read, 'W' write, 0 frame not used*/
+  uint8_t status;			/* PS3mca status byte of the reply*/
+  uint8_t meb;				/* Memory End Byte of the reply*/
+  uint8_t attempts;			/* Attempts of the same operation on the frame*/
+  uint32_t time;			/* Time of the last attempt (microseconds)*/
+};
+
+struct frame_result frame_results[1024];
+
+void frame_results_reset()
+{
+  memset(frame_results, 0, sizeof(frame_results));
+}
+
+void frame_result_record(uint8_t operation, uint16_t frame_number, uint16_t errors, uint8_t status, uint8_t meb, long long start)
+{
+  struct frame_result *result;
+
+  if (frame_number > PS1CARD_MAX_FRAME)
+  {
+    return;
+  }
+
+  result = &frame_results[frame_number];
+  if (result->operation != operation)
+  {
+    result->attempts = 0;
+  }
+  result->frame = frame_number;
+  result->operation = operation;
+  result->errors = errors;
+  result->status = status;
+  result->meb = meb;
+  if (result->attempts < 0xff)
+  {
+    result->attempts++;
+  }
+  result->time = (uint32_t)(time_us() - start);
+
+  metrics_frame(operation == 'W', errors, meb, result->time);
+}
+
+int frame_results_failed()			/* Frames with errors in the last attempt*/
+{
+  int failed = 0;
+  int f;
+
+  for (f = PS1CARD_MIN_FRAME; f <= PS1CARD_MAX_FRAME; f++)
+  {
+    if (frame_results[f].operation != 0 && frame_results[f].errors != 0)
+    {
+      failed++;
+    }
+  }
+
+  return failed;
+}
+
+void report_json_string(FILE *report, const char *text)
+{
+  fputc('"', report);
+  for (; *text != '\0'; text++)
+  {
+    if (*text == '"' || *text == '\\')
+    {
+      fprintf(report, "\\%c", *text);
+    }
+    else if ((unsigned char)*text < 0x20)
+    {
+      fprintf(report, "\\u%04x", (unsigned char)*text);
+    }
+    else
+    {
+      fputc(*text, report);
+    }
+  }
+  fputc('"', report);
+}
+
+void report_write(int argc, char* argv[], int exit_code, long long elapsed)	/* Append the report of a command*/
+{
+  const char *filename = getenv(REPORT_VARIABLE);
+  FILE *report;
+  int used = 0;
+  int failed = 0;
+  int retries = 0;
+  int errors[FRAME_ERRORS];
+  uint32_t time_min = 0;
+  uint32_t time_max = 0;
+  uint64_t time_total = 0;
+  int first;
+  int f;
+  int e;
+
+  if (filename == NULL || *filename == '\0')
+  {
+    return;
+  }
+
+  report = fopen(filename, "a");
+  if (report == NULL)
+  {
+    fprintf(stderr, "Unable to write the report %s.\n", filename);
+    return;
+  }
+
+  memset(errors, 0, sizeof(errors));
+  for (f = PS1CARD_MIN_FRAME; f <= PS1CARD_MAX_FRAME; f++)
+  {
+    if (frame_results[f].operation == 0)
+    {
+      continue;
+    }
+    if (used == 0 || frame_results[f].time < time_min)
+    {
+      time_min = frame_results[f].time;
+    }
+    if (frame_results[f].time > time_max)
+    {
+      time_max = frame_results[f].time;
+    }
+    time_total += frame_results[f].time;
+    used++;
+    retries += frame_results[f].attempts - 1;
+    if (frame_results[f].errors != 0)
+    {
+      failed++;
+    }
+    for (e = 0; e < FRAME_ERRORS; e++)
+    {
+      if (frame_results[f].errors & (1 << e))
+      {
+        errors[e]++;
+      }
+    }
+  }
+
+  fprintf(report, "{\"command\":");
+  report_json_string(report, argc > 1 ? argv[1] : "");
+  fprintf(report, ",\"arguments\":[");
+  for (e = 2; e < argc; e++)
+  {
+    if (e > 2)
+    {
+      fputc(',', report);
+    }
+    report_json_string(report, argv[e]);
+  }
+  fprintf(report, "],\"exit_code\":%d,\"aborted\":%d,\"time_us\":%lld", exit_code, ps3mca_aborted, elapsed);
+  fprintf(report, ",\"frames\":%d,\"good\":%d,\"failed\":%d,\"retries\":%d", used, used - failed, failed, retries);
+  fprintf(report, ",\"frame_time_us\":{\"min\":%u,\"average\":%u,\"max\":%u}", time_min, used ? (uint32_t)(time_total/used) : 0, time_max);
+
+  fprintf(report, ",\"errors\":{");
+  for (e = 0; e < FRAME_ERRORS; e++)
+  {
+    fprintf(report, "%s\"%s\":%d", e ? "," : "", FRAME_ERROR_NAMES[e], errors[e]);
+  }
+
+  fprintf(report, "},\"failed_frames\":[");
+  first = 1;
+  for (f = PS1CARD_MIN_FRAME; f <= PS1CARD_MAX_FRAME; f++)
+  {
+    if (frame_results[f].operation == 0 || frame_results[f].errors == 0)
+    {
+      continue;
+    }
+    fprintf(report, "%s{\"frame\":%d,\"operation\":\"%s\",\"errors\":[", first ? "" : ",", f, frame_results[f].operation == 'W' ? "write" : "read");
+    first = 0;
+    for (e = 0, used = 0; e < FRAME_ERRORS; e++)
+    {
+      if (frame_results[f].errors & (1 << e))
+      {
+        fprintf(report, "%s\"%s\"", used++ ? "," : "", FRAME_ERROR_NAMES[e]);
+      }
+    }
+    fprintf(report, "],\"status\":%d,\"meb\":%d,\"attempts\":%d,\"time_us\":%u}", frame_results[f].status, frame_results[f].meb, frame_results[f].attempts, frame_results[f].time);
+  }
+  fprintf(report, "]}\n");
+
+  fclose(report);
+}
+/* ----------------------------------------------------------End of Frame results--------------------------------------------------*/
+
+
+
+
+
+
+
+
+
+/* ---------------------------------------------------------------Progress---------------------------------------------------------*/
+/* With the environment variable PS3MCA_PROGRESS_FD=n the long commands write their progress on the file descriptor n,
+   a line every PROGRESS_INTERVAL milliseconds and one at the end:
+   "op=read done=512 total=1024 fps=190.5 eta_ms=2687 errors=0" (at the end also "result=ok|failed").
+   fps is the speed since the previous line, eta_ms use the mean speed of the command. The descriptor is non-blocking,
+   if the reader is slow the lines are dropped, so the frame loops never wait the frontend.*/
+struct progress_state
+{
+  const char *operation;
+  int total;				/* Frames of the command*/
+  int done;
+  int last_done;			/* Frames done at the previous line*/
+  long long start;
+  long long last;			/* time_us() of the previous line*/
+};
+
+int progress_fd = -2;			/* -1 without progress, -2 if PS3MCA_PROGRESS_FD isn't read yet*/
+int progress_fd_flags;			/* Flags of progress_fd before O_NONBLOCK, restored at exit*/
+unsigned long progress_dropped = 0;	/* Lines not written (reader too slow)*/
+struct progress_state progress;
+
+void progress_write (const char *result)
+{
+
+  char line[200];
+  long long now = time_us();
+  long long elapsed = now - progress.start;
+  long long interval = now - progress.last;
+  double fps = interval > 0 ? (progress.done - progress.last_done) * 1000000.0 / interval : 0;
+  long long eta = progress.done > 0 ? elapsed * (progress.total - progress.done) / progress.done / 1000 : -1;
+  int size;
+
+  size = snprintf(line, sizeof(line), "op=%s done=%d total=%d fps=%.1f eta_ms=%lld errors=%d%s%s\n", progress.operation, progress.done, progress.total, fps, eta, frame_results_failed(), result != NULL ? " result=" : "", result != NULL ? result : "");
+
+  /* Short lines are written all or nothing (pipes), else the line is dropped*/
+  if (write(progress_fd, line, size) != size)
+  {
+    progress_dropped++;
+  }
+  progress.last = now;
+  progress.last_done = progress.done;
+
+}
+
+/* The file description can be shared with the parent (like 3>&1), it is blocking again at exit*/
+void progress_restore ()
+{
+  fcntl(progress_fd, F_SETFL, progress_fd_flags);
+}
+
+/* Start the progress of a command with total frames*/
+void progress_begin (const char *operation, int total)
+{
+
+  const char *variable;
+  int flags;
+
+  if (progress_fd == -2)
+  {
+    progress_fd = -1;
+    variable = getenv(PROGRESS_VARIABLE);
+    if (variable != NULL && variable[0] != '\0')
+    {
+      flags = fcntl(atoi(variable), F_GETFL);
+      if (flags < 0)
+      {
+        fprintf(stderr, "%s=%s isn't an open file descriptor.\n", PROGRESS_VARIABLE, variable);
+      }
+      else
+      {
+        progress_fd = atoi(variable);
+        progress_fd_flags = flags;
+        fcntl(progress_fd, F_SETFL, flags | O_NONBLOCK);
+        atexit(progress_restore);
+      }
+    }
+  }
+
+  progress.operation = operation;
+  progress.total = total;
+  progress.done = 0;
+  progress.last_done = 0;
+  progress.start = progress.last = time_us();
+
+}
+
+/* Called after every frame, write a line only every PROGRESS_INTERVAL milliseconds*/
+void progress_update (int done)
+{
+
+  if (progress_fd < 0)
+  {
+    return;
+  }
+
+  progress.done = done;
+  if (time_us() - progress.last >= PROGRESS_INTERVAL*1000LL)
+  {
+    progress_write(NULL);
+  }
+
+}
+
+/* result 0 if good, also the frames with errors make the command fail (as the exit code of run_command)*/
+void progress_end (int done, int result)
+{
+
+  if (progress_fd < 0)
+  {
+    return;
+  }
+
+  progress.done = done;
+  progress_write(result == 0 && frame_results_failed() == 0 ? "ok" : "failed");
+
+}
+/* -----------------------------------------------------------End of Progress------------------------------------------------------*/
+
+
+
+
+
+
+
+
+
+/* -------------------------------------------------------PS1 command read----------------------------------------------------------*/
+/* Command for read every single frame*/
+/* Reading Data from Memory Card
+   Send Reply Comment
+   81h  N/A   Memory Card Access (unlike 01h=Controller access), dummy response
+   52h  FLAG  Send Read Command (ASCII "R"), Receive FLAG Byte
+   00h  5Ah   Receive Memory Card ID1
+   00h  5Dh   Receive Memory Card ID2
+   MSB  (00h) Send Address MSB  ;\frame number (0..3FFh)
+   LSB  (pre) Send Address LSB  ;/
+   00h  5Ch   Receive Command Acknowledge 1  ;<-- late /ACK after this byte-pair
+   00h  5Dh   Receive Command Acknowledge 2
+   00h  MSB   Receive Confirmed Address MSB
+   00h  LSB   Receive Confirmed Address LSB
+   00h  ...   Receive Data Frame (128 bytes)
+   00h  CHK   Receive Checksum (MSB xor LSB xor Data bytes)
+   00h  47h   Receive Memory End Byte (should be always 47h="G"=Good for Read)
+*/
+int PS1_read_frame (uint16_t frame_number, uint8_t *data)
+{
+
+  uint8_t *cmd_read;
+  int frame_status = 0;					/* 0 good frame, 1 frame received with errors, -1 frame not received*/
+  uint16_t errors = 0;					/* FRAME_ERROR_* bits for the frame result*/
+  long long start = time_us();
+
+  if (ps3mca_aborted)
+  {
+    frame_result_record('R', frame_number, FRAME_ERROR_NO_REPLY, 0, 0, start);
+    return -1;
+  }
+
+  /* Known PS1 card (no round trip), asked again only after an autentication failure*/
+  if (ps3mca_card_type() != RESPONSE_PS1_CARD)
+  {
+    fprintf(stderr, "There isn't a PS1 memory card in the ps3mca, frame %d not read.\n", frame_number);
+    frame_result_record('R', frame_number, FRAME_ERROR_NO_CARD, 0, 0, start);
+    return -1;
+  }
+
+  /* Split frame value in two*/
+  msb = (uint8_t)((frame_number & 0xFF00) >> 8);
+  lsb = (uint8_t)(frame_number & 0x00FF);
+  /* Read packet from the template, only frame value change*/
+  cmd_read = packet_read_build(frame_number);
+  /* Send 0x00 134 times (2 Command Acknowledge + 2 Confirmed Address + 128 Data Frame + 1 Checksum + 1 Memory End Byte)*/
+
+
+  
+  /* Send the message to endpoint with the adaptive timeout. */
+  res = ps3mca_bulk_transfer(BULK_WRITE_ENDPOINT, cmd_read, PS1CARD_READ_PACKET_SIZE);
+  if (res == 0)
+  {
+    /* See on screen what is transmitted for debug purpose*/
+    #if DEBUG
+    printf("\n%d bytes transmitted successfully on frame %d:\n", numBytes, frame_number);
+    printf("Send:\n");
+    printf("%x \n", cmd_read[0]);
+    printf("%x \n", cmd_read[1]);
+    printf("%x \n", cmd_read[2]);
+    printf("%x \n", cmd_read[3]);
+    printf("%x \n", cmd_read[4]);
+    printf("%x \n", cmd_read[5]);
+    printf("%x \n", cmd_read[6]);
+    printf("%x \n", cmd_read[7]);
+    printf("%x \n", cmd_read[8]);
+    printf("%x \n", cmd_read[9]);
+    printf("%x \n", cmd_read[10]);
+    printf("%x \n", cmd_read[11]);
+    printf("%x \n", cmd_read[12]);
+    printf("%x \n", cmd_read[13]);
+    printf("%x \n", cmd_read[142]);
+    printf("%x \n", cmd_read[143]);
+    printf("\n");
+    #endif
+  }
+  else
+  {
+    fprintf(stderr, "Error sending message to device.\n");
+    errors |= FRAME_ERROR_SEND;
+  }
+
+  /* Clean buffer.*/
+  memset(ps1_ram_buffer, 0, sizeof(ps1_ram_buffer));
+
+  /* Listen for a message.*/
+  /* Wait up to the adaptive timeout (max 5 seconds) for a message to arrive on endpoint*/
+  res = ps3mca_bulk_transfer(BULK_READ_ENDPOINT, ps1_ram_buffer, sizeof(ps1_ram_buffer));
+  if (0 == res)
+  {
+    if (numBytes <= sizeof(ps1_ram_buffer))
+    {
+        /* Verify if PS3mca send status succes code*/
+        if (ps1_ram_buffer[0] == RESPONSE_CODE & ps1_ram_buffer[1] == RESPONSE_STATUS_SUCCES)
+        {
+	  #if DEBUG
+          printf("Autentication verified on frame %d.\n", frame_number);
+          #endif
+	  #if VERBOSE
+	  printf("Reading frame %d.\n", frame_number);
+	  #endif
+        }
+
+        /* Verify if PS3mca send status wrong code*/
+        else if (ps1_ram_buffer[0] == RESPONSE_CODE & ps1_ram_buffer[1] == RESPONSE_WRONG)    
+        {
+          fprintf(stderr, "Autentication failed on frame %d.\n", frame_number);
+          errors |= FRAME_ERROR_AUTH;
+          metrics_count(&metrics.auth_failures, 1);
+          card_cache_invalidate();
+          frame_status = 1;
+        }
+
+        /* Other unknown PS3mca error*/
+        else   
+        {
+          fprintf(stderr, "Unknown error on PS3mca protocol on frame %d.\n", frame_number);
+          errors |= FRAME_ERROR_PROTOCOL;
+          frame_status = 1;
+        }
+
+        /* Verify command acknowledge*/
+        if (ps1_ram_buffer[10] == PS1CARD_REPLY_COMMAND_ACKNOWLEDGE_1 & ps1_ram_buffer[11] == PS1CARD_REPLY_COMMAND_ACKNOWLEDGE_2)
+        {
+	  #if DEBUG
+          printf("Good command acknowledge on frame %d.\n", frame_number);
+          #endif
+        }
+
+        /* Unknown command acknowledge error*/
+        else   
+        {
+          fprintf(stderr, "Unknown command acknowledge error on frame %d.\n", frame_number);
+          errors |= FRAME_ERROR_ACK;
+          frame_status = 1;
+        }
+
+        /* Verify msb and lsb*/
+        if (ps1_ram_buffer[12] == msb & ps1_ram_buffer[13] == lsb)
+        {
+	  #if DEBUG
+          printf("Confirmed frame number on frame %d.\n", frame_number);
+          #endif
+        }
+
+        /* Unknown frame error*/
+        else   
+        {
+          fprintf(stderr, "Unknown frame number error on frame %d.\n", frame_number);
+          fprintf(stderr, "Return frame number %d %d.\n\n", ps1_ram_buffer[12], ps1_ram_buffer[13]);
+          errors |= FRAME_ERROR_ADDRESS;
+          frame_status = 1;
+        }
+
+	/* This permit to select and save only the received Data Frame (PS1CARD_FRAME_SIZE=128 bytes).*/
+	/* First 14 bytes are about PS3mca (4 bytes) and PS1 (10 bytes) protocol.*/
+	/* Last 2 bytes are Checksum & Memory End Byte.*/
+	memcpy(data, &ps1_ram_buffer[14], PS1CARD_FRAME_SIZE);
+
+	/* Clean checksum.*/
+	checksum = 0x00;
+
+	/* Calc supposed checksum.*/
+	for (c = 12; c < 12+2+PS1CARD_FRAME_SIZE; c++)		/* Loop of msb + lsb + all data bytes*/
+	{
+	checksum = checksum ^ ps1_ram_buffer[c];		/* Checksum = MSB xor LSB xor all Data bytes*/
+	}
+
+        /* Verify checksum*/
+        if (ps1_ram_buffer[142] == checksum)
+        {
+	#if DEBUG
+	printf("Good checksum on frame %d.\n", frame_number);
+        #endif
+        }
+
+        /* Checksum error*/
+        else   
+        {
+          fprintf(stderr, "Incorrect checksum on frame %d.\n", frame_number);
+          fprintf(stderr, "Received %x, should be %x.\n\n", ps1_ram_buffer[142], checksum);
+          errors |= FRAME_ERROR_CHECKSUM;
+          frame_status = 1;
+        }
+
+
+        /* Verify MEB*/
+        if (ps1_ram_buffer[143] == PS1CARD_REPLY_MEB_GOOD)
+        {
+	#if DEBUG
+	printf("Good Memory End Byte on frame %d.\n", frame_number);
+        #endif
+        }
+
+        /* Other unknown MEB error*/
+        else   
+        {
+          fprintf(stderr, "Unknown Memory End Byte on frame %d.\n", frame_number);
+          fprintf(stderr, "Received %x, should be 47.\n\n", ps1_ram_buffer[143]);
+          errors |= FRAME_ERROR_MEB;
+          frame_status = 1;
+        }
+
+
+    }
+    else
+    {
+      fprintf(stderr, "Received %d bytes, expected a maximum of %lu bytes on frame %d.\n", numBytes, sizeof(ps1_ram_buffer), frame_number);
+      errors |= FRAME_ERROR_SIZE;
+      frame_status = -1;
+    }
+  }
+
+
+  else
+  {
+    fprintf(stderr, "Error receiving message.\n");
+    errors |= FRAME_ERROR_NO_REPLY;
+    frame_status = -1;
+  }
+
+  frame_result_record('R', frame_number, errors, ps1_ram_buffer[1], ps1_ram_buffer[143], start);
+  return frame_status;
+
+}
+
+void output_filename (char *filename, const char *extension)
+{
+
+  // get the timestamp for file saving.
+  time_t t = time(NULL);
+  struct tm tm = *localtime(&t);
+  sprintf(filename, "memory_card_out_%d-%02d-%02d_%02d-%02d-%02d.%s", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, extension);
+
+}
+
+/* Read all the card in filename (format from the extension), without filename in memory_card_out_<timestamp>.mcd.
+   The frames go to the image (and the other sinks) through the read pipeline, beside the next USB transfers.*/
+int PS1_read (const char *filename)
+{
+
+  char default_filename[70];
+  struct read_pipeline *pipeline;
+  uint8_t *direct = NULL;
+  uint8_t *data_frame;
+  void *mapping;
+  int format;
+  int frame_status;
+  int saved;
+  int sinks_good;
+
+  if (filename == NULL)
+  {
+    output_filename(default_filename, "mcd");
+    filename = default_filename;
+  }
+
+  FILE *output = image_open_write(filename, &format);
+  if (output == NULL)
+  {
+    return 1;
+  }
+
+  if (open_ps1_card() != 0)
+  {
+    fclose(output);
+    return 1;
+  }
+  load_card_profile();
+
+  /* Image in shared memory, the frames arrive directly in the mapped image*/
+  if (format == IMAGE_FORMAT_SHM)
+  {
+    direct = shm_image_map(output, 1, &mapping);
+  }
+
+  pipeline = pipeline_start(direct != NULL ? NULL : output);
+  if (pipeline == NULL)
+  {
+    if (direct != NULL)
+    {
+      munmap(mapping, (PS1CARD_MAX_FRAME+1)*PS1CARD_FRAME_SIZE);
+    }
+    image_close_write(output, format, 0);
+    close_ps3mca();
+    return 1;
+  }
+  progress_begin("read", PS1CARD_MAX_FRAME - PS1CARD_MIN_FRAME + 1);
+
+  /* Start of frame to frame loop*/
+  for (frame = PS1CARD_MIN_FRAME; frame <= PS1CARD_MAX_FRAME && !ps3mca_aborted; frame++)
+  {
+    data_frame = direct != NULL ? &direct[(frame - PS1CARD_MIN_FRAME)*PS1CARD_FRAME_SIZE] : pipeline_slot(pipeline);
+    frame_status = PS1_read_frame(frame, data_frame);
+    /* A frame not arrived in the mapped image is empty, not the frame of the previous image of the slot*/
+    if (frame_status < 0 && direct != NULL)
+    {
+      memset(data_frame, 0, PS1CARD_FRAME_SIZE);
+    }
+    pipeline_push(pipeline, frame, data_frame, frame_status);
+    progress_update(frame - PS1CARD_MIN_FRAME + 1);
+    scheduler_preempt();
+  }
+
+  /* The sinks end the frames in the queue, the write errors of the image are in its FILE*/
+  sinks_good = pipeline_finish(pipeline, !ps3mca_aborted) == 0;
+
+  if (direct != NULL)
+  {
+    munmap(mapping, (PS1CARD_MAX_FRAME+1)*PS1CARD_FRAME_SIZE);
+  }
+
+  /* Clean and close the file output, a library add the image only if it is complete*/
+  saved = image_close_write(output, format, !ps3mca_aborted) == 0;
+  progress_end(frame - PS1CARD_MIN_FRAME, ps3mca_aborted || !saved || !sinks_good);
+
+  /* Unmount the ps3mca*/
+  close_ps3mca();
+
+  if (ps3mca_aborted)
+  {
+    fprintf(stderr, "Reading aborted at frame %d, %s is incomplete.\n", frame - 1, filename);
+    return 1;
+  }
+  if (!saved)
+  {
+    fprintf(stderr, "Unable to save %s.\n", filename);
+    return 1;
+  }
+
+  /* Image saved, but a sink failed (see stderr)*/
+  return !sinks_good;
+
+}
+/* ----------------------------------------------------End of PS1 command read------------------------------------------------------*/
+
+
+
+
+
+
+
+
+/* -------------------------------------------------------PS1 command write----------------------------------------------------------*/
+/* Command for start writing every single frame*/
+/* Writing Data to Memory Card
+   Send Reply Comment
+   81h  N/A   Memory Card Access (unlike 01h=Controller access), dummy response
+   57h  FLAG  Send Write Command (ASCII "W"), Receive FLAG Byte
+   00h  5Ah   Receive Memory Card ID1
+   00h  5Dh   Receive Memory Card ID2
+   MSB  (00h) Send Address MSB  ;\frame number (0..3FFh)
+   LSB  (pre) Send Address LSB  ;/
+   ...  (pre) Send Data Sector (128 bytes)
+   CHK  (pre) Send Checksum (MSB xor LSB xor Data bytes)
+   00h  5Ch   Receive Command Acknowledge 1
+   00h  5Dh   Receive Command Acknowledge 2
+   00h  4xh   Receive Memory End Byte (47h=Good, 4Eh=BadChecksum, FFh=BadSector)
+*/
+/* Send a write packet (see packet_write_build), return 0 good frame, 1 frame refused or with errors, -1 no reply,
+   -2 write rejected by PocketStation (abort)*/
+int PS1_write_packet (uint8_t *cmd_write)
+{
+
+  uint16_t frame_number = (uint16_t)((cmd_write[8] << 8) | cmd_write[9]);
+  int frame_status = 0;
+  uint16_t errors = 0;					/* FRAME_ERROR_* bits for the frame result*/
+  long long start = time_us();
+
+  if (ps3mca_aborted)
+  {
+    frame_result_record('W', frame_number, FRAME_ERROR_NO_REPLY, 0, 0, start);
+    return -1;
+  }
+
+  /* Known PS1 card (no round trip), asked again only after an autentication failure*/
+  if (ps3mca_card_type() != RESPONSE_PS1_CARD)
+  {
+    fprintf(stderr, "There isn't a PS1 memory card in the ps3mca, frame %d not written.\n", frame_number);
+    frame_result_record('W', frame_number, FRAME_ERROR_NO_CARD, 0, 0, start);
+    return -1;
+  }
+
+  /* Split frame value in two*/
+  msb = cmd_write[8];
+  lsb = cmd_write[9];
+
+
+  
+  /* Send the message to endpoint with the adaptive timeout. */
+  res = ps3mca_bulk_transfer(BULK_WRITE_ENDPOINT, cmd_write, PS1CARD_WRITE_PACKET_SIZE);
+  if (res == 0)
+  {
+    /* See on screen what is transmitted for debug purpose*/
+    #if DEBUG
+    printf("%d bytes transmitted successfully  on frame %d.\n", numBytes, frame_number);
+    printf("Send:\n");
+    printf("%x \n", cmd_write[0]);
+    printf("%x \n", cmd_write[1]);
+    printf("%x \n", cmd_write[2]);
+    printf("%x \n", cmd_write[3]);
+    printf("%x \n", cmd_write[4]);
+    printf("%x \n", cmd_write[5]);
+    printf("%x \n", cmd_write[6]);
+    printf("%x \n", cmd_write[7]);
+    printf("%x \n", cmd_write[8]);
+    printf("%x \n", cmd_write[9]);
+    printf("%x \n", cmd_write[10]);
+    printf("%x \n", cmd_write[11]);
+    printf("%x \n", cmd_write[12]);
+    printf("%x \n", cmd_write[13]);
+    printf("%x \n", cmd_write[14]);
+    printf("%x \n", cmd_write[15]);
+    printf("%x \n", cmd_write[16]);
+    printf("%x \n", cmd_write[17]);
+    printf("%x \n", cmd_write[18]);
+    printf("%x \n", cmd_write[19]);
+    printf("%x \n", cmd_write[20]);
+    printf("%x \n", cmd_write[21]);
+    printf("%x \n", cmd_write[22]);
+    printf("%x \n", cmd_write[23]);
+    printf("%x \n", cmd_write[24]);
+    printf("%x \n", cmd_write[25]);
+    printf("%x \n", cmd_write[26]);
+    printf("%x \n", cmd_write[27]);
+    printf("%x \n", cmd_write[28]);
+    printf("%x \n", cmd_write[29]);
+    printf("%x \n", cmd_write[30]);
+    printf("%x \n", cmd_write[31]);
+    printf("%x \n", cmd_write[32]);
+    printf("%x \n", cmd_write[33]);
+    printf("%x \n", cmd_write[34]);
+    printf("%x \n", cmd_write[35]);
+    printf("%x \n", cmd_write[36]);
     printf("%x \n", cmd_write[37]);
     printf("%x \n", cmd_write[38]);
     printf("%x \n", cmd_write[39]);
@@ -895,133 +2316,5798 @@ int PS1_write ()
     printf("%x \n", cmd_write[141]);
     #endif
 
-    #if VERBOSE
-    printf("Writing frame %d.\n", frame);
-    #endif
+    #if VERBOSE
+    printf("Writing frame %d.\n", frame_number);
+    #endif
+  }
+  else
+  {
+    fprintf(stderr, "Error sending message to device.\n");
+    errors |= FRAME_ERROR_SEND;
+  }
+
+
+  /* Listen for a message.*/
+  /* Wait up to the adaptive timeout (max 5 seconds) for a message to arrive on endpoint*/
+  res = ps3mca_bulk_transfer(BULK_READ_ENDPOINT, ps1_ram_buffer, sizeof(ps1_ram_buffer));
+  if (0 == res)
+  {
+    if (numBytes <= sizeof(ps1_ram_buffer))
+    {
+        /* Verify if PS3mca send status succes code*/
+        if (ps1_ram_buffer[0] == RESPONSE_CODE & ps1_ram_buffer[1] == RESPONSE_STATUS_SUCCES)
+        {
+	  #if DEBUG
+          printf("Autentication verified on frame %d.\n", frame_number);
+          #endif
+        } 
+
+        /* Verify if PS3mca send status wrong code*/
+        else if (ps1_ram_buffer[0] == RESPONSE_CODE & ps1_ram_buffer[1] == RESPONSE_WRONG)    
+        {
+          fprintf(stderr, "Autentication failed on frame %d.\n", frame_number);
+          errors |= FRAME_ERROR_AUTH;
+          metrics_count(&metrics.auth_failures, 1);
+          card_cache_invalidate();
+          frame_status = 1;
+        }
+
+        /* Other unknown PS3mca error*/
+        else   
+        {
+          fprintf(stderr, "Unknown error on PS3mca protocol on frame %d.\n", frame_number);
+          errors |= FRAME_ERROR_PROTOCOL;
+          frame_status = 1;
+        }
+
+
+        /* Verify Memory End Byte (0x47h=Good)*/
+        if (ps1_ram_buffer[141] == PS1CARD_REPLY_MEB_GOOD)
+        {
+	  #if DEBUG
+          printf("Good Memory End Byte on frame %d.\n", frame_number);
+          #endif
+        }
+ 
+        /* Verify Memory End Byte (0x4E=BadChecksum)*/
+        else if (ps1_ram_buffer[141] == PS1CARD_REPLY_MEB_BAD_CHECKSUM)
+        {
+          fprintf(stderr, "Bad Checksum Memory End Byte on frame %d.\n", frame_number);
+          errors |= FRAME_ERROR_MEB | FRAME_ERROR_CHECKSUM;
+          frame_status = 1;
+
+	  checksum = 0x00;					/* Clean checksum*/
+	  for (c = 8; c < 8+2+PS1CARD_FRAME_SIZE; c++)		/* Loop started at msb(8) and finished at last data byte(137)*/
+		{
+		  checksum = checksum ^ cmd_write[c];		/* Checksum = MSB xor LSB xor all Data bytes*/
+		}
+	  fprintf(stderr, "Sent checksum %x, should be %x.\n", cmd_write[138], checksum);
+        }
+ 
+        /* Verify Memory End Byte (0xFF=BadFrame)*/
+        else if (ps1_ram_buffer[141] == PS1CARD_REPLY_MEB_BAD_FRAME)
+        {
+          fprintf(stderr, "Bad frame Memory End Byte on frame %d.\n", frame_number);
+          errors |= FRAME_ERROR_MEB;
+          frame_status = 1;
+        }
+
+	/* Verify Memory End Byte (0xFD=Reject write to Directory Entries of currently executed file)*/
+        else if (ps1_ram_buffer[141] == POCKETSTATION_REPLY_REJECT_EXECUTED)
+        {
+          fprintf(stderr, "WARNING Reject write to Directory Entries of currently executed file on frame %d.\n", frame_number);
+          fprintf(stderr, "aborting for prevent to delete the currently executed file.\n");
+	  errors |= FRAME_ERROR_REJECTED;
+	  frame_status = -2;
+        }
+
+	/* Verify Memory End Byte (0xFE=Reject write to write-protected Broken Frame region)*/
+        else if (ps1_ram_buffer[141] == POCKETSTATION_REPLY_REJECT_PROTECTED)
+        {
+          fprintf(stderr, "WARNING The write-protection is enabled by ComFlags.bit10 on frame %d.\n", frame_number);
+          fprintf(stderr, "Please unable write protection.\nAborting...\n");
+	  errors |= FRAME_ERROR_REJECTED;
+	  frame_status = -2;
+        }
+
+	/* Other unknown MEB error*/
+        else
+        {
+          fprintf(stderr, "Unknown Memory End Byte on frame %d.\n", frame_number);
+          fprintf(stderr, "Received %x, should be 47.\n\n", ps1_ram_buffer[141]);
+          errors |= FRAME_ERROR_MEB;
+          frame_status = 1;
+        }
+
+    }
+    else
+    {
+      fprintf(stderr, "Received %d bytes, expected a maximum of %lu  on frame %d.\n", numBytes, sizeof(ps1_ram_buffer), frame_number);
+      errors |= FRAME_ERROR_SIZE;
+      frame_status = -1;
+    }
+  }
+  else
+  {
+    errors |= FRAME_ERROR_NO_REPLY;
+    frame_status = -1;
+  }
+
+  frame_result_record('W', frame_number, errors, ps1_ram_buffer[1], ps1_ram_buffer[141], start);
+
+
+  /* Wait for give time to write, on original card (slower) this time is important.*/
+  /* This time can make slower the writing data, if it's possible can be better implement directly the clock.*/
+  //sleep(1);
+  delay(writing_delay);
+  pthread_mutex_lock(&metrics_lock);
+  metrics.pacing_wait += writing_delay*1000;
+  metrics.writing_delay = writing_delay;
+  pthread_mutex_unlock(&metrics_lock);
+  #if DEBUG
+  printf("Wait %dms for write the frame.\n\n", writing_delay);
+  #endif
+
+
+  /* Clean buffer.*/
+  memset(ps1_ram_buffer, 0, sizeof(ps1_ram_buffer));
+
+  return frame_status;
+
+}
+
+/* Write one frame, return as PS1_write_packet*/
+int PS1_write_frame (uint16_t frame_number, const uint8_t *data)
+{
+
+  uint8_t cmd_write[142];
+
+  packet_write_build(cmd_write, frame_number, data);
+  return PS1_write_packet(cmd_write);
+
+}
+
+/* Write the frames first_frame to last_frame of the image filename (raw, VgsM or PSX)*/
+int PS1_write (const char *filename)
+{
+
+  uint8_t *frames;
+  uint8_t *packets;
+  uint16_t *order;
+  void *mapping;
+  int count;
+  int format;
+  uint8_t *checked = NULL;				/* Image checked before the write*/
+  int frame_status = 0;
+  int i;
+
+  /* Verify first frame and last frame value, if impossible overwrite it*/
+  if (!((first_frame >= PS1CARD_MIN_FRAME) && (first_frame <= PS1CARD_MAX_FRAME) && (last_frame >= PS1CARD_MIN_FRAME) && (last_frame <= PS1CARD_MAX_FRAME) && (first_frame <= last_frame)))
+	{
+	fprintf(stderr, "Error on number of sector, possible values are 0 to 1023.\n");
+	fprintf(stderr, "First frame must be minor or equal of last frame.\n");
+	fprintf(stderr, "Overwrite the frame sector by selecting all the memory card.\n");
+	fprintf(stderr, "The original first_frame was %d, overwrited to 0\n", first_frame);
+	fprintf(stderr, "The original last_frame was %d, overwrited to 1023\n", last_frame);
+	first_frame = PS1CARD_MIN_FRAME;
+	last_frame = PS1CARD_MAX_FRAME;
+	}
+
+  /* Header, directory and broken frame list must be good before writing them (after the check of the range, it can
+     become all the card). The packets are built from the checked image, not from the file read again.*/
+  if (first_frame <= PS1CARD_BROKEN_LAST_FRAME)
+  {
+    checked = malloc((PS1CARD_MAX_FRAME+1)*PS1CARD_FRAME_SIZE);
+    if (checked == NULL || image_check_before_write(filename, checked) != 0)
+    {
+      free(checked);
+      return 1;
+    }
+  }
+
+  FILE *input = NULL;
+  if (checked == NULL)
+  {
+    input = image_open_read(filename, &format);
+    if (input == NULL)
+    {
+      return 1;
+    }
+  }
+
+  if (open_ps1_card() != 0)
+  {
+    if (input != NULL)
+    {
+      fclose(input);
+    }
+    free(checked);
+    return 1;
+  }
+  load_card_profile();
+
+  /* Read all the frames, then build all the packets in one pass before sending the first*/
+  count = last_frame - first_frame + 1;
+  frames = calloc(count, PS1CARD_FRAME_SIZE);
+  packets = malloc(count*PS1CARD_WRITE_PACKET_SIZE);
+  order = malloc(count*sizeof(uint16_t));
+  if (frames == NULL || packets == NULL || order == NULL)
+  {
+    fprintf(stderr, "Out of memory.\n");
+    free(frames);
+    free(packets);
+    free(order);
+    free(checked);
+    if (input != NULL)
+    {
+      fclose(input);
+    }
+    close_ps3mca();
+    return 1;
+  }
+  if (checked != NULL)
+  {
+    packet_write_build_range(packets, first_frame, last_frame, &checked[first_frame*PS1CARD_FRAME_SIZE]);
+  }
+  /* Image in shared memory, the packets are built directly from the mapped image*/
+  else if (format == IMAGE_FORMAT_SHM && shm_image_map(input, 0, &mapping) != NULL)
+  {
+    packet_write_build_range(packets, first_frame, last_frame, (uint8_t *)mapping + first_frame*PS1CARD_FRAME_SIZE);
+    munmap(mapping, (PS1CARD_MAX_FRAME+1)*PS1CARD_FRAME_SIZE);
+  }
+  else
+  {
+    fseek ( input, first_frame*PS1CARD_FRAME_SIZE, SEEK_CUR);	/* Read the file since frame value, needed for start on frame different to 0*/
+    fread ( frames, PS1CARD_FRAME_SIZE, count, input);	/* Data Sectors (128 bytes each)*/
+    packet_write_build_range(packets, first_frame, last_frame, frames);
+  }
+  free(frames);
+  free(checked);
+
+  /* Clean and close the file input*/
+  if (input != NULL)
+  {
+    fclose(input);
+  }
+
+  /* Data blocks before directory, original frames in the undo journal*/
+  write_order(order, first_frame, last_frame, NULL);
+  if (journal_begin(order, count, packets + PS1CARD_WRITE_PACKET_DATA, first_frame, PS1CARD_WRITE_PACKET_SIZE) != 0)
+  {
+    free(packets);
+    free(order);
+    close_ps3mca();
+    return 1;
+  }
+  progress_begin("write", count);
+
+  /* Start of frame to frame loop*/
+  for (i = 0; i < count && !ps3mca_aborted; i++)
+  {
+  frame = order[i];
+  journal_mark(i);
+
+  /* PocketStation reject, abort*/
+  frame_status = PS1_write_packet(&packets[(frame - first_frame)*PS1CARD_WRITE_PACKET_SIZE]);
+  if (frame_status == -2)
+  {
+	  i++;
+	  break;
+  }
+  progress_update(i + 1);
+  scheduler_preempt();
+
+  /* End of frame to frame loop*/
+  }
+
+  free(packets);
+  free(order);
+  progress_end(i, ps3mca_aborted || frame_status == -2);
+  journal_end(!ps3mca_aborted && frame_status != -2 && frame_results_failed() == 0, i);
+
+  /* Unmount the ps3mca*/
+  close_ps3mca();
+
+  /* Close program with error status*/
+  if (frame_status == -2)
+  {
+    return -1;
+  }
+  if (ps3mca_aborted)
+  {
+    fprintf(stderr, "Writing aborted at frame %d.\n", frame);
+    return 1;
+  }
+
+  return 0;
+
+}
+/* ----------------------------------------------------End of PS1 command write------------------------------------------------------*/
+
+
+
+
+
+
+
+
+
+/* ----------------------------------------------------------Memory card images----------------------------------------------------*/
+/* Load of raw images and delta images (see Delta images) and common helpers for images.*/
+uint8_t card_image[131072];				/* Whole memory card in RAM (1024x128 bytes)*/
+uint8_t baseline_image[131072];				/* Baseline image for delta (1024x128 bytes)*/
+
+/* FNV-1a 32 bit hash, start with hash=0x811c9dc5*/
+uint32_t fingerprint_update (uint32_t hash, const uint8_t *bytes, int size)
+{
+
+  int i;
+
+  for (i = 0; i < size; i++)
+  {
+    hash = (hash ^ bytes[i]) * 0x01000193;
+  }
+
+  return hash;
+
+}
+
+uint32_t image_fingerprint (const uint8_t *image, int size)
+{
+  return fingerprint_update(0x811c9dc5, image, size);
+}
+
+uint16_t get_le16 (const uint8_t *bytes)
+{
+  return (uint16_t)(bytes[0] | (bytes[1] << 8));
+}
+
+uint32_t get_le32 (const uint8_t *bytes)
+{
+  return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+void put_le32 (uint8_t *bytes, uint32_t value)
+{
+  bytes[0] = (uint8_t)(value & 0xFF);
+  bytes[1] = (uint8_t)((value >> 8) & 0xFF);
+  bytes[2] = (uint8_t)((value >> 16) & 0xFF);
+  bytes[3] = (uint8_t)((value >> 24) & 0xFF);
+}
+
+uint64_t get_le64 (const uint8_t *bytes)
+{
+  return (uint64_t)get_le32(bytes) | ((uint64_t)get_le32(&bytes[4]) << 32);
+}
+
+void put_le64 (uint8_t *bytes, uint64_t value)
+{
+  put_le32(bytes, (uint32_t)(value & 0xFFFFFFFF));
+  put_le32(&bytes[4], (uint32_t)(value >> 32));
+}
+
+/* Name of a baseline saved in the delta image filename: relative to the directory of the delta image. A delta of the
+   previous versions (relative to the working directory) is still found if the baseline isn't near the delta*/
+void delta_baseline_path (const char *filename, const char *baseline_name, char *path, size_t path_size)
+{
+
+  const char *slash = strrchr(filename, '/');
+  char file[PATH_MAX];
+  char old_file[PATH_MAX];
+
+  snprintf(path, path_size, "%s", baseline_name);
+  if (slash == NULL || baseline_name[0] == '/' || image_format_from_name(baseline_name) == IMAGE_FORMAT_SHM)
+  {
+    return;
+  }
+  if ((size_t)snprintf(path, path_size, "%.*s%s", (int)(slash - filename + 1), filename, baseline_name) >= path_size)
+  {
+    snprintf(path, path_size, "%s", baseline_name);
+    return;
+  }
+
+  /* library.mcl@selector: the file is library.mcl*/
+  library_selector(path, file, sizeof(file));
+  library_selector(baseline_name, old_file, sizeof(old_file));
+  if (access(file, F_OK) != 0 && access(old_file, F_OK) == 0)
+  {
+    snprintf(path, path_size, "%s", baseline_name);
+  }
+
+}
+
+int load_image_depth (const char *filename, uint8_t *image, int depth)
+{
+
+  uint8_t header[272];
+  uint8_t record[130];
+  char baseline_name[257];
+  char baseline_path[PATH_MAX];
+  uint32_t records;
+  uint32_t r;
+  uint16_t record_frame;
+  int format;
+
+  /* Image of a library*/
+  if (image_format_from_name(filename) == IMAGE_FORMAT_LIBRARY)
+  {
+    return library_load(filename, image);
+  }
+  /* Image in shared memory*/
+  if (image_format_from_name(filename) == IMAGE_FORMAT_SHM)
+  {
+    FILE *shared = image_open_read(filename, &format);
+    if (shared == NULL)
+    {
+      return 1;
+    }
+    records = fread(image, 1, sizeof(card_image), shared);
+    fclose(shared);
+    if (records != sizeof(card_image))
+    {
+      fprintf(stderr, "%s isn't a 128 KiB memory card image.\n", filename);
+      return 1;
+    }
+    return 0;
+  }
+
+  FILE *input=fopen( filename, "rb" );		/* Open the image in reading*/
+  if (input == NULL)
+  {
+    fprintf(stderr, "Unable to open %s.\n", filename);
+    return 1;
+  }
+
+  /* Raw image or image with header (VgsM, PSX)*/
+  if (fread(header, 1, DELTA_HEADER_SIZE, input) != DELTA_HEADER_SIZE || memcmp(header, DELTA_MAGIC, 8) != 0)
+  {
+    fclose(input);
+    input = image_open_read(filename, &format);
+    if (input == NULL)
+    {
+      return 1;
+    }
+    if (fread(image, 1, sizeof(card_image), input) != sizeof(card_image))
+    {
+      fprintf(stderr, "%s isn't a 128 KiB memory card image.\n", filename);
+      fclose(input);
+      return 1;
+    }
+    fclose(input);
+    return 0;
+  }
+
+  /* Delta image, first rebuild the baseline*/
+  if (depth >= DELTA_MAX_DEPTH)
+  {
+    fprintf(stderr, "Too many delta images over other delta images on %s.\n", filename);
+    fclose(input);
+    return 1;
+  }
+
+  records = get_le32(&header[8]);
+  memcpy(baseline_name, &header[16], 256);
+  baseline_name[256] = '\0';
+  delta_baseline_path(filename, baseline_name, baseline_path, sizeof(baseline_path));
+
+  if (load_image_depth(baseline_path, image, depth + 1) != 0)
+  {
+    fclose(input);
+    return 1;
+  }
+
+  if (image_fingerprint(image, sizeof(card_image)) != get_le32(&header[12]))
+  {
+    fprintf(stderr, "The baseline %s is changed after the creation of %s.\n", baseline_path, filename);
+    fclose(input);
+    return 1;
+  }
+
+  /* Then apply the changed frames*/
+  for (r = 0; r < records; r++)
+  {
+    if (fread(record, 1, DELTA_RECORD_SIZE, input) != DELTA_RECORD_SIZE)
+    {
+      fprintf(stderr, "%s is truncated at record %u.\n", filename, r);
+      fclose(input);
+      return 1;
+    }
+
+    record_frame = (uint16_t)(record[0] | (record[1] << 8));
+    if (record_frame > PS1CARD_MAX_FRAME)
+    {
+      fprintf(stderr, "Impossible frame %d in %s.\n", record_frame, filename);
+      fclose(input);
+      return 1;
+    }
+    memcpy(&image[record_frame*PS1CARD_FRAME_SIZE], &record[2], PS1CARD_FRAME_SIZE);
+  }
+
+  fclose(input);
+  return 0;
+
+}
+
+/* Load a raw image or rebuild the version of a delta image*/
+int load_image (const char *filename, uint8_t *image)
+{
+  return load_image_depth(filename, image, 0);
+}
+
+/* Map an image (raw, VgsM or PSX) in memory in reading, return the first Data Frame or NULL*/
+const uint8_t *image_map (const char *filename, void **mapping, size_t *mapping_size)
+{
+
+  struct stat sb;
+  int format;
+
+  FILE *image;
+
+  if (image_format_from_name(filename) == IMAGE_FORMAT_LIBRARY)
+  {
+    return library_map_image(filename, mapping, mapping_size);
+  }
+  if (image_format_from_name(filename) == IMAGE_FORMAT_SHM)
+  {
+    image = shm_image_open(filename, 0);
+    if (image == NULL)
+    {
+      return NULL;
+    }
+    *mapping_size = sizeof(card_image);
+    shm_image_map(image, 0, mapping);
+    fclose(image);
+    return *mapping == MAP_FAILED ? NULL : *mapping;
+  }
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+  {
+    fprintf(stderr, "Unable to open %s.\n", filename);
+    return NULL;
+  }
+  if (fstat(fd, &sb) != 0 || sb.st_size < sizeof(card_image))
+  {
+    fprintf(stderr, "%s isn't a memory card image (raw, VgsM or PSX).\n", filename);
+    close(fd);
+    return NULL;
+  }
+
+  *mapping_size = sb.st_size;
+  *mapping = mmap(NULL, *mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (*mapping == MAP_FAILED)
+  {
+    fprintf(stderr, "Unable to map %s.\n", filename);
+    return NULL;
+  }
+
+  format = image_format_detect(*mapping, *mapping_size);
+  if (format < 0)
+  {
+    fprintf(stderr, "%s isn't a memory card image (raw, VgsM or PSX).\n", filename);
+    munmap(*mapping, *mapping_size);
+    return NULL;
+  }
+
+  return (const uint8_t *)*mapping + IMAGE_HEADER_SIZE[format];
+
+}
+/* -------------------------------------------------------End of Memory card images-------------------------------------------------*/
+
+
+
+
+
+
+
+
+
+/* ------------------------------------------------------------Undo journal--------------------------------------------------------*/
+/* The writes are transactions: the frames to write are read and saved in UNDO_JOURNAL, then written with the data blocks
+   before header, directory and broken frame list (a stopped write leave the old directory), the journal is removed at
+   the end of a good write. After a failed write "ps3mca-ps1 u" write back only the frames already started, in reverse
+   order, so the restore time depend on the frames changed, not on the size of the card.*/
+FILE *undo_file = NULL;					/* Journal of the running write*/
+
+/* Order of the write: data frames, then header, directory and broken frame list. selected NULL for all the frames*/
+int write_order (uint16_t *order, int first, int last, const uint8_t *selected)
+{
+
+  int count = 0;
+  int f;
+
+  for (f = first; f <= last; f++)
+  {
+    if (f > PS1CARD_BROKEN_LAST_FRAME && (selected == NULL || selected[f]))
+    {
+      order[count++] = f;
+    }
+  }
+  for (f = first; f <= last && f <= PS1CARD_BROKEN_LAST_FRAME; f++)
+  {
+    if (selected == NULL || selected[f])
+    {
+      order[count++] = f;
+    }
+  }
+
+  return count;
+
+}
+
+/* Read the frames of the write and save them in the journal, nothing is written if a frame can't be read.
+   The new data of frame f is at data + (f - data_first)*stride (the image or the write packets)*/
+int journal_begin (const uint16_t *order, int count, const uint8_t *data, int data_first, int stride)
+{
+
+  uint8_t header[16];
+  uint8_t record[134];
+  FILE *previous;
+  int i;
+
+  /* Only one journal: a write run by the daemon between the frames of another write would replace its journal*/
+  if (undo_file != NULL)
+  {
+    fprintf(stderr, "Another write is running, nothing written.\n");
+    return 1;
+  }
+
+  /* Don't lose the journal of a failed write (also of the previous format, "PS1UNDO")*/
+  previous = fopen(UNDO_JOURNAL, "rb");
+  if (previous != NULL)
+  {
+    if (fread(header, 1, UNDO_HEADER_SIZE, previous) == UNDO_HEADER_SIZE && memcmp(header, UNDO_MAGIC, 6) == 0 && get_le32(&header[12]) > 0)
+    {
+      fprintf(stderr, "A previous write isn't finished, restore it with \"ps3mca-ps1 u\" or remove %s.\n", UNDO_JOURNAL);
+      fclose(previous);
+      return 1;
+    }
+    fclose(previous);
+  }
+
+  undo_file = fopen(UNDO_JOURNAL, "w+b");
+  if (undo_file == NULL)
+  {
+    fprintf(stderr, "Unable to create %s.\n", UNDO_JOURNAL);
+    return 1;
+  }
+
+  memset(header, 0, sizeof(header));
+  memcpy(header, UNDO_MAGIC, 8);
+  put_le32(&header[8], count);
+  fwrite(header, 1, UNDO_HEADER_SIZE, undo_file);
+
+  progress_begin("journal", count);
+  for (i = 0; i < count && !ps3mca_aborted; i++)
+  {
+    record[0] = order[i] & 0xFF;
+    record[1] = order[i] >> 8;
+    if (PS1_read_frame(order[i], &record[2]) != 0)
+    {
+      break;
+    }
+    put_le32(&record[130], fingerprint_update(0x811c9dc5, &data[(order[i] - data_first)*stride], PS1CARD_FRAME_SIZE));
+    fwrite(record, 1, UNDO_RECORD_SIZE, undo_file);
+    progress_update(i + 1);
+  }
+  progress_end(i, i < count);
+
+  fflush(undo_file);
+  if (i < count || ferror(undo_file) || fsync(fileno(undo_file)) != 0)
+  {
+    fprintf(stderr, "Unable to save frame %d in %s, nothing written.\n", i < count ? order[i] : -1, UNDO_JOURNAL);
+    fclose(undo_file);
+    undo_file = NULL;
+    remove(UNDO_JOURNAL);
+    return 1;
+  }
+
+  return 0;
+
+}
+
+/* Called before sending the frame i of the order*/
+void journal_mark (int i)
+{
+
+  uint8_t started[4];
+
+  put_le32(started, i + 1);
+  fseek(undo_file, 12, SEEK_SET);
+  fwrite(started, 1, sizeof(started), undo_file);
+  fflush(undo_file);
+
+}
+
+/* End of the write, the journal is kept only if the write failed*/
+void journal_end (int good, int started)
+{
+
+  if (undo_file == NULL)
+  {
+    return;
+  }
+
+  if (good)
+  {
+    fclose(undo_file);
+    remove(UNDO_JOURNAL);
+  }
+  else
+  {
+    fsync(fileno(undo_file));
+    fclose(undo_file);
+    fprintf(stderr, "%d frames can be changed, \"ps3mca-ps1 u\" restores them from %s.\n", started, UNDO_JOURNAL);
+  }
+  undo_file = NULL;
+
+}
+
+/* Restore the frames started by a failed write*/
+int PS1_undo ()
+{
+
+  uint8_t header[16];
+  uint8_t data_frame[128];
+  uint8_t *record;
+  uint8_t *records;
+  uint32_t count;
+  uint32_t started;
+  int errors = 0;
+  int frame_status;
+  int i;
+
+  /* The journal is the journal of the running write*/
+  if (undo_file != NULL)
+  {
+    fprintf(stderr, "A write is running, restore it at its end.\n");
+    return 1;
+  }
+
+  FILE *journal=fopen( UNDO_JOURNAL, "rb" );
+  if (journal == NULL)
+  {
+    printf("No write to restore (%s not found).\n", UNDO_JOURNAL);
+    return 0;
+  }
+  if (fread(header, 1, UNDO_HEADER_SIZE, journal) != UNDO_HEADER_SIZE || memcmp(header, UNDO_MAGIC, 8) != 0)
+  {
+    fprintf(stderr, "%s isn't an undo journal.\n", UNDO_JOURNAL);
+    fclose(journal);
+    return 1;
+  }
+  count = get_le32(&header[8]);
+  started = get_le32(&header[12]);
+  if (started > count)
+  {
+    started = count;
+  }
+  if (started == 0)
+  {
+    fclose(journal);
+    remove(UNDO_JOURNAL);
+    printf("No frame was changed.\n");
+    return 0;
+  }
+
+  records = malloc((size_t)count*UNDO_RECORD_SIZE);
+  if (records == NULL || fread(records, UNDO_RECORD_SIZE, count, journal) != count)
+  {
+    fprintf(stderr, "%s is truncated.\n", UNDO_JOURNAL);
+    free(records);
+    fclose(journal);
+    return 1;
+  }
+  fclose(journal);
+
+  if (open_ps1_card() != 0)
+  {
+    free(records);
+    return 1;
+  }
+  load_card_profile();
+
+  /* Same card of the journal: every started frame is the original or the new one, the next frames still the original*/
+  for (i = 0; i < count && i < started + UNDO_CHECK_FRAMES; i++)
+  {
+    record = &records[i*UNDO_RECORD_SIZE];
+    if (PS1_read_frame(get_le16(record), data_frame) != 0 || (memcmp(data_frame, &record[2], PS1CARD_FRAME_SIZE) != 0 &&
+        (i >= started || fingerprint_update(0x811c9dc5, data_frame, PS1CARD_FRAME_SIZE) != get_le32(&record[130]))))
+    {
+      fprintf(stderr, "Frame %d isn't a frame of %s, the card isn't the same, nothing restored.\n", get_le16(record), UNDO_JOURNAL);
+      free(records);
+      close_ps3mca();
+      return 1;
+    }
+  }
+
+  /* Reverse order: first header, directory and broken frame list*/
+  progress_begin("undo", started);
+  for (i = started - 1; i >= 0 && !ps3mca_aborted; i--)
+  {
+    frame = get_le16(&records[i*UNDO_RECORD_SIZE]);
+    frame_status = PS1_write_frame(frame, &records[i*UNDO_RECORD_SIZE + 2]);
+    if (frame_status == -2)
+    {
+      errors++;
+      break;
+    }
+    if (frame_status != 0)
+    {
+      errors++;
+    }
+    progress_update(started - i);
+  }
+  progress_end(started - 1 - i, errors != 0 || ps3mca_aborted);
+  free(records);
+
+  /* Unmount the ps3mca*/
+  close_ps3mca();
+
+  if (errors != 0 || ps3mca_aborted)
+  {
+    fprintf(stderr, "Restore failed, %s is kept for another attempt.\n", UNDO_JOURNAL);
+    return 1;
+  }
+
+  remove(UNDO_JOURNAL);
+  printf("%u frames restored.\n", started);
+  return 0;
+
+}
+/* --------------------------------------------------------End of Undo journal-----------------------------------------------------*/
+
+
+
+
+
+
+
+
+
+/* -------------------------------------------------------Memory card index---------------------------------------------------------*/
+/* In memory model of the card filesystem, built in one pass on header, directory (frame 0 to 15) and title frames.
+   Frames can be given one by one in any order (as they arrive from PS1_read_frame) or all together from an image.
+   Every save is found from its first block, from every block of its chain or from the product code without search.*/
+struct ps1_save
+{
+  uint8_t first_block;					/* First block of the file (1 to 15)*/
+  uint8_t blocks;					/* Number of blocks in the chain*/
+  uint8_t chain[15];					/* Blocks of the file in order*/
+  uint8_t broken_chain;					/* 1 if the chain is wrong (loop, free block or size mismatch)*/
+  uint32_t size;					/* File size from directory*/
+  char filename[21];					/* Full file name (region + product code + identifier)*/
+  char region[3];					/* BI=Japan, BA=America, BE=Europe*/
+  char product_code[11];				/* Example SLUS-00001*/
+  char identifier[9];					/* Text choosen by the game*/
+  char title[65];					/* Title converted from Shift-JIS to ASCII*/
+};
+
+struct ps1_card_index
+{
+  uint8_t directory[16*128];				/* Header and directory frames*/
+  uint8_t title_frames[16][128];			/* First frame of every block*/
+  uint32_t directory_seen;				/* Bit n set when frame n (0 to 15) is arrived*/
+  uint16_t title_seen;					/* Bit n set when the first frame of block n is arrived*/
+  uint16_t bad_checksum;				/* Bit n set when frame n (0 to 15) has a wrong checksum*/
+  uint8_t directory_ready;				/* 1 when directory is parsed*/
+  uint8_t formatted;					/* 1 if frame 0 start with "MC"*/
+  int saves_count;
+  struct ps1_save saves[15];
+  int8_t block_owner[16];				/* Save using every block, -1 if free*/
+  uint16_t free_map;					/* Bit n set when block n is free*/
+  int8_t product_table[32];				/* Hash table of saves by product code, -1 if empty*/
+};
+
+struct ps1_card_index card_index;			/* Index of the card in use*/
+
+/* xor of all the 128 bytes of a frame, 64 bits at a time (the compiler can vectorize it)*/
+uint8_t frame_xor (const uint8_t *data)
+{
+
+  uint64_t words[16];
+  uint64_t xor = 0;
+  int i;
+
+  memcpy(words, data, sizeof(words));		/* Frames in images can be unaligned*/
+  for (i = 0; i < 16; i++)
+  {
+    xor = xor ^ words[i];
+  }
+  xor = xor ^ (xor >> 32);
+  xor = xor ^ (xor >> 16);
+  xor = xor ^ (xor >> 8);
+
+  return (uint8_t)(xor & 0xFF);
+
+}
+
+/* Checksum of header and directory frames, xor of all bytes except the last*/
+uint8_t directory_frame_checksum (const uint8_t *data)
+{
+  return frame_xor(data) ^ data[PS1CARD_CHECKSUM_OFFSET];
+}
+
+/* Convert a Shift-JIS title to ASCII, only the full width characters used by the games are converted*/
+void sjis_to_ascii (const uint8_t *sjis, int size, char *ascii)
+{
+
+  int i = 0;
+  int a = 0;
+
+  while (i < size && sjis[i] != 0x00)
+  {
+    if (sjis[i] < 0x80)
+    {
+      ascii[a++] = sjis[i];
+      i++;
+      continue;
+    }
+
+    if (i+1 >= size)
+    {
+      break;
+    }
+
+    if (sjis[i] == 0x82 && sjis[i+1] >= 0x4f && sjis[i+1] <= 0x58)	/* 0 to 9*/
+    {
+      ascii[a++] = '0' + (sjis[i+1] - 0x4f);
+    }
+    else if (sjis[i] == 0x82 && sjis[i+1] >= 0x60 && sjis[i+1] <= 0x79)	/* A to Z*/
+    {
+      ascii[a++] = 'A' + (sjis[i+1] - 0x60);
+    }
+    else if (sjis[i] == 0x82 && sjis[i+1] >= 0x81 && sjis[i+1] <= 0x9a)	/* a to z*/
+    {
+      ascii[a++] = 'a' + (sjis[i+1] - 0x81);
+    }
+    else if (sjis[i] == 0x81 && sjis[i+1] == 0x40)			/* Space*/
+    {
+      ascii[a++] = ' ';
+    }
+    else if (sjis[i] == 0x81 && sjis[i+1] == 0x46)			/* :*/
+    {
+      ascii[a++] = ':';
+    }
+    else if (sjis[i] == 0x81 && sjis[i+1] == 0x5e)			/* /*/
+    {
+      ascii[a++] = '/';
+    }
+    else if (sjis[i] == 0x81 && sjis[i+1] == 0x7c)			/* -*/
+    {
+      ascii[a++] = '-';
+    }
+    else
+    {
+      ascii[a++] = '?';
+    }
+    i += 2;
+  }
+
+  ascii[a] = '\0';
+
+}
+
+unsigned int product_code_hash (const char *product_code)
+{
+  return fingerprint_update(0x811c9dc5, (const uint8_t *)product_code, strlen(product_code)) & 31;
+}
+
+void ps1_index_init (struct ps1_card_index *index)
+{
+  memset(index, 0, sizeof(struct ps1_card_index));
+  memset(index->block_owner, -1, sizeof(index->block_owner));
+  memset(index->product_table, -1, sizeof(index->product_table));
+}
+
+void ps1_index_parse_title (struct ps1_card_index *index, int save)
+{
+  struct ps1_save *entry = &index->saves[save];
+
+  if (index->title_seen & (1 << entry->first_block))
+  {
+    sjis_to_ascii(&index->title_frames[entry->first_block][PS1CARD_TITLE_OFFSET], PS1CARD_TITLE_SIZE, entry->title);
+  }
+}
+
+void ps1_index_parse_directory (struct ps1_card_index *index)
+{
+
+  int block;
+  int next;
+  int s;
+  int f;
+  unsigned int h;
+  uint8_t *entry;
+  struct ps1_save *save;
+
+  index->formatted = (index->directory[0] == 'M' && index->directory[1] == 'C');
+
+  /* xor of all the bytes with the checksum is 0 on a good frame*/
+  for (f = PS1CARD_MIN_FRAME; f <= PS1CARD_DIRECTORY_LAST_FRAME; f++)
+  {
+    if (frame_xor(&index->directory[f*PS1CARD_FRAME_SIZE]) != 0x00)
+    {
+      index->bad_checksum |= (1 << f);
+    }
+  }
+
+  /* Free map*/
+  for (block = 1; block < PS1CARD_BLOCKS; block++)
+  {
+    entry = &index->directory[block*PS1CARD_FRAME_SIZE];
+    if (entry[0] != PS1CARD_DIR_FIRST_BLOCK && entry[0] != PS1CARD_DIR_MIDDLE_BLOCK && entry[0] != PS1CARD_DIR_LAST_BLOCK)
+    {
+      index->free_map |= (1 << block);
+    }
+  }
+
+  /* Follow the chain of every file from the first block*/
+  for (block = 1; block < PS1CARD_BLOCKS; block++)
+  {
+    entry = &index->directory[block*PS1CARD_FRAME_SIZE];
+    if (entry[0] != PS1CARD_DIR_FIRST_BLOCK)
+    {
+      continue;
+    }
+
+    s = index->saves_count++;
+    save = &index->saves[s];
+    save->first_block = block;
+    save->size = get_le32(&entry[PS1CARD_DIR_SIZE_OFFSET]);
+    memcpy(save->filename, &entry[PS1CARD_DIR_NAME_OFFSET], PS1CARD_DIR_NAME_SIZE);
+    save->filename[PS1CARD_DIR_NAME_SIZE] = '\0';
+    memcpy(save->region, save->filename, 2);
+    memcpy(save->product_code, &save->filename[2], 10);
+    strncpy(save->identifier, &save->filename[12], 8);
+
+    next = block;
+    while (next >= 1 && next < PS1CARD_BLOCKS)
+    {
+      /* Loop or block used by another file*/
+      if (index->block_owner[next] != -1 || (index->free_map & (1 << next)) || save->blocks >= sizeof(save->chain))
+      {
+        save->broken_chain = 1;
+        break;
+      }
+      index->block_owner[next] = s;
+      save->chain[save->blocks++] = next;
+
+      entry = &index->directory[next*PS1CARD_FRAME_SIZE];
+      if (entry[0] == PS1CARD_DIR_LAST_BLOCK || (save->blocks == 1 && entry[PS1CARD_DIR_NEXT_OFFSET] == 0xff && entry[PS1CARD_DIR_NEXT_OFFSET+1] == 0xff))
+      {
+        break;
+      }
+      next = (entry[PS1CARD_DIR_NEXT_OFFSET] | (entry[PS1CARD_DIR_NEXT_OFFSET+1] << 8)) + 1;
+    }
+
+    if (next < 1 || next >= PS1CARD_BLOCKS || save->size != (uint32_t)save->blocks*PS1CARD_BLOCK_FRAMES*PS1CARD_FRAME_SIZE)
+    {
+      save->broken_chain = 1;
+    }
+
+    /* Product code hash table (open addressing)*/
+    h = product_code_hash(save->product_code);
+    while (index->product_table[h] != -1)
+    {
+      h = (h + 1) & 31;
+    }
+    index->product_table[h] = s;
+
+    ps1_index_parse_title(index, s);
+  }
+
+  index->directory_ready = 1;
+
+}
+
+/* Give a frame to the index, only header, directory and title frames are used*/
+void ps1_index_feed_frame (struct ps1_card_index *index, uint16_t frame_number, const uint8_t *data)
+{
+
+  int block = frame_number / PS1CARD_BLOCK_FRAMES;
+
+  if (frame_number <= PS1CARD_DIRECTORY_LAST_FRAME)
+  {
+    memcpy(&index->directory[frame_number*PS1CARD_FRAME_SIZE], data, PS1CARD_FRAME_SIZE);
+    index->directory_seen |= (1 << frame_number);
+    if (index->directory_seen == 0xffff && !index->directory_ready)
+    {
+      ps1_index_parse_directory(index);
+    }
+  }
+  else if (block > 0 && frame_number % PS1CARD_BLOCK_FRAMES == 0)
+  {
+    memcpy(index->title_frames[block], data, PS1CARD_FRAME_SIZE);
+    index->title_seen |= (1 << block);
+    if (index->directory_ready && index->block_owner[block] != -1 && index->saves[index->block_owner[block]].first_block == block)
+    {
+      ps1_index_parse_title(index, index->block_owner[block]);
+    }
+  }
+
+}
+
+/* Build the index from a raw image*/
+void ps1_index_build (struct ps1_card_index *index, const uint8_t *image)
+{
+
+  int block;
+  int f;
+
+  ps1_index_init(index);
+  for (f = PS1CARD_MIN_FRAME; f <= PS1CARD_DIRECTORY_LAST_FRAME; f++)
+  {
+    ps1_index_feed_frame(index, f, &image[f*PS1CARD_FRAME_SIZE]);
+  }
+  for (block = 1; block < PS1CARD_BLOCKS; block++)
+  {
+    ps1_index_feed_frame(index, block*PS1CARD_BLOCK_FRAMES, &image[block*PS1CARD_BLOCK_FRAMES*PS1CARD_FRAME_SIZE]);
+  }
+
+}
+
+/* Return the save that use the frame, NULL if the frame is free or in block 0*/
+struct ps1_save *ps1_index_frame_save (struct ps1_card_index *index, uint16_t frame_number)
+{
+  int owner = index->block_owner[frame_number / PS1CARD_BLOCK_FRAMES];
+
+  return owner == -1 ? NULL : &index->saves[owner];
+}
+
+/* Return 1 if the block is free (also block 0 is never free)*/
+int ps1_index_block_free (struct ps1_card_index *index, int block)
+{
+  return (index->free_map >> block) & 1;
+}
+
+/* Return the first save with the product code, NULL if not found*/
+struct ps1_save *ps1_index_find (struct ps1_card_index *index, const char *product_code)
+{
+
+  unsigned int h = product_code_hash(product_code);
+
+  while (index->product_table[h] != -1)
+  {
+    if (strcmp(index->saves[index->product_table[h]].product_code, product_code) == 0)
+    {
+      return &index->saves[index->product_table[h]];
+    }
+    h = (h + 1) & 31;
+  }
+
+  return NULL;
+
+}
+
+void ps1_index_print (struct ps1_card_index *index)
+{
+
+  int s;
+  int free_blocks = 0;
+  int block;
+
+  if (!index->formatted)
+  {
+    printf("Memory card not formatted.\n");
+  }
+  if (index->bad_checksum != 0)
+  {
+    fprintf(stderr, "Wrong checksum on header or directory frames (mask %04x).\n", index->bad_checksum);
+  }
+
+  printf("Block Size Region Product    Identifier Title\n");
+  for (s = 0; s < index->saves_count; s++)
+  {
+    printf("%5d %4d %-6s %-10s %-10s %s%s\n", index->saves[s].first_block, index->saves[s].blocks, index->saves[s].region,
+           index->saves[s].product_code, index->saves[s].identifier, index->saves[s].title, index->saves[s].broken_chain ? " (BROKEN CHAIN)" : "");
+  }
+
+  for (block = 1; block < PS1CARD_BLOCKS; block++)
+  {
+    free_blocks += ps1_index_block_free(index, block);
+  }
+  printf("%d saves, %d free blocks.\n", index->saves_count, free_blocks);
+
+}
+
+/* List the saves of an image or, without image, of the card (only directory and title frames are read)*/
+int PS1_list (const char *filename)
+{
+
+  int block;
+  int errors = 0;
+  uint8_t data_frame[128];
+
+  /* Images of a library*/
+  if (filename != NULL && image_format_from_name(filename) == IMAGE_FORMAT_LIBRARY && library_selector(filename, NULL, 0) == NULL)
+  {
+    return library_list(filename);
+  }
+
+  if (filename != NULL)
+  {
+    if (load_image(filename, card_image) != 0)
+    {
+      return 1;
+    }
+    ps1_index_build(&card_index, card_image);
+    ps1_index_print(&card_index);
+    return 0;
+  }
+
+  if (open_ps1_card() != 0)
+  {
+    return 1;
+  }
+
+  ps1_index_init(&card_index);
+  for (frame = PS1CARD_MIN_FRAME; frame <= PS1CARD_DIRECTORY_LAST_FRAME; frame++)
+  {
+    if (PS1_read_frame(frame, data_frame) < 0)
+    {
+      errors++;
+    }
+    ps1_index_feed_frame(&card_index, frame, data_frame);
+  }
+
+  /* Title frames only for the used blocks*/
+  for (block = 1; block < PS1CARD_BLOCKS; block++)
+  {
+    if (card_index.block_owner[block] != -1 && card_index.saves[card_index.block_owner[block]].first_block == block)
+    {
+      if (PS1_read_frame(block*PS1CARD_BLOCK_FRAMES, data_frame) < 0)
+      {
+        errors++;
+      }
+      ps1_index_feed_frame(&card_index, block*PS1CARD_BLOCK_FRAMES, data_frame);
+    }
+  }
+
+  /* Unmount the ps3mca*/
+  close_ps3mca();
+
+  ps1_index_print(&card_index);
+
+  return errors != 0;
+
+}
+/* ---------------------------------------------------End of Memory card index------------------------------------------------------*/
+
+
+
+
+
+
+
+
+
+/* -------------------------------------------------------------Read pipeline------------------------------------------------------*/
+/* PS1_read is the producer: it reads the frames on the USB and puts them in a queue of PIPELINE_DEPTH frames, a thread takes
+   them from the queue and gives every frame to a chain of sinks, so the work on the frames runs while the next frame is on
+   the USB. The first sink saves the image, the others are selected with PS3MCA_SINKS (comma separated):
+     index        parse header, directory and titles while they arrive and list the saves at the end (like "l")
+     fingerprint  fingerprint of the image (the same of the card library)
+     copy=file    second raw copy of the image, for example on an archive disk
+   The queue has one producer and one consumer: head is written only by the producer and tail only by the consumer, the
+   other stage reads it with acquire and sees the frame complete, no lock. The consumer with the queue empty waits on a
+   condition variable, the producer locks only to wake it when it is waiting; the producer with the queue full sleeps
+   PIPELINE_WAIT_US (the sinks are faster than the USB, it happens only with a slow disk).
+   The sinks don't print and don't touch the globals during the frames (they run beside the USB), only in end.*/
+struct read_sink
+{
+  const char *name;
+  int (*begin)(struct read_sink *sink);
+  void (*frame)(struct read_sink *sink, uint16_t frame_number, const uint8_t *data, int status);
+  int (*end)(struct read_sink *sink, int complete);	/* 0 if good*/
+  const char *argument;					/* After "=" in PS3MCA_SINKS*/
+  FILE *file;
+  uint32_t hash;
+  int errors;
+  struct ps1_card_index *index;
+  struct read_sink *next;
+};
+
+struct pipeline_entry
+{
+  uint16_t frame_number;
+  int status;						/* Of PS1_read_frame*/
+  const uint8_t *data;					/* buffer or a frame of the image in shared memory*/
+  uint8_t buffer[128];
+};
+
+struct read_pipeline
+{
+  struct pipeline_entry entries[PIPELINE_DEPTH];
+  unsigned int head;					/* Next entry to fill, written only by the producer*/
+  unsigned int tail;					/* Next entry to give to the sinks, written only by the consumer*/
+  int finished;						/* No more frames after head*/
+  int threaded;						/* 0 if the thread isn't started, the sinks run in pipeline_push*/
+  int waiting;						/* The consumer is waiting (or going to wait) on ready*/
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;					/* A frame or finished for the consumer*/
+  struct read_sink *sinks;
+};
+
+/* Image sink, file is NULL when the frames arrive directly in the image (shared memory)*/
+void sink_image_frame (struct read_sink *sink, uint16_t frame_number, const uint8_t *data, int status)
+{
+  (void)frame_number;
+  /* Save the Data Frame only if it's arrived, also with errors (see stderr)*/
+  if (sink->file != NULL && status >= 0 && fwrite(data, 1, PS1CARD_FRAME_SIZE, sink->file) != (size_t)PS1CARD_FRAME_SIZE)
+  {
+    sink->errors++;
+  }
+}
+
+int sink_image_end (struct read_sink *sink, int complete)
+{
+  (void)complete;
+  return sink->errors != 0;
+}
+
+int sink_index_begin (struct read_sink *sink)
+{
+  sink->index = malloc(sizeof(struct ps1_card_index));
+  if (sink->index == NULL)
+  {
+    return 1;
+  }
+  ps1_index_init(sink->index);
+  return 0;
+}
+
+void sink_index_frame (struct read_sink *sink, uint16_t frame_number, const uint8_t *data, int status)
+{
+  if (status >= 0)
+  {
+    ps1_index_feed_frame(sink->index, frame_number, data);
+  }
+}
+
+/* The index of the dump become the index of the card in use*/
+int sink_index_end (struct read_sink *sink, int complete)
+{
+
+  int result = 0;
+
+  (void)complete;
+  if (sink->index->directory_ready)
+  {
+    card_index = *sink->index;
+    ps1_index_print(&card_index);
+  }
+  else
+  {
+    fprintf(stderr, "Header or directory frames not read, no list of the saves.\n");
+    result = 1;
+  }
+  free(sink->index);
+  sink->index = NULL;
+
+  return result;
+
+}
+
+int sink_fingerprint_begin (struct read_sink *sink)
+{
+  sink->hash = 0x811c9dc5;
+  return 0;
+}
+
+void sink_fingerprint_frame (struct read_sink *sink, uint16_t frame_number, const uint8_t *data, int status)
+{
+  (void)frame_number;
+  if (status >= 0)
+  {
+    sink->hash = fingerprint_update(sink->hash, data, PS1CARD_FRAME_SIZE);
+  }
+  else
+  {
+    sink->errors++;
+  }
+}
+
+int sink_fingerprint_end (struct read_sink *sink, int complete)
+{
+
+  if (!complete || sink->errors != 0)
+  {
+    fprintf(stderr, "Image incomplete, no fingerprint.\n");
+    return 1;
+  }
+  printf("Fingerprint of the image: %08x.\n", sink->hash);
+
+  return 0;
+
+}
+
+int sink_copy_begin (struct read_sink *sink)
+{
+
+  if (sink->argument == NULL || sink->argument[0] == '\0')
+  {
+    fprintf(stderr, "The sink copy needs a file, like copy=backup.mcd.\n");
+    return 1;
+  }
+  sink->file = fopen(sink->argument, "wb");
+  if (sink->file == NULL)
+  {
+    fprintf(stderr, "Unable to create %s.\n", sink->argument);
+    return 1;
+  }
+
+  return 0;
+
+}
+
+int sink_copy_end (struct read_sink *sink, int complete)
+{
+
+  int closed = fclose(sink->file);
+
+  sink->file = NULL;
+  if (closed != 0 || sink->errors != 0)
+  {
+    fprintf(stderr, "Unable to save %s.\n", sink->argument);
+    return 1;
+  }
+  if (!complete)
+  {
+    fprintf(stderr, "%s is incomplete.\n", sink->argument);
+  }
+
+  return 0;
+
+}
+
+const struct read_sink READ_SINKS[] =
+{
+  { "index", sink_index_begin, sink_index_frame, sink_index_end, NULL, NULL, 0, 0, NULL, NULL },
+  { "fingerprint", sink_fingerprint_begin, sink_fingerprint_frame, sink_fingerprint_end, NULL, NULL, 0, 0, NULL, NULL },
+  { "copy", sink_copy_begin, sink_image_frame, sink_copy_end, NULL, NULL, 0, 0, NULL, NULL },
+  { NULL, NULL, NULL, NULL, NULL, NULL, 0, 0, NULL, NULL }
+};
+
+/* Give a frame to all the sinks*/
+void pipeline_sinks_frame (struct read_pipeline *pipeline, struct pipeline_entry *entry)
+{
+
+  struct read_sink *sink;
+
+  for (sink = pipeline->sinks; sink != NULL; sink = sink->next)
+  {
+    sink->frame(sink, entry->frame_number, entry->data, entry->status);
+  }
+
+}
+
+/* Consumer thread*/
+void *pipeline_worker (void *arg)
+{
+
+  struct read_pipeline *pipeline = arg;
+  unsigned int tail = pipeline->tail;
+
+  while (1)
+  {
+    if (tail == __atomic_load_n(&pipeline->head, __ATOMIC_ACQUIRE))
+    {
+      /* finished is set after the last head, so with finished a queue still empty is really empty*/
+      if (__atomic_load_n(&pipeline->finished, __ATOMIC_ACQUIRE) && tail == __atomic_load_n(&pipeline->head, __ATOMIC_ACQUIRE))
+      {
+        break;
+      }
+      /* waiting is set before head and finished are read again, the producer sets them before it reads waiting:
+         one of the two sees the other, so a frame can't arrive without a signal while the consumer sleeps*/
+      pthread_mutex_lock(&pipeline->lock);
+      __atomic_store_n(&pipeline->waiting, 1, __ATOMIC_SEQ_CST);
+      while (tail == __atomic_load_n(&pipeline->head, __ATOMIC_SEQ_CST) && !__atomic_load_n(&pipeline->finished, __ATOMIC_SEQ_CST))
+      {
+        pthread_cond_wait(&pipeline->ready, &pipeline->lock);
+      }
+      __atomic_store_n(&pipeline->waiting, 0, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&pipeline->lock);
+      continue;
+    }
+
+    pipeline_sinks_frame(pipeline, &pipeline->entries[tail % PIPELINE_DEPTH]);
+    tail++;
+    __atomic_store_n(&pipeline->tail, tail, __ATOMIC_RELEASE);
+  }
+
+  return NULL;
+
+}
+
+/* Add a sink of READ_SINKS at the end of the chain from "name" or "name=argument"*/
+int pipeline_add_sink (struct read_pipeline *pipeline, const char *description, size_t size)
+{
+
+  const struct read_sink *model;
+  struct read_sink *sink;
+  struct read_sink **last;
+  const char *equal = memchr(description, '=', size);
+  size_t name_size = equal != NULL ? (size_t)(equal - description) : size;
+  char *argument = NULL;
+
+  for (model = READ_SINKS; model->name != NULL; model++)
+  {
+    if (strlen(model->name) == name_size && strncmp(model->name, description, name_size) == 0)
+    {
+      break;
+    }
+  }
+  if (model->name == NULL)
+  {
+    fprintf(stderr, "Unknown sink %.*s in %s (index, fingerprint, copy=file).\n", (int)size, description, SINKS_VARIABLE);
+    return 1;
+  }
+
+  sink = calloc(1, sizeof(struct read_sink));
+  if (equal != NULL)
+  {
+    argument = strndup(equal + 1, size - name_size - 1);
+  }
+  if (sink == NULL || (equal != NULL && argument == NULL))
+  {
+    free(sink);
+    free(argument);
+    return 1;
+  }
+  *sink = *model;
+  sink->argument = argument;
+
+  if (sink->begin != NULL && sink->begin(sink) != 0)
+  {
+    free(argument);
+    free(sink);
+    return 1;
+  }
+
+  last = &pipeline->sinks;
+  while (*last != NULL)
+  {
+    last = &(*last)->next;
+  }
+  *last = sink;
+
+  return 0;
+
+}
+
+/* Free the sinks, also the memory and the files of the sinks not ended*/
+void pipeline_free_sinks (struct read_pipeline *pipeline)
+{
+
+  struct read_sink *sink;
+
+  while (pipeline->sinks != NULL)
+  {
+    sink = pipeline->sinks;
+    pipeline->sinks = sink->next;
+    free(sink->index);
+    if (sink->begin != NULL && sink->file != NULL)		/* Not the image*/
+    {
+      fclose(sink->file);
+    }
+    free((char *)sink->argument);
+    free(sink);
+  }
+
+}
+
+/* Start the sinks and their thread, output is the image (NULL if the frames are written directly in the image)*/
+struct read_pipeline *pipeline_start (FILE *output)
+{
+
+  struct read_pipeline *pipeline;
+  struct read_sink *image;
+  const char *sinks = getenv(SINKS_VARIABLE);
+  const char *comma;
+
+  pipeline = calloc(1, sizeof(struct read_pipeline));
+  image = calloc(1, sizeof(struct read_sink));
+  if (pipeline == NULL || image == NULL)
+  {
+    fprintf(stderr, "Out of memory.\n");
+    free(pipeline);
+    free(image);
+    return NULL;
+  }
+  image->name = "image";
+  image->frame = sink_image_frame;
+  image->end = sink_image_end;
+  image->file = output;
+  pipeline->sinks = image;
+
+  while (sinks != NULL && sinks[0] != '\0')
+  {
+    comma = strchr(sinks, ',');
+    if (comma == NULL)
+    {
+      comma = sinks + strlen(sinks);
+    }
+    if (comma > sinks && pipeline_add_sink(pipeline, sinks, comma - sinks) != 0)
+    {
+      pipeline_free_sinks(pipeline);
+      free(pipeline);
+      return NULL;
+    }
+    sinks = comma[0] == ',' ? comma + 1 : comma;
+  }
+
+  /* Without the thread the sinks run between the frames, as before*/
+  pthread_mutex_init(&pipeline->lock, NULL);
+  pthread_cond_init(&pipeline->ready, NULL);
+  pipeline->threaded = pthread_create(&pipeline->thread, NULL, pipeline_worker, pipeline) == 0;
+
+  return pipeline;
+
+}
+
+/* Buffer for the next frame, waits if the queue is full*/
+uint8_t *pipeline_slot (struct read_pipeline *pipeline)
+{
+
+  if (pipeline->head - __atomic_load_n(&pipeline->tail, __ATOMIC_ACQUIRE) >= PIPELINE_DEPTH)
+  {
+    metrics_count(&metrics.pipeline_stalls, 1);
+    while (pipeline->head - __atomic_load_n(&pipeline->tail, __ATOMIC_ACQUIRE) >= PIPELINE_DEPTH)
+    {
+      usleep(PIPELINE_WAIT_US);
+    }
+  }
+
+  return pipeline->entries[pipeline->head % PIPELINE_DEPTH].buffer;
+
+}
+
+/* Wake the consumer if it waits on ready, after a new head or finished*/
+void pipeline_wake (struct read_pipeline *pipeline)
+{
+  if (__atomic_load_n(&pipeline->waiting, __ATOMIC_SEQ_CST))
+  {
+    pthread_mutex_lock(&pipeline->lock);
+    pthread_cond_signal(&pipeline->ready);
+    pthread_mutex_unlock(&pipeline->lock);
+  }
+}
+
+/* Give the frame read in pipeline_slot (or at data) to the sinks*/
+void pipeline_push (struct read_pipeline *pipeline, uint16_t frame_number, const uint8_t *data, int status)
+{
+
+  struct pipeline_entry *entry = &pipeline->entries[pipeline->head % PIPELINE_DEPTH];
+
+  entry->frame_number = frame_number;
+  entry->status = status;
+  entry->data = data;
+  if (!pipeline->threaded)
+  {
+    pipeline_sinks_frame(pipeline, entry);
+    pipeline->head++;
+    pipeline->tail++;
+    return;
+  }
+  __atomic_store_n(&pipeline->head, pipeline->head + 1, __ATOMIC_SEQ_CST);
+  pipeline_wake(pipeline);
+
+}
+
+/* Wait the sinks for the frames in the queue and end them, return 0 if all the sinks are good*/
+int pipeline_finish (struct read_pipeline *pipeline, int complete)
+{
+
+  struct read_sink *sink;
+  int result = 0;
+
+  if (pipeline->threaded)
+  {
+    __atomic_store_n(&pipeline->finished, 1, __ATOMIC_SEQ_CST);
+    pipeline_wake(pipeline);
+    pthread_join(pipeline->thread, NULL);
+  }
+  pthread_cond_destroy(&pipeline->ready);
+  pthread_mutex_destroy(&pipeline->lock);
+
+  for (sink = pipeline->sinks; sink != NULL; sink = sink->next)
+  {
+    if (sink->end != NULL && sink->end(sink, complete) != 0)
+    {
+      result = 1;
+    }
+  }
+  pipeline_free_sinks(pipeline);
+  free(pipeline);
+
+  return result;
+
+}
+/* ---------------------------------------------------------End of Read pipeline---------------------------------------------------*/
+
+
+
+
+
+
+
+
+
+/* -------------------------------------------------------------Card library-------------------------------------------------------*/
+/* Many card images in one file (see Card library definitions), for archives with too many small images.
+   The index is read from the mapped library: "library.mcl@12" is the image 12, "library.mcl@0x1a2b3c4d" the last image
+   with that fingerprint, "library.mcl@SLUS-00594" the last image with a save with that text in file name or title and
+   "library.mcl" the last image. Every command reading an image can use an image of a library, read and convert add
+   the new image at the end of the library and then write its index entry, so a broken append don't damage the index.*/
+uint64_t library_append_offset;				/* Image added by library_open_append*/
+uint64_t library_append_block;				/* Index block of its entry*/
+
+struct library_cursor
+{
+  const uint8_t *library;
+  size_t size;
+  uint64_t block;					/* Index block in use, 0 at the end*/
+  uint32_t position;					/* Next entry in the block*/
+  uint32_t number;					/* Number of the next entry in the library*/
+};
+
+/* Selector of "library.mcl@selector" (NULL if the name hasn't it), the library file name is copied in path*/
+const char *library_selector (const char *filename, char *path, size_t path_size)
+{
+
+  const char *at = strrchr(filename, '@');
+
+  if (at == NULL || at - filename < 4 || strncasecmp(at - 4, ".mcl", 4) != 0)
+  {
+    if (path != NULL)
+    {
+      snprintf(path, path_size, "%s", filename);
+    }
+    return NULL;
+  }
+
+  if (path != NULL)
+  {
+    snprintf(path, path_size, "%.*s", (int)(at - filename), filename);
+  }
+  return at + 1;
+
+}
+
+/* Map a library in reading, NULL if it isn't a library*/
+const uint8_t *library_map (const char *path, size_t *size)
+{
+
+  struct stat sb;
+  void *mapping;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+  {
+    fprintf(stderr, "Unable to open %s.\n", path);
+    return NULL;
+  }
+  if (fstat(fd, &sb) != 0 || sb.st_size < LIBRARY_HEADER_SIZE)
+  {
+    fprintf(stderr, "%s isn't a card library.\n", path);
+    close(fd);
+    return NULL;
+  }
+
+  mapping = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+  {
+    fprintf(stderr, "Unable to map %s.\n", path);
+    return NULL;
+  }
+  if (memcmp(mapping, IMAGE_MAGIC[IMAGE_FORMAT_LIBRARY], 8) != 0)
+  {
+    fprintf(stderr, "%s isn't a card library.\n", path);
+    munmap(mapping, sb.st_size);
+    return NULL;
+  }
+
+  *size = sb.st_size;
+  return mapping;
+
+}
+
+void library_cursor_init (struct library_cursor *cursor, const uint8_t *library, size_t size)
+{
+  cursor->library = library;
+  cursor->size = size;
+  cursor->block = get_le64(&library[16]);
+  cursor->position = 0;
+  cursor->number = 0;
+}
+
+/* Next entry of the index, NULL at the end (or on a damaged index)*/
+const uint8_t *library_next (struct library_cursor *cursor)
+{
+
+  const uint8_t *block;
+  const uint8_t *entry;
+
+  while (cursor->block != 0 && cursor->block + LIBRARY_BLOCK_HEADER_SIZE <= cursor->size)
+  {
+    block = &cursor->library[cursor->block];
+    if (cursor->position < get_le32(&block[0]) && cursor->block + LIBRARY_BLOCK_HEADER_SIZE + (uint64_t)(cursor->position + 1)*LIBRARY_ENTRY_SIZE <= cursor->size)
+    {
+      entry = &block[LIBRARY_BLOCK_HEADER_SIZE + cursor->position*LIBRARY_ENTRY_SIZE];
+      cursor->position++;
+      cursor->number++;
+      if (get_le64(&entry[0]) + sizeof(card_image) > cursor->size)
+      {
+        fprintf(stderr, "Image %u is out of the library.\n", cursor->number - 1);
+        return NULL;
+      }
+      return entry;
+    }
+    cursor->block = get_le64(&block[8]);
+    cursor->position = 0;
+  }
+
+  return NULL;
+
+}
+
+/* 1 if a save of the entry has text in file name or title*/
+int library_entry_match (const uint8_t *entry, const char *text)
+{
+
+  const uint8_t *record;
+  char name[21];
+  char title[65];
+  int s;
+
+  for (s = 0; s < entry[20] && s < 15; s++)
+  {
+    record = &entry[LIBRARY_ENTRY_HEADER_SIZE + s*LIBRARY_SAVE_SIZE];
+    memcpy(name, &record[0], 20);
+    name[20] = '\0';
+    memcpy(title, &record[20], 64);
+    title[64] = '\0';
+    if (strstr(name, text) != NULL || strstr(title, text) != NULL)
+    {
+      return 1;
+    }
+  }
+
+  return 0;
+
+}
+
+/* Entry chosen by the selector (see above), NULL if not found*/
+const uint8_t *library_find (const uint8_t *library, size_t size, const char *selector)
+{
+
+  struct library_cursor cursor;
+  const uint8_t *entry;
+  const uint8_t *found = NULL;
+  char *end;
+  unsigned long number = 0;
+  unsigned long fingerprint = 0;
+  int kind = 0;						/* 0 last, 1 number, 2 fingerprint, 3 text*/
+
+  if (selector != NULL && selector[0] != '\0')
+  {
+    kind = 3;
+    if (strncmp(selector, "0x", 2) == 0)
+    {
+      fingerprint = strtoul(selector + 2, &end, 16);
+      if (*end == '\0' && end != selector + 2)
+      {
+        kind = 2;
+      }
+    }
+    else
+    {
+      number = strtoul(selector, &end, 10);
+      if (*end == '\0')
+      {
+        kind = 1;
+      }
+    }
+  }
+
+  library_cursor_init(&cursor, library, size);
+  while ((entry = library_next(&cursor)) != NULL)
+  {
+    if (kind == 1 && cursor.number - 1 == number)
+    {
+      return entry;
+    }
+    if (kind == 0 || (kind == 2 && get_le32(&entry[16]) == fingerprint) || (kind == 3 && library_entry_match(entry, selector)))
+    {
+      found = entry;
+    }
+  }
+
+  if (found == NULL)
+  {
+    fprintf(stderr, "No image %s in the library.\n", selector != NULL && selector[0] != '\0' ? selector : "(the library is empty)");
+  }
+  return found;
+
+}
+
+/* Open an image of the library in reading, positioned on the first Data Frame*/
+FILE *library_open_read (const char *filename)
+{
+
+  char path[4096];
+  const char *selector = library_selector(filename, path, sizeof(path));
+  const uint8_t *library;
+  const uint8_t *entry;
+  uint64_t offset;
+  size_t size;
+  FILE *input;
+
+  library = library_map(path, &size);
+  if (library == NULL)
+  {
+    return NULL;
+  }
+  entry = library_find(library, size, selector);
+  if (entry == NULL)
+  {
+    munmap((void *)library, size);
+    return NULL;
+  }
+  offset = get_le64(&entry[0]);
+  munmap((void *)library, size);
+
+  input = fopen(path, "rb");
+  if (input == NULL)
+  {
+    fprintf(stderr, "Unable to open %s.\n", path);
+    return NULL;
+  }
+  fseek(input, offset, SEEK_SET);
+  return input;
+
+}
+
+/* Load an image of the library*/
+int library_load (const char *filename, uint8_t *image)
+{
+
+  char path[4096];
+  const char *selector = library_selector(filename, path, sizeof(path));
+  const uint8_t *library;
+  const uint8_t *entry;
+  size_t size;
+
+  library = library_map(path, &size);
+  if (library == NULL)
+  {
+    return 1;
+  }
+  entry = library_find(library, size, selector);
+  if (entry != NULL)
+  {
+    memcpy(image, &library[get_le64(&entry[0])], sizeof(card_image));
+  }
+  munmap((void *)library, size);
+
+  return entry == NULL;
+
+}
+
+/* Map the library, return the first Data Frame of the image or NULL (see image_map)*/
+const uint8_t *library_map_image (const char *filename, void **mapping, size_t *mapping_size)
+{
+
+  char path[4096];
+  const char *selector = library_selector(filename, path, sizeof(path));
+  const uint8_t *library;
+  const uint8_t *entry;
+  size_t size;
+
+  library = library_map(path, &size);
+  if (library == NULL)
+  {
+    return NULL;
+  }
+  entry = library_find(library, size, selector);
+  if (entry == NULL)
+  {
+    munmap((void *)library, size);
+    return NULL;
+  }
+
+  *mapping = (void *)library;
+  *mapping_size = size;
+  return &library[get_le64(&entry[0])];
+
+}
+
+uint64_t library_align (uint64_t offset)
+{
+  return (offset + LIBRARY_ALIGN - 1) / LIBRARY_ALIGN * LIBRARY_ALIGN;
+}
+
+/* Add an index block of LIBRARY_BLOCK_ENTRIES entries at offset*/
+int library_add_block (FILE *library, uint64_t offset)
+{
+
+  uint8_t block[16];
+
+  memset(block, 0, sizeof(block));
+  put_le32(&block[4], LIBRARY_BLOCK_ENTRIES);
+  fseek(library, offset, SEEK_SET);
+  fwrite(block, 1, sizeof(block), library);
+  fflush(library);
+
+  return ftruncate(fileno(library), offset + LIBRARY_BLOCK_HEADER_SIZE + (uint64_t)LIBRARY_BLOCK_ENTRIES*LIBRARY_ENTRY_SIZE);
+
+}
+
+/* Open (or create) the library for adding an image, positioned on the first Data Frame of the new image.
+   The image is added only by library_commit*/
+FILE *library_open_append (const char *filename)
+{
+
+  uint8_t header[64];
+  uint8_t block[16];
+  uint8_t link[8];
+  uint64_t last;
+  uint64_t end;
+
+  if (library_selector(filename, NULL, 0) != NULL)
+  {
+    fprintf(stderr, "New images are added at the end of the library, use the name of the library without @.\n");
+    return NULL;
+  }
+
+  /* One append at a time (the daemon and the command line): the library is locked until library_commit closes it.
+     The lock isn't waited, an urgent job of the daemon run inside an append of the same library would wait forever*/
+  int fd = open(filename, O_RDWR | O_CREAT, 0666);
+  FILE *library = fd >= 0 ? fdopen(fd, "r+b") : NULL;
+  if (library == NULL)
+  {
+    fprintf(stderr, "Unable to create %s.\n", filename);
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    return NULL;
+  }
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0)
+  {
+    fprintf(stderr, "%s is used by another command adding an image, try again at its end.\n", filename);
+    fclose(library);
+    return NULL;
+  }
+
+  fseek(library, 0, SEEK_END);
+  if (ftell(library) == 0)
+  {
+    /* New library with an empty index block*/
+    memset(header, 0, sizeof(header));
+    memcpy(header, IMAGE_MAGIC[IMAGE_FORMAT_LIBRARY], 8);
+    put_le32(&header[8], LIBRARY_VERSION);
+    put_le64(&header[16], LIBRARY_HEADER_SIZE);
+    put_le64(&header[24], LIBRARY_HEADER_SIZE);
+    fwrite(header, 1, LIBRARY_HEADER_SIZE, library);
+    if (library_add_block(library, LIBRARY_HEADER_SIZE) != 0)
+    {
+      fprintf(stderr, "Unable to create %s.\n", filename);
+      fclose(library);
+      return NULL;
+    }
+  }
+
+  fseek(library, 0, SEEK_SET);
+  if (fread(header, 1, LIBRARY_HEADER_SIZE, library) != LIBRARY_HEADER_SIZE || memcmp(header, IMAGE_MAGIC[IMAGE_FORMAT_LIBRARY], 8) != 0)
+  {
+    fprintf(stderr, "%s isn't a card library.\n", filename);
+    fclose(library);
+    return NULL;
+  }
+  last = get_le64(&header[24]);
+  fseek(library, last, SEEK_SET);
+  if (fread(block, 1, sizeof(block), library) != sizeof(block))
+  {
+    fprintf(stderr, "The index of %s is damaged.\n", filename);
+    fclose(library);
+    return NULL;
+  }
+  fseek(library, 0, SEEK_END);
+  end = ftell(library);
+
+  /* Last index block full, a new one after the images*/
+  if (get_le32(&block[0]) >= get_le32(&block[4]))
+  {
+    end = library_align(end);
+    if (library_add_block(library, end) != 0)
+    {
+      fprintf(stderr, "Unable to extend %s.\n", filename);
+      fclose(library);
+      return NULL;
+    }
+    put_le64(link, end);
+    fseek(library, last + 8, SEEK_SET);
+    fwrite(link, 1, sizeof(link), library);
+    fseek(library, 24, SEEK_SET);
+    fwrite(link, 1, sizeof(link), library);
+    last = end;
+    end += LIBRARY_BLOCK_HEADER_SIZE + (uint64_t)LIBRARY_BLOCK_ENTRIES*LIBRARY_ENTRY_SIZE;
+  }
+
+  library_append_block = last;
+  library_append_offset = library_align(end);
+  fseek(library, library_append_offset, SEEK_SET);
+  return library;
+
+}
+
+/* Write the index entry of the image written after library_open_append and close the library.
+   A partial image is removed*/
+int library_commit (FILE *library, int complete)
+{
+
+  struct ps1_card_index *index;
+  uint8_t *image;
+  uint8_t *entry;
+  uint8_t *record;
+  uint8_t count[4];
+  uint32_t number;
+  uint32_t fingerprint;
+  int error;
+  int s;
+
+  fflush(library);
+  if (!complete || ferror(library) || ftell(library) != library_append_offset + sizeof(card_image))
+  {
+    if (complete)
+    {
+      fprintf(stderr, "The image isn't complete, it isn't added to the library.\n");
+    }
+    if (ftruncate(fileno(library), library_append_offset) != 0)
+    {
+      fprintf(stderr, "Unable to remove the partial image from the library.\n");
+    }
+    fclose(library);
+    return 1;
+  }
+
+  image = malloc(sizeof(card_image));
+  entry = calloc(1, LIBRARY_ENTRY_SIZE);
+  index = malloc(sizeof(struct ps1_card_index));
+  if (image == NULL || entry == NULL || index == NULL)
+  {
+    fprintf(stderr, "Out of memory.\n");
+    free(image);
+    free(entry);
+    free(index);
+    fclose(library);
+    return 1;
+  }
+
+  fseek(library, library_append_offset, SEEK_SET);
+  fread(image, 1, sizeof(card_image), library);
+  ps1_index_build(index, image);
+  fingerprint = image_fingerprint(image, sizeof(card_image));
+
+  put_le64(&entry[0], library_append_offset);
+  put_le64(&entry[8], (uint64_t)time(NULL));
+  put_le32(&entry[16], fingerprint);
+  entry[20] = index->saves_count;
+  /* Id of the card in the ps3mca (asked once for the session), zero if the image doesn't come from a card*/
+  if (session_depth > 0 && !ps3mca_aborted && PS1_read_id(&entry[24]) != 0)
+  {
+    memset(&entry[24], 0, 8);
+  }
+  for (s = 0; s < index->saves_count; s++)
+  {
+    record = &entry[LIBRARY_ENTRY_HEADER_SIZE + s*LIBRARY_SAVE_SIZE];
+    memcpy(&record[0], index->saves[s].filename, strlen(index->saves[s].filename));
+    memcpy(&record[20], index->saves[s].title, strlen(index->saves[s].title));
+    record[84] = index->saves[s].first_block;
+    record[85] = index->saves[s].blocks;
+  }
+
+  /* The image is on the disk before its entry, the entry before the counts*/
+  fsync(fileno(library));
+  fseek(library, library_append_block, SEEK_SET);
+  fread(count, 1, sizeof(count), library);
+  fseek(library, library_append_block + LIBRARY_BLOCK_HEADER_SIZE + (uint64_t)get_le32(count)*LIBRARY_ENTRY_SIZE, SEEK_SET);
+  fwrite(entry, 1, LIBRARY_ENTRY_SIZE, library);
+  fflush(library);
+  fsync(fileno(library));
+  put_le32(count, get_le32(count) + 1);
+  fseek(library, library_append_block, SEEK_SET);
+  fwrite(count, 1, sizeof(count), library);
+  fseek(library, 12, SEEK_SET);
+  fread(count, 1, sizeof(count), library);
+  number = get_le32(count);
+  put_le32(count, number + 1);
+  fseek(library, 12, SEEK_SET);
+  fwrite(count, 1, sizeof(count), library);
+  fflush(library);
+  error = ferror(library);
+  fclose(library);
+
+  free(image);
+  free(entry);
+  free(index);
+
+  if (error)
+  {
+    fprintf(stderr, "Error writing the index of the library.\n");
+    return 1;
+  }
+  printf("Image %u added to the library (fingerprint %08x).\n", number, fingerprint);
+  return 0;
+
+}
+
+/* List the images of a library: number, time, fingerprint, card id and saves*/
+int library_list (const char *filename)
+{
+
+  struct library_cursor cursor;
+  const uint8_t *library;
+  const uint8_t *entry;
+  const uint8_t *record;
+  struct tm *date;
+  time_t added;
+  char text[20];
+  size_t size;
+  int s;
+  int i;
+
+  library = library_map(filename, &size);
+  if (library == NULL)
+  {
+    return 1;
+  }
+
+  printf("%u images in %s.\n", get_le32(&library[12]), filename);
+  library_cursor_init(&cursor, library, size);
+  while ((entry = library_next(&cursor)) != NULL)
+  {
+    added = (time_t)get_le64(&entry[8]);
+    date = localtime(&added);
+    strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", date);
+    printf("%u\t%s\tfingerprint %08x\tcard id ", cursor.number - 1, text, get_le32(&entry[16]));
+    for (i = 0; i < 8; i++)
+    {
+      printf("%02x", entry[24+i]);
+    }
+    printf("\t%d saves\n", entry[20]);
+
+    for (s = 0; s < entry[20] && s < 15; s++)
+    {
+      record = &entry[LIBRARY_ENTRY_HEADER_SIZE + s*LIBRARY_SAVE_SIZE];
+      printf("\tblock %2d (%d blocks)\t%.20s\t%.64s\n", record[84], record[85], (const char *)&record[0], (const char *)&record[20]);
+    }
+  }
+
+  munmap((void *)library, size);
+  return 0;
+
+}
+/* ---------------------------------------------------------End of Card library----------------------------------------------------*/
+
+
+
+
+
+
+
+
+
+/* ------------------------------------------------------------Shared memory-------------------------------------------------------*/
+/* The daemon has a ring of SHM_SLOTS images in a POSIX shared memory object (see Shared memory definitions), the name is
+   the reply of the request "shm". Clients map it (see ps3mca-ps1-client.h) and get the images without copies on the socket:
+   "shm" is the next slot of the ring (only for a new image, the reply of the job has "slot=n"), "shm:3" is the slot 3 and
+   "shm:/name" is a shared memory object of the client with an image at the start (for example the source of a write).
+   Read and write use the mapped image directly, the other commands read and write it as a file.
+   The sequence of a slot is odd while the daemon write the image: a client check it before and after using the image.*/
+uint8_t *shm_ring = NULL;				/* Ring mapped by the daemon, NULL out of the daemon*/
+char shm_name[64];
+int shm_writing_slot = -1;				/* Slot of the image being written, -1 if none*/
+int shm_output_slot = -1;				/* Slot of the last image written (for the reply of the job)*/
+
+uint8_t *shm_slot_header (int slot)
+{
+  return &shm_ring[SHM_RING_HEADER_SIZE + slot*SHM_SLOT_HEADER_SIZE];
+}
+
+/* Sequence of a slot, an aligned uint32_t updated only with atomic stores (a client never sees half a counter)*/
+uint32_t *shm_slot_sequence (int slot)
+{
+  return (uint32_t *)shm_slot_header(slot);
+}
+
+/* Create the ring of the daemon*/
+int shm_create ()
+{
+
+  int fd;
+
+  snprintf(shm_name, sizeof(shm_name), "/ps3mca-ps1-%d", (int)getpid());
+  fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0)
+  {
+    fprintf(stderr, "Unable to create the shared memory %s.\n", shm_name);
+    return 1;
+  }
+  if (ftruncate(fd, SHM_DATA_OFFSET + (off_t)SHM_SLOTS*sizeof(card_image)) != 0)
+  {
+    fprintf(stderr, "Unable to allocate the shared memory %s.\n", shm_name);
+    close(fd);
+    shm_unlink(shm_name);
+    return 1;
+  }
+  shm_ring = mmap(NULL, SHM_DATA_OFFSET + (size_t)SHM_SLOTS*sizeof(card_image), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (shm_ring == MAP_FAILED)
+  {
+    fprintf(stderr, "Unable to map the shared memory %s.\n", shm_name);
+    shm_ring = NULL;
+    shm_unlink(shm_name);
+    return 1;
+  }
+
+  memcpy(shm_ring, SHM_MAGIC, 8);
+  put_le32(&shm_ring[8], SHM_SLOTS);
+  put_le32(&shm_ring[12], sizeof(card_image));
+  put_le32(&shm_ring[16], SHM_DATA_OFFSET);
+  put_le32(&shm_ring[20], 0);
+
+  return 0;
+
+}
+
+void shm_destroy ()
+{
+  if (shm_ring != NULL)
+  {
+    munmap(shm_ring, SHM_DATA_OFFSET + (size_t)SHM_SLOTS*sizeof(card_image));
+    shm_unlink(shm_name);
+    shm_ring = NULL;
+  }
+}
+
+/* Open an image in shared memory as a file, positioned on the first Data Frame.
+   output is 1 for a new image: "shm" take the next slot of the ring and the slot is marked as being written*/
+FILE *shm_image_open (const char *filename, int output)
+{
+
+  struct stat sb;
+  const char *object = shm_name;
+  char *end;
+  long slot = -1;
+  off_t offset = 0;
+  FILE *image;
+  int fd;
+
+  if (strcmp(filename, "shm") == 0 && output)
+  {
+    if (shm_ring != NULL)
+    {
+      slot = get_le32(&shm_ring[20]);
+      put_le32(&shm_ring[20], (slot + 1) % SHM_SLOTS);
+    }
+  }
+  else if (strncmp(filename, "shm:/", 5) == 0)
+  {
+    object = filename + 4;
+  }
+  else if (strncmp(filename, "shm:", 4) == 0)
+  {
+    slot = strtol(filename + 4, &end, 10);
+    if (*end != '\0' || slot < 0 || slot >= SHM_SLOTS)
+    {
+      fprintf(stderr, "The slots of the shared memory are 0 to %d.\n", SHM_SLOTS - 1);
+      return NULL;
+    }
+  }
+  else
+  {
+    fprintf(stderr, "%s isn't an image in shared memory (shm, shm:slot or shm:/name).\n", filename);
+    return NULL;
+  }
+
+  if (object == shm_name)
+  {
+    if (shm_ring == NULL)
+    {
+      fprintf(stderr, "The slots of the shared memory are only in the daemon (\"ps3mca-ps1 h\").\n");
+      return NULL;
+    }
+    offset = SHM_DATA_OFFSET + (off_t)slot*sizeof(card_image);
+  }
+
+  fd = shm_open(object, output ? O_RDWR : O_RDONLY, 0);
+  if (fd < 0 || fstat(fd, &sb) != 0 || sb.st_size < offset + (off_t)sizeof(card_image))
+  {
+    fprintf(stderr, "Unable to open the shared memory %s.\n", object);
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    return NULL;
+  }
+  image = fdopen(fd, output ? "r+b" : "rb");
+  if (image == NULL)
+  {
+    close(fd);
+    return NULL;
+  }
+  fseek(image, offset, SEEK_SET);
+
+  /* Odd sequence while writing*/
+  if (output && object == shm_name)
+  {
+    shm_writing_slot = slot;
+    __atomic_store_n(shm_slot_sequence(slot), __atomic_load_n(shm_slot_sequence(slot), __ATOMIC_RELAXED) | 1, __ATOMIC_RELAXED);
+    /* The odd sequence is visible before the first frame of the image*/
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    put_le32(&shm_slot_header(slot)[4], SHM_SLOT_WRITING);
+  }
+
+  return image;
+
+}
+
+/* Map the image of a file opened by shm_image_open, NULL if it can't be mapped. Unmap mapping with sizeof(card_image)*/
+uint8_t *shm_image_map (FILE *image, int output, void **mapping)
+{
+
+  *mapping = mmap(NULL, sizeof(card_image), output ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fileno(image), ftell(image));
+  if (*mapping == MAP_FAILED)
+  {
+    return NULL;
+  }
+  return *mapping;
+
+}
+
+/* Close a new image, the slot of the ring has the fingerprint and an even sequence*/
+int shm_image_close (FILE *image, int complete)
+{
+
+  uint8_t *header;
+  uint8_t *data;
+  int error;
+
+  fflush(image);
+  error = ferror(image);
+  fclose(image);
+
+  if (shm_writing_slot >= 0)
+  {
+    header = shm_slot_header(shm_writing_slot);
+    data = &shm_ring[SHM_DATA_OFFSET + (size_t)shm_writing_slot*sizeof(card_image)];
+    put_le32(&header[4], complete && !error ? SHM_SLOT_GOOD : SHM_SLOT_INCOMPLETE);
+    put_le32(&header[8], image_fingerprint(data, sizeof(card_image)));
+    /* Image, state and fingerprint are visible before the even sequence*/
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(shm_slot_sequence(shm_writing_slot), __atomic_load_n(shm_slot_sequence(shm_writing_slot), __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    shm_output_slot = shm_writing_slot;
+    shm_writing_slot = -1;
+  }
+
+  return error != 0 || !complete;
+
+}
+/* --------------------------------------------------------End of Shared memory----------------------------------------------------*/
+
+
+
+
+
+
+
+
+
+/* -----------------------------------------------------------Archive scanner------------------------------------------------------*/
+/* Validate all the images (*.mcd, *.mcr, *.psm, *.ps, *.ddf, *.mc, *.mem, *.psx, *.vm1) of a directory tree with one thread for every CPU,
+   every image is mapped in memory and checked with the card index (size, header, directory checksums and block chains).
+   The saves of the good images are written in a tab separated index sorted by product code:
+   product code, title, region, identifier, first block, blocks, image file name.*/
+struct archive_entry
+{
+  uint32_t image;					/* Position in archive_files*/
+  uint8_t first_block;
+  uint8_t blocks;
+  char region[3];
+  char product_code[11];
+  char identifier[9];
+  char title[65];
+};
+
+struct archive_worker
+{
+  pthread_t thread;
+  struct archive_entry *entries;			/* Saves found by this thread*/
+  size_t entries_count;
+  size_t entries_size;
+  size_t bad_images;
+};
+
+char **archive_files = NULL;				/* Images found in the directory tree*/
+size_t archive_files_count = 0;
+size_t archive_files_size = 0;
+size_t archive_next_file = 0;				/* Next image to scan, shared between threads*/
+
+const char *ARCHIVE_EXTENSIONS[] = { ".mcd", ".mcr", ".psm", ".ps", ".ddf", ".mc", ".mem", ".psx", ".psv", ".vm1", NULL };
+
+/* Forget the images found, for the next scan of the same process (batch script, daemon)*/
+void archive_files_free ()
+{
+
+  size_t i;
+
+  for (i = 0; i < archive_files_count; i++)
+  {
+    free(archive_files[i]);
+  }
+  free(archive_files);
+  archive_files = NULL;
+  archive_files_count = 0;
+  archive_files_size = 0;
+  archive_next_file = 0;
+
+}
+
+int archive_add_file (const char *path, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+{
+
+  const char *extension = strrchr(path, '.');
+  char **files;
+  char *name;
+  int e;
+
+  (void)sb;
+  (void)ftwbuf;
+  if (typeflag != FTW_F || extension == NULL)
+  {
+    return 0;
+  }
+
+  for (e = 0; ARCHIVE_EXTENSIONS[e] != NULL; e++)
+  {
+    if (strcasecmp(extension, ARCHIVE_EXTENSIONS[e]) == 0)
+    {
+      /* On error the files already found stay in archive_files, for archive_files_free*/
+      if (archive_files_count == archive_files_size)
+      {
+        files = realloc(archive_files, (archive_files_size == 0 ? 1024 : archive_files_size*2)*sizeof(char *));
+        if (files == NULL)
+        {
+          fprintf(stderr, "Out of memory.\n");
+          return 1;
+        }
+        archive_files = files;
+        archive_files_size = archive_files_size == 0 ? 1024 : archive_files_size*2;
+      }
+      name = strdup(path);
+      if (name == NULL)
+      {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+      }
+      archive_files[archive_files_count++] = name;
+      break;
+    }
+  }
+
+  return 0;
+
+}
+
+/* Check one image, return NULL if good or the reason*/
+const char *archive_check_image (const char *path, struct ps1_card_index *index)
+{
+
+  struct stat sb;
+  uint8_t *image;
+  int s;
+  int format;
+  const char *problem = NULL;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+  {
+    return "unable to open";
+  }
+  if (fstat(fd, &sb) != 0 || sb.st_size < sizeof(card_image) || sb.st_size > sizeof(card_image)+256)
+  {
+    close(fd);
+    return "isn't a 128 KiB image";
+  }
+
+  image = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED)
+  {
+    return "unable to map";
+  }
+
+  format = image_format_detect(image, sb.st_size);
+  if (format < 0)
+  {
+    munmap(image, sb.st_size);
+    return "unknown image header";
+  }
+  ps1_index_build(index, image + IMAGE_HEADER_SIZE[format]);
+  munmap(image, sb.st_size);
+
+  if (!index->formatted)
+  {
+    problem = "not formatted";
+  }
+  else if (index->bad_checksum != 0)
+  {
+    problem = "wrong checksum on header or directory";
+  }
+  for (s = 0; problem == NULL && s < index->saves_count; s++)
+  {
+    if (index->saves[s].broken_chain)
+    {
+      problem = "broken block chain or wrong file size";
+    }
+  }
+
+  return problem;
+
+}
+
+void *archive_worker_scan (void *argument)
+{
+
+  struct archive_worker *worker = argument;
+  struct ps1_card_index index;
+  struct archive_entry *entry;
+  const char *problem;
+  size_t file;
+  int s;
+
+  while ((file = __sync_fetch_and_add(&archive_next_file, 1)) < archive_files_count)
+  {
+    problem = archive_check_image(archive_files[file], &index);
+    if (problem != NULL)
+    {
+      fprintf(stderr, "%s: %s.\n", archive_files[file], problem);
+      worker->bad_images++;
+      continue;
+    }
+
+    for (s = 0; s < index.saves_count; s++)
+    {
+      if (worker->entries_count == worker->entries_size)
+      {
+        worker->entries_size = worker->entries_size == 0 ? 1024 : worker->entries_size*2;
+        worker->entries = realloc(worker->entries, worker->entries_size*sizeof(struct archive_entry));
+        if (worker->entries == NULL)
+        {
+          fprintf(stderr, "Out of memory.\n");
+          exit(1);
+        }
+      }
+      entry = &worker->entries[worker->entries_count++];
+      entry->image = file;
+      entry->first_block = index.saves[s].first_block;
+      entry->blocks = index.saves[s].blocks;
+      memcpy(entry->region, index.saves[s].region, sizeof(entry->region));
+      memcpy(entry->product_code, index.saves[s].product_code, sizeof(entry->product_code));
+      memcpy(entry->identifier, index.saves[s].identifier, sizeof(entry->identifier));
+      memcpy(entry->title, index.saves[s].title, sizeof(entry->title));
+    }
+  }
+
+  return NULL;
+
+}
+
+int archive_entry_compare (const void *a, const void *b)
+{
+
+  const struct archive_entry *first = a;
+  const struct archive_entry *second = b;
+  int order = strcmp(first->product_code, second->product_code);
+
+  if (order == 0)
+  {
+    order = strcmp(first->title, second->title);
+  }
+  if (order == 0)
+  {
+    order = strcmp(archive_files[first->image], archive_files[second->image]);
+  }
+
+  return order;
+
+}
+
+int PS1_archive_scan (const char *directory, const char *index_name)
+{
+
+  struct archive_worker *workers;
+  struct archive_entry *entries;
+  size_t entries_count = 0;
+  size_t bad_images = 0;
+  size_t i;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  long t;
+
+  if (threads < 1)
+  {
+    threads = 1;
+  }
+
+  if (nftw(directory, archive_add_file, 64, FTW_PHYS) != 0)
+  {
+    fprintf(stderr, "Error scanning %s.\n", directory);
+    archive_files_free();
+    return 1;
+  }
+  printf("%lu images found in %s, scanning with %ld threads.\n", (unsigned long)archive_files_count, directory, threads);
+
+  workers = calloc(threads, sizeof(struct archive_worker));
+  if (workers == NULL)
+  {
+    fprintf(stderr, "Out of memory.\n");
+    return 1;
+  }
+  for (t = 0; t < threads; t++)
+  {
+    if (pthread_create(&workers[t].thread, NULL, archive_worker_scan, &workers[t]) != 0)
+    {
+      fprintf(stderr, "Unable to start thread %ld.\n", t);
+      threads = t;
+      break;
+    }
+  }
+
+  /* Without threads scan here*/
+  if (threads == 0)
+  {
+    threads = 1;
+    archive_worker_scan(&workers[0]);
+  }
+  else
+  {
+    for (t = 0; t < threads; t++)
+    {
+      pthread_join(workers[t].thread, NULL);
+    }
+  }
+
+  /* Merge the saves found by every thread*/
+  for (t = 0; t < threads; t++)
+  {
+    entries_count += workers[t].entries_count;
+    bad_images += workers[t].bad_images;
+  }
+  entries = malloc((entries_count > 0 ? entries_count : 1)*sizeof(struct archive_entry));
+  if (entries == NULL)
+  {
+    fprintf(stderr, "Out of memory.\n");
+    return 1;
+  }
+  entries_count = 0;
+  for (t = 0; t < threads; t++)
+  {
+    if (workers[t].entries_count > 0)
+    {
+      memcpy(&entries[entries_count], workers[t].entries, workers[t].entries_count*sizeof(struct archive_entry));
+    }
+    entries_count += workers[t].entries_count;
+    free(workers[t].entries);
+  }
+  free(workers);
+  qsort(entries, entries_count, sizeof(struct archive_entry), archive_entry_compare);
+
+  FILE *output=fopen( index_name, "w" );
+  if (output == NULL)
+  {
+    fprintf(stderr, "Unable to create %s.\n", index_name);
+    return 1;
+  }
+  for (i = 0; i < entries_count; i++)
+  {
+    fprintf(output, "%s\t%s\t%s\t%s\t%d\t%d\t%s\n", entries[i].product_code, entries[i].title, entries[i].region, entries[i].identifier,
+            entries[i].first_block, entries[i].blocks, archive_files[entries[i].image]);
+  }
+  fclose(output);
+  free(entries);
+
+  printf("%lu good images, %lu bad images, %lu saves in %s.\n", (unsigned long)(archive_files_count - bad_images), (unsigned long)bad_images,
+         (unsigned long)entries_count, index_name);
+
+  archive_files_free();
+
+  return bad_images != 0;
+
+}
+/* -------------------------------------------------------End of Archive scanner---------------------------------------------------*/
+
+
+
+
+
+
+
+
+
+/* -----------------------------------------------------------Batch conversion-----------------------------------------------------*/
+/* Convert all the images of a directory tree (same extensions of Archive scanner) in another format, one thread for every CPU.
+   The converted images are in the output directory at the same path of the input tree, with the new extension.*/
+const char *batch_input_directory;
+const char *batch_output_directory;
+const char *batch_extension;
+
+/* Create the directories of a file path (like mkdir -p of its directory), return 0 if they exist*/
+int make_parent_directories (const char *path)
+{
+
+  char directory[4096];
+  char *slash;
+
+  if (strlen(path) >= sizeof(directory))
+  {
+    return 1;
+  }
+  strcpy(directory, path);
+
+  for (slash = strchr(directory + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+  {
+    *slash = '\0';
+    if (mkdir(directory, 0777) != 0 && errno != EEXIST)
+    {
+      fprintf(stderr, "Unable to create the directory %s.\n", directory);
+      return 1;
+    }
+    *slash = '/';
+  }
+
+  return 0;
+
+}
+
+void *batch_worker_convert (void *argument)
+{
+
+  size_t *errors = argument;
+  size_t file;
+  size_t input_size = strlen(batch_input_directory);
+  const char *name;
+  const char *extension;
+  char output_name[4096];
+
+  while ((file = __sync_fetch_and_add(&archive_next_file, 1)) < archive_files_count)
+  {
+    /* Path in the input tree*/
+    name = archive_files[file];
+    if (strncmp(name, batch_input_directory, input_size) == 0)
+    {
+      name += input_size;
+    }
+    name += strspn(name, "/");
+    extension = strrchr(name, '.');
+
+    if (snprintf(output_name, sizeof(output_name), "%s/%.*s.%s", batch_output_directory, (int)(extension - name), name, batch_extension) >= (int)sizeof(output_name) ||
+        make_parent_directories(output_name) != 0 || image_convert(archive_files[file], output_name) != 0)
+    {
+      (*errors)++;
+    }
+  }
+
+  return NULL;
+
+}
+int PS1_batch_convert (const char *input_directory, const char *output_directory, const char *extension)
+{
+
+  pthread_t *threads_id;
+  size_t *errors;
+  size_t total_errors = 0;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  long t;
+
+  if (threads < 1)
+  {
+    threads = 1;
+  }
+
+  batch_input_directory = input_directory;
+  batch_output_directory = output_directory;
+  batch_extension = extension[0] == '.' ? extension + 1 : extension;
+
+  if (nftw(input_directory, archive_add_file, 64, FTW_PHYS) != 0)
+  {
+    fprintf(stderr, "Error scanning %s.\n", input_directory);
+    archive_files_free();
+    return 1;
+  }
+  printf("%lu images found in %s, converting to .%s with %ld threads.\n", (unsigned long)archive_files_count, input_directory, batch_extension, threads);
+
+  threads_id = calloc(threads, sizeof(pthread_t));
+  errors = calloc(threads, sizeof(size_t));
+  if (threads_id == NULL || errors == NULL)
+  {
+    fprintf(stderr, "Out of memory.\n");
+    return 1;
+  }
+
+  for (t = 0; t < threads; t++)
+  {
+    if (pthread_create(&threads_id[t], NULL, batch_worker_convert, &errors[t]) != 0)
+    {
+      break;
+    }
+  }
+  threads = t;
+  for (t = 0; t < threads; t++)
+  {
+    pthread_join(threads_id[t], NULL);
+  }
+  /* Without threads convert here*/
+  if (threads == 0)
+  {
+    threads = 1;
+    batch_worker_convert(&errors[0]);
+  }
+
+  for (t = 0; t < threads; t++)
+  {
+    total_errors += errors[t];
+  }
+  free(threads_id);
+  free(errors);
+
+  printf("%lu images converted, %lu errors.\n", (unsigned long)(archive_files_count - total_errors), (unsigned long)total_errors);
+
+  archive_files_free();
+
+  return total_errors != 0;
+
+}
+/* -------------------------------------------------------End of Batch conversion--------------------------------------------------*/
+
+
+
+
+
+
+
+
+
+/* -------------------------------------------------------------Delta images--------------------------------------------------------*/
+/* A delta image record only the frames that differ from a baseline image (see ps3mca-ps1-driver.h).*/
+/* The baseline can be a raw image or another delta image, so every version of a card can be rebuilt.*/
+
+/* Name of the baseline saved in the delta image filename (see delta_baseline_path): only the file name if the baseline
+   is in the same directory of the delta, else the full path. Return 0 if it is in 256 bytes*/
+int delta_stored_name (const char *filename, const char *baseline_name, char *stored)
+{
+
+  char file[PATH_MAX];
+  char absolute[PATH_MAX];
+  char directory[PATH_MAX];
+  const char *selector;
+  const char *slash = strrchr(filename, '/');
+  char *base;
+  int size;
+
+  selector = library_selector(baseline_name, file, sizeof(file));
+  snprintf(directory, sizeof(directory), "%.*s", slash != NULL ? (int)(slash - filename + 1) : 1, slash != NULL ? filename : ".");
+  /* The baseline in shared memory (or a file not found) is saved as it is*/
+  if (image_format_from_name(baseline_name) == IMAGE_FORMAT_SHM || realpath(file, absolute) == NULL || realpath(directory, file) == NULL)
+  {
+    size = snprintf(stored, 257, "%s", baseline_name);
+  }
+  else
+  {
+    base = strrchr(absolute, '/');
+    *base = '\0';
+    if (strcmp(absolute, file) == 0)
+    {
+      size = snprintf(stored, 257, "%s%s%s", base + 1, selector != NULL ? "@" : "", selector != NULL ? selector : "");
+    }
+    else
+    {
+      size = snprintf(stored, 257, "%s/%s%s%s", absolute, base + 1, selector != NULL ? "@" : "", selector != NULL ? selector : "");
+    }
+  }
+  if (size > 256)
+  {
+    fprintf(stderr, "Baseline file name %s is too long.\n", baseline_name);
+    return 1;
+  }
+
+  return 0;
+
+}
+
+/* Save only the frames of image that differ from baseline, return the number of saved frames or -1 on error*/
+int write_delta (const char *filename, const char *baseline_name, const uint8_t *baseline, const uint8_t *image)
+{
+
+  uint8_t header[272];
+  uint8_t record[130];
+  char stored[257];
+  int records = 0;
+
+  if (delta_stored_name(filename, baseline_name, stored) != 0)
+  {
+    return -1;
+  }
+
+  FILE *output=fopen( filename, "wb" );	/* Open and create a binary file output in writing*/
+  if (output == NULL)
+  {
+    fprintf(stderr, "Unable to create %s.\n", filename);
+    return -1;
+  }
+
+  for (frame = PS1CARD_MIN_FRAME; frame <= PS1CARD_MAX_FRAME; frame++)
+  {
+    if (memcmp(&baseline[frame*PS1CARD_FRAME_SIZE], &image[frame*PS1CARD_FRAME_SIZE], PS1CARD_FRAME_SIZE) != 0)
+    {
+      records++;
+    }
+  }
+
+  memset(header, 0, sizeof(header));
+  memcpy(header, DELTA_MAGIC, 8);
+  put_le32(&header[8], records);
+  put_le32(&header[12], image_fingerprint(baseline, sizeof(card_image)));
+  memcpy(&header[16], stored, strlen(stored));
+  fwrite(header, 1, DELTA_HEADER_SIZE, output);
+
+  for (frame = PS1CARD_MIN_FRAME; frame <= PS1CARD_MAX_FRAME; frame++)
+  {
+    if (memcmp(&baseline[frame*PS1CARD_FRAME_SIZE], &image[frame*PS1CARD_FRAME_SIZE], PS1CARD_FRAME_SIZE) != 0)
+    {
+      record[0] = (uint8_t)(frame & 0x00FF);
+      record[1] = (uint8_t)((frame & 0xFF00) >> 8);
+      memcpy(&record[2], &image[frame*PS1CARD_FRAME_SIZE], PS1CARD_FRAME_SIZE);
+      fwrite(record, 1, DELTA_RECORD_SIZE, output);
+    }
+  }
+
+  fflush(output);
+  if (ferror(output))
+  {
+    fprintf(stderr, "Error writing %s.\n", filename);
+    fclose(output);
+    return -1;
+  }
+  fclose(output);
+
+  return records;
+
+}
+
+/* Read the card and save only the differences with a previous image of the same card*/
+int PS1_delta_read (const char *baseline_name)
+{
+
+  char filename[70];
+  int errors = 0;
+  int directory_unchanged;
+  int records;
+
+  if (load_image(baseline_name, baseline_image) != 0)
+  {
+    return 1;
+  }
+
+  if (open_ps1_card() != 0)
+  {
+    return 1;
+  }
+
+  memset(card_image, 0, sizeof(card_image));
+
+  /* Quick pre-read of header and directory (frame 0 to 15)*/
+  for (frame = PS1CARD_MIN_FRAME; frame <= PS1CARD_DIRECTORY_LAST_FRAME; frame++)
+  {
+    if (PS1_read_frame(frame, &card_image[frame*PS1CARD_FRAME_SIZE]) < 0)
+    {
+      errors++;
+    }
+  }
+
+  /* Same directory, the free blocks of the card can be taken from the baseline*/
+  directory_unchanged = (errors == 0 && memcmp(card_image, baseline_image, (PS1CARD_DIRECTORY_LAST_FRAME+1)*PS1CARD_FRAME_SIZE) == 0);
+  ps1_index_build(&card_index, card_image);
+  if (directory_unchanged)
+  {
+    printf("Directory unchanged since %s, free blocks are not read.\n", baseline_name);
+  }
+  else
+  {
+    printf("Directory changed since %s, reading all the memory card.\n", baseline_name);
+  }
+
+  for (frame = PS1CARD_DIRECTORY_LAST_FRAME+1; frame <= PS1CARD_MAX_FRAME && !ps3mca_aborted; frame++)
+  {
+    if (directory_unchanged && ps1_index_block_free(&card_index, frame/PS1CARD_BLOCK_FRAMES))
+    {
+      memcpy(&card_image[frame*PS1CARD_FRAME_SIZE], &baseline_image[frame*PS1CARD_FRAME_SIZE], PS1CARD_FRAME_SIZE);
+      continue;
+    }
+
+    if (PS1_read_frame(frame, &card_image[frame*PS1CARD_FRAME_SIZE]) < 0)
+    {
+      errors++;
+    }
+  }
+
+  /* Unmount the ps3mca*/
+  close_ps3mca();
+
+  if (ps3mca_aborted)
+  {
+    fprintf(stderr, "Reading aborted at frame %d, delta image not saved.\n", frame - 1);
+    return 1;
+  }
+
+  output_filename(filename, "mcdelta");
+  records = write_delta(filename, baseline_name, baseline_image, card_image);
+  if (records < 0)
+  {
+    return 1;
+  }
+
+  printf("%d frames differ from %s, saved in %s.\n", records, baseline_name, filename);
+  if (errors != 0)
+  {
+    fprintf(stderr, "%d frames not received, they are saved as empty frames.\n", errors);
+    return 1;
+  }
+
+  return 0;
+
+}
+
+/* Return 1 if the file is a delta image*/
+int is_delta_image (const char *filename)
+{
+
+  uint8_t magic[8];
+  int delta = 0;
+
+  FILE *input=fopen( filename, "rb" );
+  if (input != NULL)
+  {
+    delta = (fread(magic, 1, sizeof(magic), input) == sizeof(magic) && memcmp(magic, DELTA_MAGIC, 8) == 0);
+    fclose(input);
+  }
+
+  return delta;
+
+}
+
+/* Load only the frames saved in a delta image (the baseline isn't needed), frame_changed[n] is 1 for every saved frame.
+   baseline_name (257 bytes) and fingerprint are the baseline in the header*/
+int load_delta_frames (const char *filename, uint8_t *image, uint8_t *frame_changed, char *baseline_name, uint32_t *fingerprint)
+{
+
+  uint8_t header[272];
+  uint8_t record[130];
+  uint32_t records;
+  uint32_t r;
+  uint16_t record_frame;
+
+  FILE *input=fopen( filename, "rb" );
+  if (input == NULL)
+  {
+    fprintf(stderr, "Unable to open %s.\n", filename);
+    return 1;
+  }
+
+  if (fread(header, 1, DELTA_HEADER_SIZE, input) != DELTA_HEADER_SIZE || memcmp(header, DELTA_MAGIC, 8) != 0)
+  {
+    fprintf(stderr, "%s isn't a delta image.\n", filename);
+    fclose(input);
+    return 1;
+  }
+
+  memset(frame_changed, 0, PS1CARD_MAX_FRAME+1);
+  records = get_le32(&header[8]);
+  *fingerprint = get_le32(&header[12]);
+  memcpy(baseline_name, &header[16], 256);
+  baseline_name[256] = '\0';
+  for (r = 0; r < records; r++)
+  {
+    if (fread(record, 1, DELTA_RECORD_SIZE, input) != DELTA_RECORD_SIZE)
+    {
+      fprintf(stderr, "%s is truncated at record %u.\n", filename, r);
+      fclose(input);
+      return 1;
+    }
+
+    record_frame = (uint16_t)(record[0] | (record[1] << 8));
+    if (record_frame > PS1CARD_MAX_FRAME)
+    {
+      fprintf(stderr, "Impossible frame %d in %s.\n", record_frame, filename);
+      fclose(input);
+      return 1;
+    }
+    memcpy(&image[record_frame*PS1CARD_FRAME_SIZE], &record[2], PS1CARD_FRAME_SIZE);
+    frame_changed[record_frame] = 1;
+  }
+
+  fclose(input);
+  return 0;
+
+}
+
+/* Read from the card header, directory, broken frame list and the frames of the delta in the range, for the checks
+   before the write*/
+int delta_read_card (const char *filename, const uint8_t *frame_changed, uint8_t *current)
+{
+
+  int f;
+
+  for (f = PS1CARD_MIN_FRAME; f <= PS1CARD_MAX_FRAME && !ps3mca_aborted; f++)
+  {
+    if (f > PS1CARD_BROKEN_LAST_FRAME && (f < first_frame || f > last_frame || !frame_changed[f]))
+    {
+      continue;
+    }
+    if (PS1_read_frame(f, &current[f*PS1CARD_FRAME_SIZE]) != 0)
+    {
+      fprintf(stderr, "Frame %d of the card not read, %s not written.\n", f, filename);
+      return 1;
+    }
+  }
+
+  return ps3mca_aborted;
+
+}
+
+/* The card must be the baseline of the delta: same directory and the frames of the delta in the range as in the baseline
+   (or already as in the delta, for a write done again). Without the baseline the card can't be checked.
+   With force only warnings. Return 0 if the delta can be written*/
+int delta_check_baseline (const char *filename, const char *baseline_name, uint32_t fingerprint, const uint8_t *image,
+                          const uint8_t *frame_changed, const uint8_t *current, int force)
+{
+
+  char baseline_path[PATH_MAX];
+  int different = 0;
+  int first_different = -1;
+  int f;
+
+  delta_baseline_path(filename, baseline_name, baseline_path, sizeof(baseline_path));
+  if (load_image(baseline_path, baseline_image) != 0 || image_fingerprint(baseline_image, sizeof(baseline_image)) != fingerprint)
+  {
+    fprintf(stderr, "The baseline %s of %s isn't available or is changed, the card can't be checked.\n", baseline_path, filename);
+    if (!force)
+    {
+      fprintf(stderr, "Nothing written, add \"force\" for writing %s anyway.\n", filename);
+      return 1;
+    }
+    return 0;
+  }
+
+  for (f = PS1CARD_MIN_FRAME; f <= PS1CARD_MAX_FRAME; f++)
+  {
+    if (f > PS1CARD_DIRECTORY_LAST_FRAME && (f < first_frame || f > last_frame || !frame_changed[f]))
+    {
+      continue;
+    }
+    if (memcmp(&current[f*PS1CARD_FRAME_SIZE], &baseline_image[f*PS1CARD_FRAME_SIZE], PS1CARD_FRAME_SIZE) == 0)
+    {
+      continue;
+    }
+    if (frame_changed[f] && memcmp(&current[f*PS1CARD_FRAME_SIZE], &image[f*PS1CARD_FRAME_SIZE], PS1CARD_FRAME_SIZE) == 0)
+    {
+      continue;
+    }
+    if (first_different < 0)
+    {
+      first_different = f;
+    }
+    different++;
+  }
+
+  if (different == 0)
+  {
+    return 0;
+  }
+  fprintf(stderr, "The card isn't the baseline %s of %s: %d frames differ (first frame %d).\n", baseline_path, filename, different, first_different);
+  if (!force)
+  {
+    fprintf(stderr, "Nothing written, add \"force\" for writing %s anyway.\n", filename);
+    return 1;
+  }
+
+  return 0;
+
+}
+
+/* Header, directory and broken frame list of the card after the delta image (frames of the card not in the delta)
+   must be good, like the images of PS1_write. Return 0 if they are or if the delta doesn't change them*/
+int delta_check_before_write (const char *filename, const uint8_t *image, const uint8_t *frame_changed, const uint8_t *current)
+{
+
+  uint8_t *check;
+  int fixable;
+  int touched = 0;
+  int result = 0;
+  int f;
+
+  for (f = first_frame; f <= last_frame && f <= PS1CARD_BROKEN_LAST_FRAME; f++)
+  {
+    touched |= frame_changed[f];
+  }
+  if (!touched)
+  {
+    return 0;
+  }
+
+  check = calloc(1, sizeof(card_image));
+  if (check == NULL)
+  {
+    fprintf(stderr, "Out of memory.\n");
+    return 1;
+  }
+
+  for (f = PS1CARD_MIN_FRAME; f <= PS1CARD_BROKEN_LAST_FRAME; f++)
+  {
+    memcpy(&check[f*PS1CARD_FRAME_SIZE], f >= first_frame && f <= last_frame && frame_changed[f] ? &image[f*PS1CARD_FRAME_SIZE] : &current[f*PS1CARD_FRAME_SIZE], PS1CARD_FRAME_SIZE);
+  }
+
+  if (image_validate(check, &fixable) > 0 || fixable > 0)
+  {
+    fprintf(stderr, "With %s the header, directory or broken frame list of the card would be wrong, nothing written.\n", filename);
+    result = 1;
+  }
+  free(check);
+
+  return result;
+
+}
+
+/* Differential write, only the frames of the delta image (between first_frame and last_frame) are written on a card
+   that is the baseline of the delta (with force also on another card)*/
+int PS1_write_delta (const char *filename, int force)
+{
+
+  uint8_t frame_changed[1024];
+  uint16_t order[1024];
+  char baseline_name[257];
+  uint32_t fingerprint;
+  uint8_t *current;
+  int count;
+  int written = 0;
+  int errors = 0;
+  int frame_status = 0;
+
+  if (load_delta_frames(filename, card_image, frame_changed, baseline_name, &fingerprint) != 0)
+  {
+    return 1;
+  }
+
+  if (!((first_frame >= PS1CARD_MIN_FRAME) && (first_frame <= PS1CARD_MAX_FRAME) && (last_frame >= PS1CARD_MIN_FRAME) && (last_frame <= PS1CARD_MAX_FRAME) && (first_frame <= last_frame)))
+  {
+    fprintf(stderr, "Error on number of sector, possible values are 0 to 1023.\n");
+    return 1;
+  }
+
+  if (open_ps1_card() != 0)
+  {
+    return 1;
+  }
+  load_card_profile();
+
+  /* Card of the baseline and good directory after the write*/
+  current = calloc(1, sizeof(card_image));
+  if (current == NULL || delta_read_card(filename, frame_changed, current) != 0 ||
+      delta_check_baseline(filename, baseline_name, fingerprint, card_image, frame_changed, current, force) != 0 ||
+      delta_check_before_write(filename, card_image, frame_changed, current) != 0)
+  {
+    free(current);
+    close_ps3mca();
+    return 1;
+  }
+  free(current);
+
+  /* Data blocks before directory, original frames in the undo journal*/
+  count = write_order(order, first_frame, last_frame, frame_changed);
+  if (journal_begin(order, count, card_image, 0, PS1CARD_FRAME_SIZE) != 0)
+  {
+    close_ps3mca();
+    return 1;
+  }
+
+  while (written < count && !ps3mca_aborted)
+  {
+    frame = order[written];
+    journal_mark(written);
+    frame_status = PS1_write_frame(frame, &card_image[frame*PS1CARD_FRAME_SIZE]);
+    written++;
+    /* PocketStation reject, abort*/
+    if (frame_status == -2)
+    {
+      break;
+    }
+    if (frame_status != 0)
+    {
+      errors++;
+    }
+  }
+  journal_end(!ps3mca_aborted && frame_status != -2 && errors == 0, written);
+
+  /* Unmount the ps3mca*/
+  close_ps3mca();
+
+  if (frame_status == -2)
+  {
+    return -1;
+  }
+  printf("%d changed frames written from %s, %d with errors.\n", written, filename, errors);
+  if (ps3mca_aborted)
+  {
+    fprintf(stderr, "Writing aborted at frame %d.\n", frame);
+    return 1;
+  }
+
+  return errors != 0;
+
+}
+
+/* Rebuild a raw image from a delta image*/
+int PS1_delta_materialize (const char *delta_name, const char *output_name)
+{
+
+  if (load_image(delta_name, card_image) != 0)
+  {
+    return 1;
+  }
+
+  FILE *output=fopen( output_name, "wb" );	/* Open and create a binary file output in writing*/
+  if (output == NULL)
+  {
+    fprintf(stderr, "Unable to create %s.\n", output_name);
+    return 1;
+  }
+
+  fwrite(card_image, 1, sizeof(card_image), output);
+  fflush(output);
+  fclose(output);
+
+  printf("%s rebuilt in %s.\n", delta_name, output_name);
+
+  return 0;
+
+}
+/* -----------------------------------------------------------End of Delta images---------------------------------------------------*/
+
+
+
+
+
+
+
+
+
+/* ------------------------------------------------------------Image validator-----------------------------------------------------*/
+/* Check of an image before writing it: header, directory entries, block links, broken frame list and the checksums of
+   frames 0 to 35. Emulators (pcsx-r) can save images that work on the emulator but not on a console. Empty directory
+   entries, pointers of free or last blocks, orphan blocks, impossible broken frames and checksums can be fixed, a missing
+   header or a broken block chain can't.*/
+void validator_fixable (int *fixable, uint16_t frame_number, const char *problem)
+{
+  (*fixable)++;
+  printf("Frame %d: %s, can be fixed.\n", frame_number, problem);
+}
+
+/* Check the image and fix it in memory (only frames 0 to 35 are changed), return the number of problems that can't be fixed*/
+int image_validate (uint8_t *image, int *fixable)
+{
+
+  struct ps1_card_index index;
+  uint8_t changed[64];
+  uint8_t empty[128];
+  uint8_t *entry;
+  uint32_t broken;
+  int unfixable = 0;
+  int block;
+  int last;
+  int s;
+  int f;
+
+  *fixable = 0;
+  memset(changed, 0, sizeof(changed));
+  memset(empty, 0, sizeof(empty));
+
+  /* Header*/
+  if (image[0] != 'M' || image[1] != 'C')
+  {
+    fprintf(stderr, "Frame 0: isn't a memory card header (\"MC\" missing), can't be fixed.\n");
+    return 1;
+  }
+
+  /* Directory entries, a free entry is A0h with next block FFFFh*/
+  for (block = 1; block < PS1CARD_BLOCKS; block++)
+  {
+    entry = &image[block*PS1CARD_FRAME_SIZE];
+    if (entry[0] == PS1CARD_DIR_FIRST_BLOCK || entry[0] == PS1CARD_DIR_MIDDLE_BLOCK || entry[0] == PS1CARD_DIR_LAST_BLOCK)
+    {
+      continue;
+    }
+
+    if (memcmp(entry, empty, PS1CARD_FRAME_SIZE) == 0)
+    {
+      entry[0] = PS1CARD_DIR_FREE_BLOCK;
+      entry[PS1CARD_DIR_NEXT_OFFSET] = 0xff;
+      entry[PS1CARD_DIR_NEXT_OFFSET+1] = 0xff;
+      changed[block] = 1;
+      validator_fixable(fixable, block, "empty directory entry instead of a free block");
+    }
+    else if ((entry[0] & 0xf0) != PS1CARD_DIR_FREE_BLOCK)
+    {
+      fprintf(stderr, "Frame %d: unknown block state %xh, can't be fixed.\n", block, entry[0]);
+      unfixable++;
+    }
+    else if (entry[0] == PS1CARD_DIR_FREE_BLOCK && (entry[PS1CARD_DIR_NEXT_OFFSET] != 0xff || entry[PS1CARD_DIR_NEXT_OFFSET+1] != 0xff))
+    {
+      entry[PS1CARD_DIR_NEXT_OFFSET] = 0xff;
+      entry[PS1CARD_DIR_NEXT_OFFSET+1] = 0xff;
+      changed[block] = 1;
+      validator_fixable(fixable, block, "free block with a next block");
+    }
+  }
+
+  /* Block links, from the index of the image*/
+  ps1_index_build(&index, image);
+  for (s = 0; s < index.saves_count; s++)
+  {
+    if (index.saves[s].broken_chain)
+    {
+      fprintf(stderr, "Frame %d: save %s has a broken block chain or a wrong file size, can't be fixed.\n", index.saves[s].first_block, index.saves[s].filename);
+      unfixable++;
+      continue;
+    }
+
+    last = index.saves[s].chain[index.saves[s].blocks - 1];
+    entry = &image[last*PS1CARD_FRAME_SIZE];
+    if (entry[PS1CARD_DIR_NEXT_OFFSET] != 0xff || entry[PS1CARD_DIR_NEXT_OFFSET+1] != 0xff)
+    {
+      entry[PS1CARD_DIR_NEXT_OFFSET] = 0xff;
+      entry[PS1CARD_DIR_NEXT_OFFSET+1] = 0xff;
+      changed[last] = 1;
+      validator_fixable(fixable, last, "last block of a save with a next block");
+    }
+  }
+
+  /* Middle and last blocks of no save are freed*/
+  for (block = 1; block < PS1CARD_BLOCKS; block++)
+  {
+    entry = &image[block*PS1CARD_FRAME_SIZE];
+    if ((entry[0] == PS1CARD_DIR_MIDDLE_BLOCK || entry[0] == PS1CARD_DIR_LAST_BLOCK) && index.block_owner[block] == -1)
+    {
+      memset(entry, 0, PS1CARD_FRAME_SIZE);
+      entry[0] = PS1CARD_DIR_FREE_BLOCK;
+      entry[PS1CARD_DIR_NEXT_OFFSET] = 0xff;
+      entry[PS1CARD_DIR_NEXT_OFFSET+1] = 0xff;
+      changed[block] = 1;
+      validator_fixable(fixable, block, "block of no save");
+    }
+  }
+
+  /* Broken frame list, a number out of the file blocks would make the console replace a good frame*/
+  for (f = PS1CARD_BROKEN_FIRST_FRAME; f <= PS1CARD_BROKEN_LAST_FRAME; f++)
+  {
+    entry = &image[f*PS1CARD_FRAME_SIZE];
+    broken = get_le32(entry);
+    if (broken == 0xffffffff)
+    {
+      continue;
+    }
+
+    if (broken < PS1CARD_BLOCK_FRAMES || broken > PS1CARD_MAX_FRAME)
+    {
+      put_le32(entry, 0xffffffff);
+      changed[f] = 1;
+      validator_fixable(fixable, f, "impossible broken frame in the list");
+    }
+    else
+    {
+      printf("Frame %d: frame %u is marked broken, replaced by frame %d.\n", f, broken, f + PS1CARD_BROKEN_LAST_FRAME - PS1CARD_BROKEN_FIRST_FRAME + 1);
+    }
+  }
+
+  /* Checksums last, for the changed frames too*/
+  for (f = PS1CARD_MIN_FRAME; f <= PS1CARD_BROKEN_LAST_FRAME; f++)
+  {
+    entry = &image[f*PS1CARD_FRAME_SIZE];
+    if (entry[PS1CARD_CHECKSUM_OFFSET] != directory_frame_checksum(entry))
+    {
+      entry[PS1CARD_CHECKSUM_OFFSET] = directory_frame_checksum(entry);
+      if (!changed[f])
+      {
+        validator_fixable(fixable, f, "wrong checksum");
+      }
+    }
+  }
+
+  return unfixable;
+
+}
+
+/* Check an image without changing it, return 1 if it must not be written*/
+int image_check_before_write (const char *filename, uint8_t *image)
+{
+
+  int fixable;
+
+  if (load_image(filename, image) != 0)
+  {
+    return 1;
+  }
+  if (image_validate(image, &fixable) > 0)
+  {
+    fprintf(stderr, "%s can't be written on a card.\n", filename);
+    return 1;
+  }
+  if (fixable > 0)
+  {
+    fprintf(stderr, "Fix %s with \"ps3mca-ps1 n %s\" before writing it.\n", filename, filename);
+    return 1;
+  }
+
+  return 0;
+
+}
+
+/* Check an image and fix it in place, return 1 if it can't be written on a card*/
+int PS1_validate (const char *filename)
+{
+
+  int fixable;
+  int unfixable;
+  int format;
+  FILE *image;
+
+  if (load_image(filename, card_image) != 0)
+  {
+    return 1;
+  }
+
+  unfixable = image_validate(card_image, &fixable);
+  if (unfixable > 0)
+  {
+    fprintf(stderr, "%s has %d problems that can't be fixed, the image is unchanged.\n", filename, unfixable);
+    return 1;
+  }
+  if (fixable == 0)
+  {
+    printf("%s is good.\n", filename);
+    return 0;
+  }
+
+  if (is_delta_image(filename))
+  {
+    fprintf(stderr, "%s is a delta image, rebuild it (\"ps3mca-ps1 m\") before fixing it.\n", filename);
+    return 1;
+  }
+  if (image_format_from_name(filename) == IMAGE_FORMAT_LIBRARY)
+  {
+    fprintf(stderr, "%s is in a card library, convert it (\"ps3mca-ps1 c\") before fixing it.\n", filename);
+    return 1;
+  }
+
+  image = image_open_read(filename, &format);
+  if (image != NULL)
+  {
+    fclose(image);
+    image = fopen(filename, "r+b");
+  }
+  if (image == NULL)
+  {
+    fprintf(stderr, "Unable to update %s.\n", filename);
+    return 1;
+  }
+  fseek(image, IMAGE_HEADER_SIZE[format], SEEK_SET);
+  fwrite(card_image, 1, (PS1CARD_BROKEN_LAST_FRAME + 1)*PS1CARD_FRAME_SIZE, image);
+  fclose(image);
+
+  printf("%s fixed (%d problems).\n", filename, fixable);
+  return 0;
+
+}
+/* --------------------------------------------------------End of Image validator--------------------------------------------------*/
+
+
+
+
+
+
+
+
+
+/* ------------------------------------------------------------Live compare--------------------------------------------------------*/
+/* Compare the card with an image while reading, frame by frame.
+   By default the reading stop at the first different frame, with "all" every frame is read and all differences are listed.
+   Every difference is reported with the frame and the save (from the directory of the image) that use it.*/
+
+/* Print where is the frame: header, directory, system frames, save or free block*/
+void print_frame_owner (struct ps1_card_index *index, uint16_t frame_number)
+{
+
+  struct ps1_save *save = ps1_index_frame_save(index, frame_number);
+
+  if (frame_number <= PS1CARD_DIRECTORY_LAST_FRAME)
+  {
+    printf(" (header and directory)\n");
+  }
+  else if (frame_number < PS1CARD_BLOCK_FRAMES)
+  {
+    printf(" (broken frames list and system frames)\n");
+  }
+  else if (save != NULL)
+  {
+    printf(" (block %d, save %s %s \"%s\")\n", frame_number / PS1CARD_BLOCK_FRAMES, save->product_code, save->identifier, save->title);
+  }
+  else
+  {
+    printf(" (block %d, free)\n", frame_number / PS1CARD_BLOCK_FRAMES);
+  }
+
+}
+
+int PS1_compare (const char *filename, int all_frames)
+{
+
+  void *mapping;
+  size_t mapping_size;
+  const uint8_t *image;
+  uint8_t data_frame[128];
+  int save_differences[15];
+  int differences = 0;
+  int errors = 0;
+  int s;
+  struct ps1_save *save;
+
+  image = image_map(filename, &mapping, &mapping_size);
+  if (image == NULL)
+  {
+    return 1;
+  }
+  ps1_index_build(&card_index, image);
+  memset(save_differences, 0, sizeof(save_differences));
+
+  if (open_ps1_card() != 0)
+  {
+    munmap(mapping, mapping_size);
+    return 1;
+  }
+
+  progress_begin("compare", PS1CARD_MAX_FRAME - PS1CARD_MIN_FRAME + 1);
+  for (frame = PS1CARD_MIN_FRAME; frame <= PS1CARD_MAX_FRAME; frame++)
+  {
+    progress_update(frame - PS1CARD_MIN_FRAME);
+    if (PS1_read_frame(frame, data_frame) != 0)
+    {
+      errors++;
+      printf("Frame %d not read correctly", frame);
+      print_frame_owner(&card_index, frame);
+    }
+    else if (memcmp(data_frame, &image[frame*PS1CARD_FRAME_SIZE], PS1CARD_FRAME_SIZE) != 0)
+    {
+      differences++;
+      printf("Frame %d differs", frame);
+      print_frame_owner(&card_index, frame);
+
+      save = ps1_index_frame_save(&card_index, frame);
+      if (save != NULL)
+      {
+        save_differences[save - card_index.saves]++;
+      }
+    }
+    else
+    {
+      continue;
+    }
+
+    /* First difference mode, no need to read more*/
+    if (!all_frames || ps3mca_aborted)
+    {
+      break;
+    }
+  }
+
+  progress_end(frame - PS1CARD_MIN_FRAME, differences != 0 || errors != 0);
+
+  /* Unmount the ps3mca*/
+  close_ps3mca();
+  munmap(mapping, mapping_size);
+
+  if (differences == 0 && errors == 0)
+  {
+    printf("The memory card is the same of %s.\n", filename);
+    return 0;
+  }
+
+  if (all_frames)
+  {
+    for (s = 0; s < card_index.saves_count; s++)
+    {
+      if (save_differences[s] > 0)
+      {
+        printf("Save %s %s \"%s\": %d frames differ.\n", card_index.saves[s].product_code, card_index.saves[s].identifier, card_index.saves[s].title, save_differences[s]);
+      }
+    }
+    printf("%d frames differ from %s, %d frames not read correctly.\n", differences, filename, errors);
+  }
+  else
+  {
+    printf("The memory card differs from %s (stopped at frame %d).\n", filename, frame);
+  }
+
+  return 1;
+
+}
+/* ---------------------------------------------------------End of Live compare----------------------------------------------------*/
+
+
+
+
+
+
+
+
+
+/* -----------------------------------------------------------Consensus read-------------------------------------------------------*/
+/* On worn cards a frame can have a good checksum but different data on every read. Every frame is read until
+   CONSENSUS_READS good reads have the same data, at most max_reads times. The reads of a frame are sent one after the
+   other (the ps3mca serves one command at a time), so a stable frame costs only the second read.*/
+
+/* Read a frame by consensus, return 0 stable, 1 unstable (data is the most frequent good read), -1 no good read*/
+int PS1_consensus_frame (uint16_t frame_number, uint8_t *data, int max_reads, int *reads)
+{
+
+  uint8_t candidate[CONSENSUS_LIMIT_READS][128];
+  int votes[CONSENSUS_LIMIT_READS];
+  int candidates = 0;
+  int best = -1;
+  int status;
+  int i;
+
+  for (*reads = 0; *reads < max_reads && !ps3mca_aborted; )
+  {
+    status = PS1_read_frame(frame_number, candidate[candidates]);
+    (*reads)++;
+    if (status != 0)
+    {
+      continue;						/* Only good reads vote*/
+    }
+
+    for (i = 0; i < candidates; i++)
+    {
+      if (memcmp(candidate[i], candidate[candidates], PS1CARD_FRAME_SIZE) == 0)
+      {
+        break;
+      }
+    }
+    if (i == candidates)
+    {
+      votes[candidates++] = 0;
+    }
+    votes[i]++;
+    if (best < 0 || votes[i] > votes[best])
+    {
+      best = i;
+    }
+
+    if (votes[best] >= CONSENSUS_READS)
+    {
+      memcpy(data, candidate[best], PS1CARD_FRAME_SIZE);
+      return 0;
+    }
+  }
+
+  if (best < 0)
+  {
+    return -1;
+  }
+
+  memcpy(data, candidate[best], PS1CARD_FRAME_SIZE);
+  return 1;
+
+}
+
+/* Read all the card by consensus in filename (format from the extension), without filename in memory_card_out_<timestamp>.mcd*/
+int PS1_consensus_read (const char *filename, int max_reads)
+{
+
+  char default_filename[70];
+  uint8_t data_frame[128];
+  uint16_t unstable[1024];
+  int unstable_count = 0;
+  int unreadable = 0;
+  int extra = 0;
+  int format;
+  int saved;
+  int reads;
+  int status;
+  int f;
+
+  if (max_reads < CONSENSUS_READS || max_reads > CONSENSUS_LIMIT_READS)
+  {
+    fprintf(stderr, "Reads for frame must be from %d to %d.\n", CONSENSUS_READS, CONSENSUS_LIMIT_READS);
+    return 1;
+  }
+
+  if (filename == NULL)
+  {
+    output_filename(default_filename, "mcd");
+    filename = default_filename;
+  }
+
+  FILE *output = image_open_write(filename, &format);
+  if (output == NULL)
+  {
+    return 1;
+  }
+
+  if (open_ps1_card() != 0)
+  {
+    fclose(output);
+    return 1;
+  }
+  load_card_profile();
+  progress_begin("consensus_read", PS1CARD_MAX_FRAME - PS1CARD_MIN_FRAME + 1);
+
+  for (frame = PS1CARD_MIN_FRAME; frame <= PS1CARD_MAX_FRAME && !ps3mca_aborted; frame++)
+  {
+    status = PS1_consensus_frame(frame, data_frame, max_reads, &reads);
+    if (reads > CONSENSUS_READS)
+    {
+      extra += reads - CONSENSUS_READS;
+    }
+
+    if (status > 0)
+    {
+      unstable[unstable_count++] = frame;
+      frame_results[frame].errors |= FRAME_ERROR_UNSTABLE;
+    }
+    else if (status < 0)
+    {
+      unreadable++;
+      memset(data_frame, 0, PS1CARD_FRAME_SIZE);	/* Keep the position of the next frames*/
+    }
+    fwrite(data_frame, 1, PS1CARD_FRAME_SIZE, output);
+    progress_update(frame - PS1CARD_MIN_FRAME + 1);
+  }
+
+  /* Clean and close the file output, a library add the image only if it is complete*/
+  saved = image_close_write(output, format, !ps3mca_aborted) == 0;
+  progress_end(frame - PS1CARD_MIN_FRAME, ps3mca_aborted || !saved || unstable_count > 0 || unreadable > 0);
+
+  /* Unmount the ps3mca*/
+  close_ps3mca();
+
+  if (ps3mca_aborted)
+  {
+    fprintf(stderr, "Reading aborted at frame %d, %s is incomplete.\n", frame - 1, filename);
+    return 1;
+  }
+  if (!saved)
+  {
+    fprintf(stderr, "Unable to save %s.\n", filename);
+    return 1;
+  }
+
+  printf("Consensus read in %s: %d extra reads, %d unstable frames, %d unreadable frames.\n", filename, extra, unstable_count, unreadable);
+  for (f = 0; f < unstable_count; f++)
+  {
+    printf("Unstable frame %d (saved the most frequent data).\n", unstable[f]);
+  }
+
+  return unstable_count > 0 || unreadable > 0;
+
+}
+/* -------------------------------------------------------End of Consensus read----------------------------------------------------*/
+
+
+
+
+
+
+
+
+
+/* -------------------------------------------------------------Image diff---------------------------------------------------------*/
+/* Compare two images frame by frame (both mapped in memory) and attribute every different frame to the saves of both images.
+   The result is a compact report or a patch (delta image of the second over the first) for the differential write "w patch".*/
+
+/* 1 if the two frames are equal, 64 bits at a time (the compiler can vectorize it)*/
+int frame_equal (const uint8_t *first, const uint8_t *second)
+{
+
+  uint64_t first_words[16];
+  uint64_t second_words[16];
+  uint64_t difference = 0;
+  int i;
+
+  memcpy(first_words, first, sizeof(first_words));	/* Frames in images can be unaligned*/
+  memcpy(second_words, second, sizeof(second_words));
+  for (i = 0; i < 16; i++)
+  {
+    difference = difference | (first_words[i] ^ second_words[i]);
+  }
+
+  return difference == 0;
+
+}
+
+int PS1_diff (const char *first_name, const char *second_name, const char *patch_name)
+{
+
+  void *first_mapping;
+  void *second_mapping;
+  size_t first_size;
+  size_t second_size;
+  const uint8_t *first;
+  const uint8_t *second;
+  struct ps1_card_index second_index;
+  struct ps1_save *first_save;
+  struct ps1_save *second_save;
+  int first_differences[15];
+  int second_differences[15];
+  int differences = 0;
+  int records;
+  int s;
+
+  first = image_map(first_name, &first_mapping, &first_size);
+  if (first == NULL)
+  {
+    return 1;
+  }
+  second = image_map(second_name, &second_mapping, &second_size);
+  if (second == NULL)
+  {
+    munmap(first_mapping, first_size);
+    return 1;
+  }
+
+  ps1_index_build(&card_index, first);
+  ps1_index_build(&second_index, second);
+  memset(first_differences, 0, sizeof(first_differences));
+  memset(second_differences, 0, sizeof(second_differences));
+
+  for (frame = PS1CARD_MIN_FRAME; frame <= PS1CARD_MAX_FRAME; frame++)
+  {
+    if (frame_equal(&first[frame*PS1CARD_FRAME_SIZE], &second[frame*PS1CARD_FRAME_SIZE]))
+    {
+      continue;
+    }
+
+    differences++;
+    first_save = ps1_index_frame_save(&card_index, frame);
+    second_save = ps1_index_frame_save(&second_index, frame);
+    if (first_save != NULL)
+    {
+      first_differences[first_save - card_index.saves]++;
+    }
+    if (second_save != NULL)
+    {
+      second_differences[second_save - second_index.saves]++;
+    }
+    if (patch_name == NULL)
+    {
+      printf("Frame %d differs", frame);
+      print_frame_owner(&second_index, frame);
+    }
+  }
+
+  /* Report by save*/
+  for (s = 0; s < card_index.saves_count; s++)
+  {
+    if (first_differences[s] > 0)
+    {
+      printf("- %s %s \"%s\" (block %d): %d frames differ.\n", card_index.saves[s].product_code, card_index.saves[s].identifier,
+             card_index.saves[s].title, card_index.saves[s].first_block, first_differences[s]);
+    }
+  }
+  for (s = 0; s < second_index.saves_count; s++)
+  {
+    if (second_differences[s] > 0)
+    {
+      printf("+ %s %s \"%s\" (block %d): %d frames differ.\n", second_index.saves[s].product_code, second_index.saves[s].identifier,
+             second_index.saves[s].title, second_index.saves[s].first_block, second_differences[s]);
+    }
+  }
+  printf("%d frames differ between %s and %s.\n", differences, first_name, second_name);
+
+  /* Patch for the differential write*/
+  if (patch_name != NULL)
+  {
+    records = write_delta(patch_name, first_name, first, second);
+    munmap(first_mapping, first_size);
+    munmap(second_mapping, second_size);
+    if (records < 0)
+    {
+      return 1;
+    }
+    printf("Patch with %d frames saved in %s, write it with \"ps3mca-ps1 w %s\".\n", records, patch_name, patch_name);
+    return 0;
+  }
+
+  munmap(first_mapping, first_size);
+  munmap(second_mapping, second_size);
+
+  return differences != 0;
+
+}
+/* ----------------------------------------------------------End of Image diff-----------------------------------------------------*/
+
+
+
+
+
+
+
+
+
+/* -------------------------------------------------------------Quick scan----------------------------------------------------------*/
+/* Read only header, directory and some frames of every used block, if the fingerprint is the same of a previous dump
+   the full reading is skipped and the previous image is used, else the card is fully read and added to the cache.*/
+
+/* Fill sample with the frames to check after the directory (frame 0 to 15), return the number of frames*/
+int quick_scan_sample (const uint8_t *directory, uint16_t *sample)
+{
+
+  int samples = 0;
+  int block;
+
+  ps1_index_build(&card_index, directory);
+  for (block = 1; block < PS1CARD_BLOCKS; block++)
+  {
+    if (!ps1_index_block_free(&card_index, block))
+    {
+      sample[samples++] = block*PS1CARD_BLOCK_FRAMES;				/* Title frame of the file*/
+      sample[samples++] = block*PS1CARD_BLOCK_FRAMES + PS1CARD_BLOCK_FRAMES/2;	/* Middle of the block*/
+    }
+  }
+
+  return samples;
+
+}
+
+uint32_t quick_scan_fingerprint (const uint8_t *image, const uint16_t *sample, int samples)
+{
+
+  uint32_t hash = image_fingerprint(image, (PS1CARD_DIRECTORY_LAST_FRAME+1)*PS1CARD_FRAME_SIZE);
+  int s;
+
+  for (s = 0; s < samples; s++)
+  {
+    hash = fingerprint_update(hash, &image[sample[s]*PS1CARD_FRAME_SIZE], PS1CARD_FRAME_SIZE);
+  }
+
+  return hash;
+
+}
+
+/* Search in the cache a previous dump with the same sampled frames, return 1 and the file name if found*/
+int quick_scan_lookup (uint32_t fingerprint, const uint16_t *sample, int samples, char *cached_name)
+{
+
+  char line[1100];
+  unsigned int cached_fingerprint;
+  int s;
+  int same;
+
+  FILE *cache=fopen( QUICK_SCAN_CACHE, "r" );
+  if (cache == NULL)
+  {
+    return 0;
+  }
+
+  while (fgets(line, sizeof(line), cache) != NULL)
+  {
+    if (sscanf(line, "%8x %1023s", &cached_fingerprint, cached_name) != 2 || cached_fingerprint != fingerprint)
+    {
+      continue;
+    }
+
+    /* Same fingerprint, confirm the frames on the cached image (it can be removed or changed)*/
+    if (load_image(cached_name, baseline_image) != 0)
+    {
+      continue;
+    }
+
+    same = (memcmp(baseline_image, card_image, (PS1CARD_DIRECTORY_LAST_FRAME+1)*PS1CARD_FRAME_SIZE) == 0);
+    for (s = 0; same && s < samples; s++)
+    {
+      same = (memcmp(&baseline_image[sample[s]*PS1CARD_FRAME_SIZE], &card_image[sample[s]*PS1CARD_FRAME_SIZE], PS1CARD_FRAME_SIZE) == 0);
+    }
+
+    if (same)
+    {
+      fclose(cache);
+      return 1;
+    }
+  }
+
+  fclose(cache);
+  return 0;
+
+}
+
+int PS1_quick_scan ()
+{
+
+  uint16_t sample[30];					/* 2 frames for max 15 blocks*/
+  uint8_t frame_read[1024];				/* 1 if the frame is already read*/
+  char filename[1024];
+  uint32_t fingerprint;
+  int samples;
+  int s;
+  int errors = 0;
+
+  if (open_ps1_card() != 0)
+  {
+    return 1;
+  }
+
+  memset(card_image, 0, sizeof(card_image));
+  memset(frame_read, 0, sizeof(frame_read));
+
+  /* Header and directory (frame 0 to 15)*/
+  for (frame = PS1CARD_MIN_FRAME; frame <= PS1CARD_DIRECTORY_LAST_FRAME; frame++)
+  {
+    if (PS1_read_frame(frame, &card_image[frame*PS1CARD_FRAME_SIZE]) < 0)
+    {
+      errors++;
+    }
+    frame_read[frame] = 1;
+  }
+
+  /* Some frames of every used block*/
+  samples = quick_scan_sample(card_image, sample);
+  for (s = 0; s < samples; s++)
+  {
+    if (PS1_read_frame(sample[s], &card_image[sample[s]*PS1CARD_FRAME_SIZE]) < 0)
+    {
+      errors++;
+    }
+    frame_read[sample[s]] = 1;
+  }
+
+  fingerprint = quick_scan_fingerprint(card_image, sample, samples);
+
+  if (errors == 0 && quick_scan_lookup(fingerprint, sample, samples, filename))
+  {
+    printf("Memory card unchanged (fingerprint %08x), same as %s.\n", fingerprint, filename);
+    printf("Full reading skipped.\n");
+    close_ps3mca();
+    return 0;
+  }
+
+  printf("Memory card changed or unknown (fingerprint %08x), reading all the memory card.\n", fingerprint);
+
+  /* Read the remaining frames*/
+  for (frame = PS1CARD_MIN_FRAME; frame <= PS1CARD_MAX_FRAME && !ps3mca_aborted; frame++)
+  {
+    if (!frame_read[frame] && PS1_read_frame(frame, &card_image[frame*PS1CARD_FRAME_SIZE]) < 0)
+    {
+      errors++;
+    }
+  }
+
+  /* Unmount the ps3mca*/
+  close_ps3mca();
+
+  output_filename(filename, "mcd");
+  FILE *output=fopen( filename, "wb" );	/* Open and create a binary file output in writing*/
+  if (output == NULL)
+  {
+    fprintf(stderr, "Unable to create %s.\n", filename);
+    return 1;
+  }
+  fwrite(card_image, 1, sizeof(card_image), output);
+  fflush(output);
+  fclose(output);
+  printf("Memory card saved in %s.\n", filename);
+
+  /* Don't cache an incomplete dump*/
+  if (errors != 0)
+  {
+    fprintf(stderr, "%d frames not received, %s isn't added to %s.\n", errors, filename, QUICK_SCAN_CACHE);
+    return 1;
+  }
+
+  FILE *cache=fopen( QUICK_SCAN_CACHE, "a" );
+  if (cache == NULL)
+  {
+    fprintf(stderr, "Unable to update %s.\n", QUICK_SCAN_CACHE);
+    return 1;
+  }
+  fprintf(cache, "%08x %s\n", fingerprint, filename);
+  fclose(cache);
+
+  return 0;
+
+}
+/* ----------------------------------------------------------End of Quick scan------------------------------------------------------*/
+
+
+
+
+
+
+
+
+
+/* ------------------------------------------------------------FUSE filesystem-----------------------------------------------------*/
+#if FUSE
+/* Mount the card as a directory, every save is a file named as in the directory (example BASLUS-00001GAME1).
+   Frames are read from the card only when a file is read, written frames stay in a write-back cache and only
+   the changed frames are written on the card on flush, fsync, release or unmount.
+   The size of the saves is fixed, create, delete and resize files isn't supported.*/
+uint8_t fuse_frame_cached[1024];			/* 1 if the frame is in card_image*/
+uint8_t fuse_frame_dirty[1024];				/* 1 if the frame in card_image must be written on the card*/
+int fuse_directory_loaded = 0;				/* 1 when header and directory are in card_index*/
+
+int fuse_get_frame (uint16_t frame_number)
+{
+
+  if (!fuse_frame_cached[frame_number])
+  {
+    if (PS1_read_frame(frame_number, &card_image[frame_number*PS1CARD_FRAME_SIZE]) != 0)
+    {
+      return -EIO;
+    }
+    fuse_frame_cached[frame_number] = 1;
+  }
+
+  return 0;
+
+}
+
+int fuse_load_directory ()
+{
+
+  uint16_t f;
+
+  if (fuse_directory_loaded)
+  {
+    return 0;
+  }
+
+  ps1_index_init(&card_index);
+  for (f = PS1CARD_MIN_FRAME; f <= PS1CARD_DIRECTORY_LAST_FRAME; f++)
+  {
+    if (fuse_get_frame(f) != 0)
+    {
+      return -EIO;
+    }
+    ps1_index_feed_frame(&card_index, f, &card_image[f*PS1CARD_FRAME_SIZE]);
+  }
+  fuse_directory_loaded = 1;
+
+  return 0;
+
+}
+
+struct ps1_save *fuse_find_save (const char *path)
+{
+
+  int s;
+
+  if (fuse_load_directory() != 0)
+  {
+    return NULL;
+  }
+
+  for (s = 0; s < card_index.saves_count; s++)
+  {
+    if (strcmp(path + 1, card_index.saves[s].filename) == 0)
+    {
+      return &card_index.saves[s];
+    }
+  }
+
+  return NULL;
+
+}
+
+off_t fuse_save_size (struct ps1_save *save)
+{
+  return (off_t)save->blocks * PS1CARD_BLOCK_FRAMES * PS1CARD_FRAME_SIZE;
+}
+
+/* Frame of the card with the byte offset of the save*/
+uint16_t fuse_save_frame (struct ps1_save *save, off_t offset)
+{
+  return save->chain[offset / (PS1CARD_BLOCK_FRAMES*PS1CARD_FRAME_SIZE)]*PS1CARD_BLOCK_FRAMES + (offset % (PS1CARD_BLOCK_FRAMES*PS1CARD_FRAME_SIZE)) / PS1CARD_FRAME_SIZE;
+}
+
+/* Write on the card only the changed frames*/
+int fuse_flush_frames ()
+{
+
+  uint16_t f;
+  int errors = 0;
+
+  for (f = PS1CARD_MIN_FRAME; f <= PS1CARD_MAX_FRAME; f++)
+  {
+    if (fuse_frame_dirty[f])
+    {
+      if (PS1_write_frame(f, &card_image[f*PS1CARD_FRAME_SIZE]) == 0)
+      {
+        fuse_frame_dirty[f] = 0;
+      }
+      else
+      {
+        errors++;
+      }
+    }
+  }
+
+  return errors == 0 ? 0 : -EIO;
+
+}
+
+int ps1_fuse_getattr (const char *path, struct stat *stbuf)
+{
+
+  struct ps1_save *save;
+
+  memset(stbuf, 0, sizeof(struct stat));
+  if (strcmp(path, "/") == 0)
+  {
+    stbuf->st_mode = S_IFDIR | 0755;
+    stbuf->st_nlink = 2;
+    return 0;
+  }
+
+  save = fuse_find_save(path);
+  if (save == NULL)
+  {
+    return -ENOENT;
+  }
+  stbuf->st_mode = S_IFREG | 0644;
+  stbuf->st_nlink = 1;
+  stbuf->st_size = fuse_save_size(save);
+
+  return 0;
+
+}
+
+int ps1_fuse_readdir (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+
+  int s;
+
+  if (strcmp(path, "/") != 0)
+  {
+    return -ENOENT;
+  }
+  if (fuse_load_directory() != 0)
+  {
+    return -EIO;
+  }
+
+  filler(buf, ".", NULL, 0);
+  filler(buf, "..", NULL, 0);
+  for (s = 0; s < card_index.saves_count; s++)
+  {
+    filler(buf, card_index.saves[s].filename, NULL, 0);
+  }
+
+  return 0;
+
+}
+
+int ps1_fuse_open (const char *path, struct fuse_file_info *fi)
+{
+  return fuse_find_save(path) == NULL ? -ENOENT : 0;
+}
+
+/* The size is fixed, truncate (used by cp) don't change anything*/
+int ps1_fuse_truncate (const char *path, off_t size)
+{
+
+  struct ps1_save *save = fuse_find_save(path);
+
+  if (save == NULL)
+  {
+    return -ENOENT;
+  }
+
+  return size <= fuse_save_size(save) ? 0 : -EFBIG;
+
+}
+
+int ps1_fuse_read (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+
+  struct ps1_save *save = fuse_find_save(path);
+  size_t done = 0;
+  size_t chunk;
+  uint16_t f;
+  int inside;
+
+  if (save == NULL)
+  {
+    return -ENOENT;
+  }
+  if (offset >= fuse_save_size(save))
+  {
+    return 0;
+  }
+  if (offset + size > fuse_save_size(save))
+  {
+    size = fuse_save_size(save) - offset;
+  }
+
+  while (done < size)
+  {
+    f = fuse_save_frame(save, offset + done);
+    inside = (offset + done) % PS1CARD_FRAME_SIZE;
+    chunk = PS1CARD_FRAME_SIZE - inside;
+    if (chunk > size - done)
+    {
+      chunk = size - done;
+    }
+
+    if (fuse_get_frame(f) != 0)
+    {
+      return done > 0 ? (int)done : -EIO;
+    }
+    memcpy(buf + done, &card_image[f*PS1CARD_FRAME_SIZE + inside], chunk);
+    done += chunk;
+  }
+
+  return (int)done;
+
+}
+
+int ps1_fuse_write (const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+
+  struct ps1_save *save = fuse_find_save(path);
+  size_t done = 0;
+  size_t chunk;
+  uint16_t f;
+  int inside;
+
+  if (save == NULL)
+  {
+    return -ENOENT;
+  }
+  if (offset >= fuse_save_size(save))
+  {
+    return -EFBIG;
+  }
+  if (offset + size > fuse_save_size(save))
+  {
+    size = fuse_save_size(save) - offset;
+  }
+
+  while (done < size)
+  {
+    f = fuse_save_frame(save, offset + done);
+    inside = (offset + done) % PS1CARD_FRAME_SIZE;
+    chunk = PS1CARD_FRAME_SIZE - inside;
+    if (chunk > size - done)
+    {
+      chunk = size - done;
+    }
+
+    /* Only a partial frame need the old data from the card*/
+    if (chunk < PS1CARD_FRAME_SIZE && fuse_get_frame(f) != 0)
+    {
+      return done > 0 ? (int)done : -EIO;
+    }
+    if (!fuse_frame_cached[f] || memcmp(&card_image[f*PS1CARD_FRAME_SIZE + inside], buf + done, chunk) != 0)
+    {
+      memcpy(&card_image[f*PS1CARD_FRAME_SIZE + inside], buf + done, chunk);
+      fuse_frame_cached[f] = 1;
+      fuse_frame_dirty[f] = 1;
+    }
+    done += chunk;
+  }
+
+  return (int)done;
+
+}
+
+int ps1_fuse_flush (const char *path, struct fuse_file_info *fi)
+{
+  return fuse_flush_frames();
+}
+
+int ps1_fuse_release (const char *path, struct fuse_file_info *fi)
+{
+  return fuse_flush_frames();
+}
+
+int ps1_fuse_fsync (const char *path, int datasync, struct fuse_file_info *fi)
+{
+  return fuse_flush_frames();
+}
+
+void ps1_fuse_destroy (void *private_data)
+{
+  fuse_flush_frames();
+}
+
+struct fuse_operations ps1_fuse_operations =
+{
+  .getattr = ps1_fuse_getattr,
+  .truncate = ps1_fuse_truncate,
+  .open = ps1_fuse_open,
+  .read = ps1_fuse_read,
+  .write = ps1_fuse_write,
+  .flush = ps1_fuse_flush,
+  .release = ps1_fuse_release,
+  .fsync = ps1_fuse_fsync,
+  .readdir = ps1_fuse_readdir,
+  .destroy = ps1_fuse_destroy,
+};
+
+int PS1_fuse_mount (char *mountpoint)
+{
+
+  /* Foreground and single thread, there is only one ps3mca handle*/
+  char *fuse_argv[] = { "ps3mca-ps1", "-f", "-s", mountpoint, NULL };
+  int fuse_status;
+
+  if (open_ps1_card() != 0)
+  {
+    return 1;
+  }
+
+  printf("Memory card mounted on %s, unmount it with fusermount -u %s.\n", mountpoint, mountpoint);
+  fuse_status = fuse_main(4, fuse_argv, &ps1_fuse_operations, NULL);
+
+  if (fuse_flush_frames() != 0)
+  {
+    fprintf(stderr, "Some changed frames aren't written on the memory card.\n");
+    fuse_status = 1;
+  }
+
+  /* Unmount the ps3mca*/
+  close_ps3mca();
+
+  return fuse_status;
+
+}
+#endif
+/* --------------------------------------------------------End of FUSE filesystem--------------------------------------------------*/
+
+
+
+
+
+
+
+
+
+/* ----------------------------------------------------------Timing profiles-------------------------------------------------------*/
+/* Calibration measure on the inserted card the minimum reliable writing delay (on the write test frame 63) and the read
+   turnaround, and save them in the profiles with the get id reply and the directory signature of the card.
+   Read and write load the profile of the card, if there is, instead of the default writing delay.*/
+
+/* Key of the card in the profiles: get id reply and fingerprint of header and directory*/
+int card_profile_key (uint8_t *id, uint32_t *signature)
+{
+
+  uint8_t directory[16*128];
+  uint16_t f;
+
+  if (PS1_read_id(id) != 0)
+  {
+    return 1;
+  }
+
+  for (f = PS1CARD_MIN_FRAME; f <= PS1CARD_DIRECTORY_LAST_FRAME; f++)
+  {
+    if (PS1_read_frame(f, &directory[f*PS1CARD_FRAME_SIZE]) != 0)
+    {
+      return 1;
+    }
+  }
+  *signature = image_fingerprint(directory, sizeof(directory));
+
+  return 0;
+
+}
+
+void card_id_text (const uint8_t *id, char *text)
+{
+
+  int i;
+
+  for (i = 0; i < 8; i++)
+  {
+    sprintf(&text[i*2], "%02x", id[i]);
+  }
+
+}
+
+/* Load the timing profile of the card on an opened ps3mca, return 1 if there isn't*/
+int load_card_profile ()
+{
+
+  char line[200];
+  char id_text[17];
+  char profile_id[17];
+  uint8_t id[8];
+  uint32_t signature;
+  unsigned int profile_signature;
+  int profile_delay;
+  long profile_turnaround;
+  int found = 0;
+
+  FILE *profiles=fopen( TIMING_PROFILES, "r" );
+  if (profiles == NULL)
+  {
+    return 1;						/* No calibrated cards*/
+  }
+
+  if (card_profile_key(id, &signature) != 0)
+  {
+    fprintf(stderr, "Unable to identify the card, using default timing.\n");
+    fclose(profiles);
+    return 1;
+  }
+  card_id_text(id, id_text);
+  frame_results_reset();				/* The directory reads of the key aren't part of the command*/
+
+  /* The last calibration of the card win*/
+  while (fgets(line, sizeof(line), profiles) != NULL)
+  {
+    if (sscanf(line, "%16s %8x %d %ld", profile_id, &profile_signature, &profile_delay, &profile_turnaround) == 4 &&
+        strcmp(profile_id, id_text) == 0 && profile_signature == signature)
+    {
+      writing_delay = profile_delay;
+      read_turnaround = profile_turnaround;
+      found = 1;
+    }
+  }
+  fclose(profiles);
+
+  if (!found)
+  {
+    return 1;
+  }
+
+  /* The read turnaround (2 transfers) is the first measure of the round-trip time*/
+  if (read_turnaround > 0)
+  {
+    rtt_average = read_turnaround/2 > 0 ? read_turnaround/2 : 1;
+    rtt_deviation = rtt_average/2;
+  }
+  pthread_mutex_lock(&metrics_lock);
+  metrics.round_trip = rtt_average;
+  metrics.writing_delay = writing_delay;
+  pthread_mutex_unlock(&metrics_lock);
+
+  printf("Timing profile of the card loaded: writing delay %dms, read turnaround %ldus.\n", writing_delay, read_turnaround);
+  return 0;
+
+}
+
+int PS1_calibrate ()
+{
+
+  uint8_t id[8];
+  char id_text[17];
+  uint32_t signature;
+  uint8_t original_frame[128];
+  uint8_t test_frame[128];
+  uint8_t check_frame[128];
+  int candidates[] = { 50, 40, 30, 25, 20, 15, 12, 10, 8, 6, 4, 3, 2, 1, 0 };
+  int default_delay = writing_delay;
+  int reliable_delay = writing_delay;
+  int reliable;
+  int i;
+  int w;
+  int b;
+  long long start;
+
+  if (open_ps1_card() != 0)
+  {
+    return 1;
+  }
+
+  if (card_profile_key(id, &signature) != 0 || PS1_read_frame(CALIBRATION_FRAME, original_frame) != 0)
+  {
+    fprintf(stderr, "Unable to identify the card, calibration aborted.\n");
+    close_ps3mca();
+    return 1;
+  }
+  card_id_text(id, id_text);
+
+  /* Read turnaround*/
+  start = time_us();
+  for (i = 0; i < CALIBRATION_READS; i++)
+  {
+    PS1_read_frame(CALIBRATION_FRAME, check_frame);
+  }
+  read_turnaround = (long)((time_us() - start) / CALIBRATION_READS);
+  printf("Read turnaround %ldus.\n", read_turnaround);
+
+  /* Writing delay, from the default to 0 until the write test frame isn't written correctly*/
+  for (i = 0; i < sizeof(candidates)/sizeof(candidates[0]); i++)
+  {
+    if (candidates[i] > default_delay)
+    {
+      continue;
+    }
+
+    writing_delay = candidates[i];
+    reliable = 1;
+    for (w = 0; reliable && w < CALIBRATION_WRITES; w++)
+    {
+      for (b = 0; b < PS1CARD_FRAME_SIZE; b++)
+      {
+        test_frame[b] = (uint8_t)(w*31 + b*7 + candidates[i]);
+      }
+      if (PS1_write_frame(CALIBRATION_FRAME, test_frame) != 0 || PS1_read_frame(CALIBRATION_FRAME, check_frame) != 0 ||
+          memcmp(test_frame, check_frame, PS1CARD_FRAME_SIZE) != 0)
+      {
+        reliable = 0;
+      }
+    }
+
+    printf("Writing delay %dms: %s.\n", candidates[i], reliable ? "reliable" : "unreliable");
+    if (!reliable)
+    {
+      break;
+    }
+    reliable_delay = candidates[i];
+  }
+
+  /* Restore the write test frame with the default delay, the failures of the unreliable delays are expected*/
+  frame_results_reset();
+  writing_delay = default_delay;
+  if (PS1_write_frame(CALIBRATION_FRAME, original_frame) != 0)
+  {
+    fprintf(stderr, "Unable to restore the write test frame %d.\n", CALIBRATION_FRAME);
+  }
+
+  /* Unmount the ps3mca*/
+  close_ps3mca();
+
+  writing_delay = reliable_delay + CALIBRATION_MARGIN < default_delay ? reliable_delay + CALIBRATION_MARGIN : default_delay;
+
+  FILE *profiles=fopen( TIMING_PROFILES, "a" );
+  if (profiles == NULL)
+  {
+    fprintf(stderr, "Unable to update %s.\n", TIMING_PROFILES);
+    return 1;
+  }
+  fprintf(profiles, "%s %08x %d %ld\n", id_text, signature, writing_delay, read_turnaround);
+  fclose(profiles);
+
+  printf("Card %s (directory %08x) calibrated: writing delay %dms, read turnaround %ldus, saved in %s.\n", id_text, signature, writing_delay, read_turnaround, TIMING_PROFILES);
+
+  return 0;
+
+}
+/* -------------------------------------------------------End of Timing profiles---------------------------------------------------*/
+
+
+
+
+
+
+
+
+
+/* ---------------------------------------------------------------Soak test--------------------------------------------------------*/
+/* Cycles of get id, read of all the card and write of the write test frame for the given minutes, every cycle is a new
+   session as separated commands. One line for cycle (tab separated) with throughput, errors and latencies, at the end
+   the drift between the first and the last cycles. Also with the simulated ps3mca (PS3MCA_SIMULATE).*/
+struct soak_cycle
+{
+  int opened;				/* 0 if the ps3mca or the card are not found*/
+  long id_latency;			/* Get id (microseconds), -1 if failed*/
+  double read_rate;			/* Frames read for second*/
+  int read_errors;			/* Frames with errors*/
+  long write_latency;			/* Write and read back of the write test frame (microseconds)*/
+  int write_errors;			/* 1 if the write test frame isn't the same after the write*/
+  long rtt;				/* Mean round-trip time at the end of the cycle (microseconds)*/
+  int aborted;
+};
+
+void soak_run_cycle (struct soak_cycle *cycle)
+{
+
+  uint8_t id[8];
+  uint8_t data_frame[128];
+  uint8_t check_frame[128];
+  long long start;
+  int f;
+
+  memset(cycle, 0, sizeof(struct soak_cycle));
+  cycle->id_latency = -1;
+
+  if (open_ps1_card() != 0)
+  {
+    return;
+  }
+  cycle->opened = 1;
+
+  /* Get id, always asked to the card*/
+  card_cache_invalidate();
+  start = time_us();
+  if (PS1_read_id(id) == 0)
+  {
+    cycle->id_latency = (long)(time_us() - start);
+  }
+
+  /* All the card*/
+  start = time_us();
+  for (f = PS1CARD_MIN_FRAME; f <= PS1CARD_MAX_FRAME && !ps3mca_aborted; f++)
+  {
+    if (PS1_read_frame(f, data_frame) != 0)
+    {
+      cycle->read_errors++;
+    }
+  }
+  cycle->read_rate = (double)f * 1000000 / (double)(time_us() - start + 1);
+
+  /* Write test frame with the same data*/
+  start = time_us();
+  if (PS1_read_frame(CALIBRATION_FRAME, data_frame) != 0 || PS1_write_frame(CALIBRATION_FRAME, data_frame) != 0 ||
+      PS1_read_frame(CALIBRATION_FRAME, check_frame) != 0 || memcmp(data_frame, check_frame, PS1CARD_FRAME_SIZE) != 0)
+  {
+    cycle->write_errors = 1;
+  }
+  cycle->write_latency = (long)(time_us() - start);
+
+  cycle->rtt = rtt_average;
+  cycle->aborted = ps3mca_aborted;
+
+  close_ps3mca();
+
+}
+
+int PS1_soak (double minutes, const char *log_name)
+{
+
+  struct soak_cycle cycle;
+  struct soak_cycle first;
+  struct soak_cycle last;				/* Last good cycle, the drift is not measured on failed cycles*/
+  FILE *log = NULL;
+  long long start = time_us();
+  long long end = start + (long long)(minutes * 60 * 1000000);
+  int cycles = 0;
+  int failed_cycles = 0;
+  int failed_in_sequence = 0;
+  long read_errors = 0;
+  long write_errors = 0;
+  double rate_min = 0;
+  double rate_max = 0;
+  long id_max = 0;
+
+  if (minutes <= 0)
+  {
+    fprintf(stderr, "Minutes of soak must be more than 0.\n");
+    return 1;
+  }
+
+  if (log_name != NULL)
+  {
+    log = fopen(log_name, "w");
+    if (log == NULL)
+    {
+      fprintf(stderr, "Unable to create %s.\n", log_name);
+      return 1;
+    }
+    fprintf(log, "cycle\ttime_s\tid_us\tread_frames_s\tread_errors\twrite_us\twrite_errors\trtt_us\taborted\n");
+  }
+
+  printf("cycle\ttime_s\tid_us\tread_frames_s\tread_errors\twrite_us\twrite_errors\trtt_us\taborted\n");
+  memset(&first, 0, sizeof(first));
+  memset(&last, 0, sizeof(last));
+
+  while (time_us() < end)
+  {
+    soak_run_cycle(&cycle);
+    cycles++;
+
+    if (!cycle.opened || cycle.aborted || cycle.id_latency < 0)
+    {
+      failed_cycles++;
+      failed_in_sequence++;
+    }
+    else
+    {
+      failed_in_sequence = 0;
+      if (first.opened == 0)
+      {
+        first = cycle;
+      }
+      last = cycle;
+      if (rate_min == 0 || cycle.read_rate < rate_min)
+      {
+        rate_min = cycle.read_rate;
+      }
+      if (cycle.read_rate > rate_max)
+      {
+        rate_max = cycle.read_rate;
+      }
+      if (cycle.id_latency > id_max)
+      {
+        id_max = cycle.id_latency;
+      }
+    }
+    read_errors += cycle.read_errors;
+    write_errors += cycle.write_errors;
+
+    printf("%d\t%.1f\t%ld\t%.1f\t%d\t%ld\t%d\t%ld\t%d\n", cycles, (double)(time_us() - start) / 1000000, cycle.id_latency, cycle.read_rate, cycle.read_errors, cycle.write_latency, cycle.write_errors, cycle.rtt, cycle.aborted);
+    fflush(stdout);
+    if (log != NULL)
+    {
+      fprintf(log, "%d\t%.1f\t%ld\t%.1f\t%d\t%ld\t%d\t%ld\t%d\n", cycles, (double)(time_us() - start) / 1000000, cycle.id_latency, cycle.read_rate, cycle.read_errors, cycle.write_latency, cycle.write_errors, cycle.rtt, cycle.aborted);
+      fflush(log);
+    }
+
+    if (failed_in_sequence >= SOAK_MAX_FAILED_CYCLES)
+    {
+      fprintf(stderr, "%d failed cycles in sequence, soak stopped.\n", failed_in_sequence);
+      break;
+    }
+  }
+
+  if (log != NULL)
+  {
+    fclose(log);
+  }
+
+  /* The errors are measures of the soak, not of the command*/
+  frame_results_reset();
+
+  printf("%d cycles in %.1f minutes, %d failed.\n", cycles, (double)(time_us() - start) / 60000000, failed_cycles);
+  printf("Read errors %ld (%.4f%% of frames), write test frame errors %ld.\n", read_errors, cycles ? (double)read_errors * 100 / ((double)cycles * (PS1CARD_MAX_FRAME + 1)) : 0, write_errors);
+  if (first.opened)
+  {
+    printf("Read throughput min %.1f, max %.1f frames/s, last good cycle %+.1f%% from the first.\n", rate_min, rate_max, first.read_rate > 0 ? (last.read_rate - first.read_rate) * 100 / first.read_rate : 0);
+    printf("Get id latency first %ldus, max %ldus. Round-trip time first %ldus, last %ldus.\n", first.id_latency, id_max, first.rtt, last.rtt);
+  }
+
+  return failed_in_sequence >= SOAK_MAX_FAILED_CYCLES;
+
+}
+/* -----------------------------------------------------------End of Soak test-----------------------------------------------------*/
+
+
+
+
+
+
+
+
+
+/* --------------------------------------------------------------Batch script-------------------------------------------------------*/
+int batch_split(char *line, char *argv[])	/* Split a line in words (quotes for words with spaces), return the count*/
+{
+
+  int argc = 1;
+  char *p = line;
+
+  argv[0] = "ps3mca-ps1";
+  while (*p != '\0' && argc < BATCH_MAX_ARGS)
+  {
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+    {
+      p++;
+    }
+    if (*p == '\0')
+    {
+      break;
+    }
+
+    if (*p == '"')
+    {
+      argv[argc++] = ++p;
+      while (*p != '\0' && *p != '"')
+      {
+        p++;
+      }
+    }
+    else
+    {
+      argv[argc++] = p;
+      while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+      {
+        p++;
+      }
+    }
+    if (*p != '\0')
+    {
+      *p++ = '\0';
+    }
+  }
+
+  return argc;
+
+}
+
+int PS1_batch(const char *filename)		/* Run the commands of a script in the same ps3mca session*/
+{
+
+  FILE *script;
+  char *line;
+  char *command;
+  char *text;
+  char *args[BATCH_MAX_ARGS];
+  int argc;
+  int line_number = 0;
+  int step = 0;
+  int failed = 0;
+  int skipped = 0;
+  int ignore_error;
+  int stopped = 0;
+  int too_long;
+  int next;
+  int opened;
+  int result;
+  long long start;
+
+  if (strcmp(filename, "-") == 0)
+  {
+    script = stdin;
   }
   else
   {
-    fprintf(stderr, "Error sending message to device.\n");
+    script = fopen(filename, "r");
+  }
+  if (script == NULL)
+  {
+    fprintf(stderr, "Unable to open script %s.\n", filename);
+    return 1;
+  }
+
+  line = malloc(BATCH_MAX_LINE);
+  if (line == NULL)
+  {
+    fprintf(stderr, "Out of memory.\n");
+    if (script != stdin)
+    {
+      fclose(script);
+    }
+    return 1;
   }
 
+  /* One session for all the script, the commands don't claim the ps3mca again*/
+  opened = open_ps3mca() == 0;
+  if (!opened)
+  {
+    fprintf(stderr, "Commands that use the card will fail.\n");
+  }
 
-  /* Listen for a message.*/
-  /* Wait up to 5 seconds for a message to arrive on endpoint*/
-  res = libusb_bulk_transfer(handle, BULK_READ_ENDPOINT, ps1_ram_buffer, sizeof(ps1_ram_buffer), &numBytes, USB_TIMEOUT);
-  if (0 == res)
+  while (fgets(line, BATCH_MAX_LINE, script) != NULL)
   {
-    if (numBytes <= sizeof(ps1_ram_buffer))
+    line_number++;
+    /* A line without the end is longer than BATCH_MAX_LINE (or the last of the file): the rest is dropped, not run as
+       another command*/
+    too_long = 0;
+    if (strchr(line, '\n') == NULL && (next = fgetc(script)) != EOF && next != '\n')
     {
-        /* Verify if PS3mca send status succes code*/
-        if (ps1_ram_buffer[0] == RESPONSE_CODE & ps1_ram_buffer[1] == RESPONSE_STATUS_SUCCES)
-        {
-	  #if DEBUG
-          printf("Autentication verified on frame %d.\n", frame);
-          #endif
-        } 
+      too_long = 1;
+      while (next != EOF && next != '\n')
+      {
+        next = fgetc(script);
+      }
+    }
+    command = line;
+    while (*command == ' ' || *command == '\t')
+    {
+      command++;
+    }
+    command[strcspn(command, "\r\n")] = '\0';
+    if (*command == '\0' || *command == '#')
+    {
+      continue;
+    }
 
-        /* Verify if PS3mca send status wrong code*/
-        else if (ps1_ram_buffer[0] == RESPONSE_CODE & ps1_ram_buffer[1] == RESPONSE_WRONG)    
-        {
-          fprintf(stderr, "Autentication failed on frame %d.\n", frame);
-        }
+    ignore_error = (*command == '-');
+    if (ignore_error)
+    {
+      command++;
+    }
 
-        /* Other unknown PS3mca error*/
-        else   
-        {
-          fprintf(stderr, "Unknown error on PS3mca protocol on frame %d.\n", frame);
-        }
+    step++;
 
+    /* After a failure only list the skipped commands*/
+    if (stopped)
+    {
+      printf("step=%d line=%d command=\"%s\" result=skipped\n", step, line_number, command);
+      skipped++;
+      continue;
+    }
 
-        /* Verify Memory End Byte (0x47h=Good)*/
-        if (ps1_ram_buffer[141] == PS1CARD_REPLY_MEB_GOOD)
-        {
-	  #if DEBUG
-          printf("Good Memory End Byte on frame %d.\n", frame);
-          #endif
-        }
- 
-        /* Verify Memory End Byte (0x4E=BadChecksum)*/
-        else if (ps1_ram_buffer[141] == PS1CARD_REPLY_MEB_BAD_CHECKSUM)
-        {
-          fprintf(stderr, "Bad Checksum Memory End Byte on frame %d.\n", frame);
+    text = strdup(command);
+    argc = batch_split(command, args);
+    start = time_us();
+    if (too_long)
+    {
+      fprintf(stderr, "Line %d is too long (max %d characters), not run.\n", line_number, BATCH_MAX_LINE - 1);
+      result = 1;
+    }
+    else if (argc > 1 && args[1][0] == 'b')
+    {
+      fprintf(stderr, "Batch scripts can't run other scripts.\n");
+      result = 1;
+    }
+    else
+    {
+      result = run_command(argc, args);
+    }
+
+    printf("step=%d line=%d command=\"%s\" result=%s code=%d time_ms=%lld\n", step, line_number, text ? text : "", result == 0 ? "ok" : "failed", result, (time_us() - start)/1000);
+    fflush(stdout);
+    free(text);
+
+    if (result != 0)
+    {
+      failed++;
+      if (!ignore_error)
+      {
+        stopped = 1;
+      }
+    }
+  }
+
+  if (opened)
+  {
+    close_ps3mca();
+  }
+  free(line);
+  if (script != stdin)
+  {
+    fclose(script);
+  }
+
+  printf("steps=%d ok=%d failed=%d skipped=%d\n", step, step - failed - skipped, failed, skipped);
+
+  return failed > 0;
+
+}
+/* ----------------------------------------------------------End of Batch script---------------------------------------------------*/
+
+
+
+
+
+
+
+
+
+/* -----------------------------------------------------------------Daemon---------------------------------------------------------*/
+/* Resident process with the ps3mca open (one session for all the requests), one request for connection on a Unix socket.
+   The output of the commands is on the output of the daemon, the client receive only the result.
+   The commands are jobs in a queue ordered by priority, run by one worker thread. An urgent job don't wait the end of
+   a running normal job: it is run between two frames of the read or the write (scheduler_preempt), then the normal job
+   continue from the next frame. An urgent job that can write the card (DAEMON_WRITE_COMMANDS) is never run between two
+   frames, it waits the end of the running job: the state of the writes (journal, pending frames) isn't saved.*/
+struct daemon_job
+{
+  int client;				/* Connection of the request, the reply is sent at the end of the job*/
+  int priority;				/* DAEMON_PRIORITY_NORMAL or DAEMON_PRIORITY_URGENT*/
+  int writes_card;			/* 1 if the command is in DAEMON_WRITE_COMMANDS*/
+  long long queued;			/* time_us() of the request*/
+  char *line;				/* Command line, args point inside*/
+  struct daemon_job *next;
+};
+
+/* State of the running command, saved when an urgent job run between its frames (the urgent jobs between the frames
+   only read the card, so only the state used by the reads is here)*/
+struct scheduler_context
+{
+  uint16_t frame;
+  uint16_t first_frame;
+  uint16_t last_frame;
+  int writing_delay;
+  long read_turnaround;
+  int priority;
+  int shm_writing_slot;
+  struct progress_state progress;
+  struct frame_result results[1024];
+};
+
+volatile sig_atomic_t daemon_stop = 0;
+int daemon_opened = 0;			/* 1 if the daemon keep a session of the ps3mca open*/
+int scheduler_active = 0;		/* 1 if the worker of the daemon is running*/
+int scheduler_priority = -1;		/* Priority of the running job, -1 if none*/
+struct daemon_job *job_queue = NULL;	/* Highest priority first, same priority in arrival order*/
+pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t job_ready = PTHREAD_COND_INITIALIZER;
+
+void daemon_signal (int signal_number)
+{
+  daemon_stop = 1;
+}
+
+void job_push (struct daemon_job *job)		/* Call with job_lock*/
+{
+  struct daemon_job **p = &job_queue;
+
+  while (*p != NULL && (*p)->priority >= job->priority)
+  {
+    p = &(*p)->next;
+  }
+  job->next = *p;
+  *p = job;
+  pthread_mutex_lock(&metrics_lock);
+  metrics.jobs_queued++;
+  pthread_mutex_unlock(&metrics_lock);
+}
+
+struct daemon_job *job_pop (int min_priority)	/* Call with job_lock, NULL if no job with priority >= min_priority*/
+{
+  struct daemon_job *job = job_queue;
+
+  if (job == NULL || job->priority < min_priority)
+  {
+    return NULL;
+  }
+  job_queue = job->next;
+  pthread_mutex_lock(&metrics_lock);
+  metrics.jobs_queued--;
+  pthread_mutex_unlock(&metrics_lock);
+  return job;
+}
+
+/* Call with job_lock, first job with priority >= min_priority that doesn't write the card, NULL if none*/
+struct daemon_job *job_pop_preemptive (int min_priority)
+{
+
+  struct daemon_job **p = &job_queue;
+  struct daemon_job *job;
+
+  while (*p != NULL && (*p)->priority >= min_priority)
+  {
+    if (!(*p)->writes_card)
+    {
+      job = *p;
+      *p = job->next;
+      pthread_mutex_lock(&metrics_lock);
+      metrics.jobs_queued--;
+      pthread_mutex_unlock(&metrics_lock);
+      return job;
+    }
+    p = &(*p)->next;
+  }
+
+  return NULL;
+
+}
+
+void job_reply (struct daemon_job *job, const char *text)
+{
+  if (write(job->client, text, strlen(text)) < 0)
+  {
+    fprintf(stderr, "Unable to reply to a client.\n");
+  }
+  close(job->client);
+  free(job->line);
+  free(job);
+}
+
+void job_run (struct daemon_job *job)
+{
+
+  char *args[BATCH_MAX_ARGS];
+  char reply[140];
+  int argc;
+  int result;
+  int size;
+  int previous_priority = scheduler_priority;
+  long long start = time_us();
+
+  scheduler_priority = job->priority;
+  shm_output_slot = -1;
+  argc = batch_split(job->line, args);
+  if (argc < 2 || args[1][0] == 'h')
+  {
+    fprintf(stderr, "The daemon can't run this command.\n");
+    result = 1;
+  }
+  else
+  {
+    result = run_command(argc, args);
+  }
+  fflush(stdout);
+  scheduler_priority = previous_priority;
+  metrics_count(&metrics.jobs[job->priority == DAEMON_PRIORITY_URGENT], 1);
+
+  size = snprintf(reply, sizeof(reply), "result=%s code=%d time_ms=%lld wait_ms=%lld", result == 0 ? "ok" : "failed", result, (time_us() - start)/1000, (start - job->queued)/1000);
+  /* New image in the ring of the shared memory*/
+  if (shm_output_slot >= 0)
+  {
+    size += snprintf(reply + size, sizeof(reply) - size, " slot=%d sequence=%u", shm_output_slot, __atomic_load_n(shm_slot_sequence(shm_output_slot), __ATOMIC_RELAXED));
+  }
+  snprintf(reply + size, sizeof(reply) - size, "\n");
+  job_reply(job, reply);
+
+}
+
+/* Called between the frames of the long commands: run the jobs with a priority higher of the running job, then
+   restore the state of the running job*/
+void scheduler_preempt ()
+{
+
+  struct scheduler_context *context;
+  struct daemon_job *job;
+
+  if (!scheduler_active)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&job_lock);
+  job = job_pop_preemptive(scheduler_priority + 1);
+  pthread_mutex_unlock(&job_lock);
+  if (job == NULL)
+  {
+    return;
+  }
+
+  context = malloc(sizeof(struct scheduler_context));
+  if (context == NULL)
+  {
+    /* Run it later*/
+    pthread_mutex_lock(&job_lock);
+    job_push(job);
+    pthread_mutex_unlock(&job_lock);
+    return;
+  }
+  context->frame = frame;
+  context->first_frame = first_frame;
+  context->last_frame = last_frame;
+  context->writing_delay = writing_delay;
+  context->read_turnaround = read_turnaround;
+  context->priority = scheduler_priority;
+  context->progress = progress;
+  context->shm_writing_slot = shm_writing_slot;
+  memcpy(context->results, frame_results, sizeof(frame_results));
+
+  while (job != NULL)
+  {
+    printf("Frame %d: running an urgent job.\n", context->frame);
+    metrics_count(&metrics.preemptions, 1);
+    job_run(job);
+    pthread_mutex_lock(&job_lock);
+    job = job_pop_preemptive(context->priority + 1);
+    pthread_mutex_unlock(&job_lock);
+  }
+
+  frame = context->frame;
+  first_frame = context->first_frame;
+  last_frame = context->last_frame;
+  writing_delay = context->writing_delay;
+  read_turnaround = context->read_turnaround;
+  scheduler_priority = context->priority;
+  progress = context->progress;
+  shm_writing_slot = context->shm_writing_slot;
+  memcpy(frame_results, context->results, sizeof(frame_results));
+  free(context);
+  printf("Frame %d: resumed.\n", frame);
+
+}
+
+/* Called before every job: after an aborted session (ps3mca unplugged, card removed, timeouts in sequence) the ps3mca
+   is opened again, so the next commands don't fail immediately*/
+void daemon_session_check ()
+{
+
+  if (!daemon_opened || !ps3mca_aborted)
+  {
+    return;
+  }
+
+  fprintf(stderr, "Session aborted, opening the ps3mca again.\n");
+  close_ps3mca();
+  daemon_opened = open_ps3mca() == 0;
+  if (!daemon_opened)
+  {
+    fprintf(stderr, "Every command will open the ps3mca.\n");
+  }
+
+}
+
+void *scheduler_worker (void *unused)
+{
+
+  struct daemon_job *job;
+
+  pthread_mutex_lock(&job_lock);
+  while (!daemon_stop)
+  {
+    job = job_pop(DAEMON_PRIORITY_NORMAL);
+    if (job == NULL)
+    {
+      pthread_cond_wait(&job_ready, &job_lock);
+      continue;
+    }
+    pthread_mutex_unlock(&job_lock);
+    daemon_session_check();
+    job_run(job);
+    pthread_mutex_lock(&job_lock);
+  }
+
+  /* Jobs not started*/
+  while ((job = job_pop(DAEMON_PRIORITY_NORMAL)) != NULL)
+  {
+    job_reply(job, "result=skipped\n");
+  }
+  pthread_mutex_unlock(&job_lock);
+
+  return NULL;
+
+}
+
+/* Answer one request, return 1 if the daemon must stop*/
+int daemon_request (int client)
+{
+
+  struct daemon_job *job;
+  struct timeval timeout;
+  char *request;
+  FILE *reply;
+  int size = 0;
+  int priority = -1;
+  ssize_t got = 0;
+
+  request = malloc(DAEMON_MAX_REQUEST);
+  if (request == NULL)
+  {
+    fprintf(stderr, "Out of memory.\n");
+    close(client);
+    return 0;
+  }
+
+  /* A client that send nothing (or don't read the reply) can't block the other requests*/
+  timeout.tv_sec = DAEMON_REQUEST_TIMEOUT/1000;
+  timeout.tv_usec = (DAEMON_REQUEST_TIMEOUT%1000)*1000;
+  setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  /* The request is the first line*/
+  while (size < DAEMON_MAX_REQUEST - 1 && (got = read(client, request + size, DAEMON_MAX_REQUEST - 1 - size)) > 0)
+  {
+    size += got;
+    if (memchr(request + size - got, '\n', got) != NULL)
+    {
+      break;
+    }
+  }
+  if (got < 0)
+  {
+    fprintf(stderr, "Request not received in %d ms, connection closed.\n", DAEMON_REQUEST_TIMEOUT);
+    free(request);
+    close(client);
+    return 0;
+  }
+  request[size] = '\0';
+  request[strcspn(request, "\r\n")] = '\0';
+
+  /* Commands are replied by the worker*/
+  if (strncmp(request, "run ", 4) == 0)
+  {
+    priority = DAEMON_PRIORITY_NORMAL;
+  }
+  else if (strncmp(request, "urgent ", 7) == 0)
+  {
+    priority = DAEMON_PRIORITY_URGENT;
+  }
+  if (priority >= 0)
+  {
+    job = malloc(sizeof(struct daemon_job));
+    if (job == NULL)
+    {
+      fprintf(stderr, "Out of memory.\n");
+      free(request);
+      close(client);
+      return 0;
+    }
+    job->client = client;
+    job->priority = priority;
+    job->queued = time_us();
+    job->line = request;
+    memmove(request, strchr(request, ' ') + 1, strlen(strchr(request, ' ')));
+    request += strspn(request, " \t");
+    job->writes_card = request[0] != '\0' && strchr(DAEMON_WRITE_COMMANDS, request[0]) != NULL;
+    pthread_mutex_lock(&job_lock);
+    job_push(job);
+    pthread_cond_signal(&job_ready);
+    pthread_mutex_unlock(&job_lock);
+    return 0;
+  }
+
+  reply = fdopen(client, "w");
+  if (reply == NULL)
+  {
+    free(request);
+    close(client);
+    return 0;
+  }
+
+  if (strncmp(request, "GET ", 4) == 0)
+  {
+    if (strncmp(request + 4, "/metrics", 8) == 0 && (request[12] == ' ' || request[12] == '\0'))
+    {
+      fprintf(reply, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n");
+      metrics_write(reply);
+    }
+    else
+    {
+      fprintf(reply, "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\n\r\nOnly /metrics\n");
+    }
+  }
+  else if (strcmp(request, "metrics") == 0)
+  {
+    metrics_write(reply);
+  }
+  else if (strcmp(request, "shm") == 0)
+  {
+    if (shm_ring != NULL)
+    {
+      fprintf(reply, "shm=%s slots=%d slot_size=%lu data_offset=%d\n", shm_name, SHM_SLOTS, (unsigned long)sizeof(card_image), SHM_DATA_OFFSET);
+    }
+    else
+    {
+      fprintf(reply, "result=failed no shared memory\n");
+    }
+  }
+  else if (strcmp(request, "quit") == 0)
+  {
+    fprintf(reply, "result=ok\n");
+    fclose(reply);
+    free(request);
+    return 1;
+  }
+  else
+  {
+    fprintf(reply, "result=failed unknown request\n");
+  }
+
+  fclose(reply);
+  free(request);
+  return 0;
+
+}
 
-	  checksum = 0x00;					/* Clean checksum*/
-	  for (c = 8; c < 8+2+PS1CARD_FRAME_SIZE; c++)		/* Loop started at msb(8) and finished at last data byte(137)*/
-		{
-		  checksum = checksum ^ cmd_write[c];		/* Checksum = MSB xor LSB xor all Data bytes*/
-		}
-	  fprintf(stderr, "In your image checksum is %x, should be %x.\n", cmd_write[138], checksum);
-        }
- 
-        /* Verify Memory End Byte (0xFF=BadFrame)*/
-        else if (ps1_ram_buffer[141] == PS1CARD_REPLY_MEB_BAD_FRAME)
-        {
-          fprintf(stderr, "Bad frame Memory End Byte on frame %d.\n", frame);
-        }
+int PS1_daemon (const char *socket_name)
+{
 
-	/* Verify Memory End Byte (0xFD=Reject write to Directory Entries of currently executed file)*/
-        else if (ps1_ram_buffer[141] == POCKETSTATION_REPLY_REJECT_EXECUTED)
-        {
-          fprintf(stderr, "WARNING Reject write to Directory Entries of currently executed file on frame %d.\n", frame);
-          fprintf(stderr, "aborting for prevent to delete the currently executed file.\n");
-	  /* Clean and close the file input*/
-	  fflush(input);
-	  fclose(input);
-	  /* Unmount the ps3mca*/
-	  close_ps3mca();
-	  /* Close program with error status*/
-	  return -1;
-        }
+  struct sockaddr_un address;
+  struct sigaction action;
+  struct stat sb;
+  pthread_t worker;
+  sigset_t signals;
+  int server;
+  int client;
 
-	/* Verify Memory End Byte (0xFE=Reject write to write-protected Broken Frame region)*/
-        else if (ps1_ram_buffer[141] == POCKETSTATION_REPLY_REJECT_PROTECTED)
-        {
-          fprintf(stderr, "WARNING The write-protection is enabled by ComFlags.bit10 on frame %d.\n", frame);
-          fprintf(stderr, "Please unable write protection.\nAborting...\n");
-	  /* Clean and close the file input*/
-	  fflush(input);
-	  fclose(input);
-	  /* Unmount the ps3mca*/
-	  close_ps3mca();
-	  /* Close program with error status*/
-	  return -1;
-        }
+  if (strlen(socket_name) >= sizeof(address.sun_path))
+  {
+    fprintf(stderr, "Socket name %s is too long.\n", socket_name);
+    return 1;
+  }
 
-    }
-    else
+  /* Socket of a previous daemon*/
+  if (stat(socket_name, &sb) == 0)
+  {
+    if (!S_ISSOCK(sb.st_mode))
     {
-      fprintf(stderr, "Received %d bytes, expected a maximum of %lu  on frame %d.\n", numBytes, sizeof(ps1_ram_buffer), frame);
+      fprintf(stderr, "%s exists and isn't a socket.\n", socket_name);
+      return 1;
     }
+    unlink(socket_name);
+  }
+
+  server = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server < 0)
+  {
+    fprintf(stderr, "Unable to create the socket.\n");
+    return 1;
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, socket_name);
+  if (bind(server, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(server, DAEMON_BACKLOG) != 0)
+  {
+    fprintf(stderr, "Unable to listen on %s.\n", socket_name);
+    close(server);
+    return 1;
   }
 
+  /* Stop on SIGINT and SIGTERM (accept is interrupted), a client closed early don't stop the daemon*/
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = daemon_signal;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
 
-  /* Wait for give time to write, on original card (slower) this time is important.*/
-  /* This time can make slower the writing data, if it's possible can be better implement directly the clock.*/
-  //sleep(1);
-  delay(writing_delay);
-  #if DEBUG
-  printf("Wait %dms for write the frame.\n\n", writing_delay);
-  #endif
+  /* One session for all the requests*/
+  daemon_opened = open_ps3mca() == 0;
+  if (!daemon_opened)
+  {
+    fprintf(stderr, "Commands that use the card will fail.\n");
+  }
 
+  /* Ring of images for the clients, the daemon works also without it*/
+  if (shm_create() != 0)
+  {
+    fprintf(stderr, "Images in shared memory (shm) will fail.\n");
+  }
 
-  /* Clean buffer.*/
-  memset(ps1_ram_buffer, 0, sizeof(ps1_ram_buffer));
+  /* The signals go to this thread, the worker is blocked on the card*/
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  scheduler_active = 1;
+  if (pthread_create(&worker, NULL, scheduler_worker, NULL) != 0)
+  {
+    fprintf(stderr, "Unable to start the worker.\n");
+    scheduler_active = 0;
+    daemon_stop = 1;
+  }
+  pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
 
-  /* End of frame to frame loop*/
+  printf("Daemon listening on %s.\n", socket_name);
+  fflush(stdout);
+
+  while (!daemon_stop)
+  {
+    client = accept(server, NULL, NULL);
+    if (client < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      fprintf(stderr, "Error accepting a connection.\n");
+      break;
+    }
+    if (daemon_request(client))
+    {
+      daemon_stop = 1;
+    }
   }
 
-  /* Clean and close the file input*/
-  fflush(input);
-  fclose(input);
+  /* The running job end, the others are skipped*/
+  if (scheduler_active)
+  {
+    pthread_mutex_lock(&job_lock);
+    daemon_stop = 1;
+    pthread_cond_signal(&job_ready);
+    pthread_mutex_unlock(&job_lock);
+    pthread_join(worker, NULL);
+    scheduler_active = 0;
+  }
 
-  /* Unmount the ps3mca*/
-  close_ps3mca();
+  if (daemon_opened)
+  {
+    close_ps3mca();
+  }
+  shm_destroy();
+  close(server);
+  unlink(socket_name);
 
+  printf("Daemon stopped.\n");
   return 0;
 
 }
-/* ----------------------------------------------------End of PS1 command write------------------------------------------------------*/
+/* -------------------------------------------------------------End of Daemon------------------------------------------------------*/
 
 
 
@@ -1032,10 +8118,10 @@ int PS1_write ()
 
 
 /*-----------------------------------------------------------Main program-----------------------------------------------------------*/
-int main(int argc, char* argv[])
+int dispatch_command(int argc, char* argv[])
 {
 
-  if (argc > 4)
+  if (argc > 5 && !(argc == 6 && strcmp(argv[5], "force") == 0))
   {
     fprintf(stderr, "Warning: uncorrect command. See usage of program.\n");
   }
@@ -1084,7 +8170,12 @@ int main(int argc, char* argv[])
 	/* If tipe "ps3mca-ps1 r"*/
 	if (argc == (2))
 	{
-	return PS1_read ();
+	return PS1_read (NULL);
+	}
+	/* If type "ps3mca-ps1 r image"*/
+	else if (argc == (2+1))
+	{
+	return PS1_read (argv[2]);
 	}
 	else
 	{
@@ -1093,20 +8184,69 @@ int main(int argc, char* argv[])
 	}
 	break;
 
+      case 'e':
+	/* If type "ps3mca-ps1 e", "ps3mca-ps1 e image" or "ps3mca-ps1 e image reads"*/
+	if (argc == (2))
+	{
+		return PS1_consensus_read (NULL, CONSENSUS_MAX_READS);
+	}
+	else if (argc == (2+1))
+	{
+		return PS1_consensus_read (argv[2], CONSENSUS_MAX_READS);
+	}
+	else if (argc == (2+2))
+	{
+		return PS1_consensus_read (argv[2], atoi(argv[3]));
+	}
+	else
+	{
+		fprintf(stderr, "Error on usage of consensus read command.\n");
+		return 1;
+	}
+	break;
+
       case 'w':
 	/* If tipe "ps3mca-ps1 w"*/
 	if (argc == (2))
 	{
 		first_frame = PS1CARD_MIN_FRAME;
 		last_frame = PS1CARD_MAX_FRAME;
-		return PS1_write ();
+		return PS1_write ("write.mcd");
+	}
+	/* If type "ps3mca-ps1 w image" or "ps3mca-ps1 w patch.mcdelta"*/
+	else if (argc == (2+1))
+	{
+		first_frame = PS1CARD_MIN_FRAME;
+		last_frame = PS1CARD_MAX_FRAME;
+		return is_delta_image(argv[2]) ? PS1_write_delta (argv[2], 0) : PS1_write (argv[2]);
+	}
+	/* If type "ps3mca-ps1 w patch.mcdelta force"*/
+	else if (argc == (2+2) && strcmp(argv[3], "force") == 0 && is_delta_image(argv[2]))
+	{
+		first_frame = PS1CARD_MIN_FRAME;
+		last_frame = PS1CARD_MAX_FRAME;
+		return PS1_write_delta (argv[2], 1);
 	}
 	/* If type "ps3mca-ps1 w number number"*/
 	else if (argc == (2+2))
 	{
 		first_frame = atoi(argv[2]);
 		last_frame = atoi(argv[3]);
-		return PS1_write ();
+		return PS1_write ("write.mcd");
+	}
+	/* If type "ps3mca-ps1 w image number number"*/
+	else if (argc == (2+3))
+	{
+		first_frame = atoi(argv[3]);
+		last_frame = atoi(argv[4]);
+		return is_delta_image(argv[2]) ? PS1_write_delta (argv[2], 0) : PS1_write (argv[2]);
+	}
+	/* If type "ps3mca-ps1 w patch.mcdelta number number force"*/
+	else if (argc == (2+4) && strcmp(argv[5], "force") == 0 && is_delta_image(argv[2]))
+	{
+		first_frame = atoi(argv[3]);
+		last_frame = atoi(argv[4]);
+		return PS1_write_delta (argv[2], 1);
 	}
 	else
 	{
@@ -1114,6 +8254,230 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 	break;
+
+      case 'u':
+	/* If type "ps3mca-ps1 u"*/
+	if (argc == (2))
+	{
+		return PS1_undo ();
+	}
+	else
+	{
+		fprintf(stderr, "Warning: %s only processes one option at a time! %d were given.\n", argv[0], argc - 1);
+		return 1;
+	}
+	break;
+
+      case 'a':
+	/* If type "ps3mca-ps1 a"*/
+	if (argc == (2))
+	{
+	return PS1_calibrate ();
+	}
+	else
+	{
+		fprintf(stderr, "Warning: %s only processes one option at a time! %d were given.\n", argv[0], argc - 1);
+		return 1;
+	}
+	break;
+
+      case 'c':
+	/* If type "ps3mca-ps1 c image" or "ps3mca-ps1 c image all"*/
+	if (argc == (2+1))
+	{
+		return PS1_compare (argv[2], 0);
+	}
+	else if (argc == (2+2) && strcmp(argv[3], "all") == 0)
+	{
+		return PS1_compare (argv[2], 1);
+	}
+	else
+	{
+		fprintf(stderr, "Error on usage of compare command, need the image.\n");
+		return 1;
+	}
+	break;
+
+      case 'd':
+	/* If type "ps3mca-ps1 d baseline.mcd"*/
+	if (argc == (2+1))
+	{
+		return PS1_delta_read (argv[2]);
+	}
+	else
+	{
+		fprintf(stderr, "Error on usage of delta command, need the baseline image.\n");
+		return 1;
+	}
+	break;
+
+      case 'm':
+	/* If type "ps3mca-ps1 m delta.mcdelta output.mcd"*/
+	if (argc == (2+2))
+	{
+		return PS1_delta_materialize (argv[2], argv[3]);
+	}
+	else
+	{
+		fprintf(stderr, "Error on usage of materialize command, need the delta image and the output image.\n");
+		return 1;
+	}
+	break;
+
+      case 'h':
+	/* If type "ps3mca-ps1 h socket"*/
+	if (argc == (2+1))
+	{
+		return PS1_daemon (argv[2]);
+	}
+	else
+	{
+		fprintf(stderr, "Error on usage of daemon command, need the socket.\n");
+		return 1;
+	}
+	break;
+
+      case 'i':
+	/* If type "ps3mca-ps1 i directory" or "ps3mca-ps1 i directory index.tsv"*/
+	if (argc == (2+1))
+	{
+		return PS1_archive_scan (argv[2], ARCHIVE_INDEX);
+	}
+	else if (argc == (2+2))
+	{
+		return PS1_archive_scan (argv[2], argv[3]);
+	}
+	else
+	{
+		fprintf(stderr, "Error on usage of index command, need the directory of images.\n");
+		return 1;
+	}
+	break;
+
+      case 'l':
+	/* If type "ps3mca-ps1 l" or "ps3mca-ps1 l image.mcd"*/
+	if (argc == (2))
+	{
+		return PS1_list (NULL);
+	}
+	else if (argc == (2+1))
+	{
+		return PS1_list (argv[2]);
+	}
+	else
+	{
+		fprintf(stderr, "Error on usage of list command.\n");
+		return 1;
+	}
+	break;
+
+      case 'f':
+	/* If type "ps3mca-ps1 f mountpoint"*/
+	#if FUSE
+	if (argc == (2+1))
+	{
+		return PS1_fuse_mount (argv[2]);
+	}
+	else
+	{
+		fprintf(stderr, "Error on usage of mount command, need the mount point.\n");
+		return 1;
+	}
+	#else
+	fprintf(stderr, "Compiled without FUSE support, use ps3mca-ps1-fuse (make ps3mca-ps1-fuse).\n");
+	return 1;
+	#endif
+	break;
+
+      case 't':
+	/* If type "ps3mca-ps1 t input output" or "ps3mca-ps1 t input_directory output_directory extension"*/
+	if (argc == (2+2))
+	{
+		return image_convert (argv[2], argv[3]);
+	}
+	else if (argc == (2+3))
+	{
+		return PS1_batch_convert (argv[2], argv[3], argv[4]);
+	}
+	else
+	{
+		fprintf(stderr, "Error on usage of convert command.\n");
+		return 1;
+	}
+	break;
+
+      case 'x':
+	/* If type "ps3mca-ps1 x old.mcd new.mcd" or "ps3mca-ps1 x old.mcd new.mcd patch.mcdelta"*/
+	if (argc == (2+2))
+	{
+		return PS1_diff (argv[2], argv[3], NULL);
+	}
+	else if (argc == (2+3))
+	{
+		return PS1_diff (argv[2], argv[3], argv[4]);
+	}
+	else
+	{
+		fprintf(stderr, "Error on usage of diff command, need two images.\n");
+		return 1;
+	}
+	break;
+
+      case 'b':
+	/* If type "ps3mca-ps1 b script.txt" or "ps3mca-ps1 b -" (script from standard input)*/
+	if (argc == (2+1))
+	{
+		return PS1_batch (argv[2]);
+	}
+	else
+	{
+		fprintf(stderr, "Error on usage of batch command, need the script.\n");
+		return 1;
+	}
+	break;
+
+      case 'k':
+	/* If type "ps3mca-ps1 k minutes" or "ps3mca-ps1 k minutes log.tsv"*/
+	if (argc == (2+1))
+	{
+		return PS1_soak (atof(argv[2]), NULL);
+	}
+	else if (argc == (2+2))
+	{
+		return PS1_soak (atof(argv[2]), argv[3]);
+	}
+	else
+	{
+		fprintf(stderr, "Error on usage of soak command, need the minutes.\n");
+		return 1;
+	}
+	break;
+
+      case 'n':
+	/* If type "ps3mca-ps1 n image"*/
+	if (argc == (2+1))
+	{
+		return PS1_validate (argv[2]);
+	}
+	else
+	{
+		fprintf(stderr, "Error on usage of validate command, need the image.\n");
+		return 1;
+	}
+	break;
+
+      case 'q':
+	/* If type "ps3mca-ps1 q"*/
+	if (argc == (2))
+	{
+	return PS1_quick_scan ();
+	}
+	else
+	{
+		fprintf(stderr, "Warning: %s only processes one option at a time! %d were given.\n", argv[0], argc - 1);
+		return 1;
+	}
+	break;
     }
 
 
@@ -1121,6 +8485,41 @@ int main(int argc, char* argv[])
 
   return 1;
 
+}
+
+int run_command(int argc, char* argv[])	/* Run one command, from the command line or from a batch script*/
+{
+
+  int result;
+  long long start;
+
+  /* The steps of a batch script and the requests of the daemon have their own results*/
+  if (argc < 2 || argv[1][0] == 'b' || argv[1][0] == 'h')
+  {
+    return dispatch_command (argc, argv);
+  }
+
+  frame_results_reset();
+  start = time_us();
+  result = dispatch_command (argc, argv);
+
+  /* A frame with errors fail the command, also if the image is saved*/
+  if (result == 0 && frame_results_failed() > 0)
+  {
+    fprintf(stderr, "%d frames with errors.\n", frame_results_failed());
+    result = 1;
+  }
+  report_write(argc, argv, result, time_us() - start);
+
+  return result;
+
+}
+
+int main(int argc, char* argv[])
+{
+
+  return run_command (argc, argv);
+
 }
 /*--------------------------------------------------------End of Main program-------------------------------------------------------*/
 
@@ -0,0 +1,177 @@
+/*
+ * this is a libusb program to communicate with the PlayStation 3 Memory Card Adaptor CECHZM1 (SCPH-98042) for PS1 cards (SCPH-1020,
+ * SCPH-1170 and SCPH-119X), maybe the PocketStation (SCPH-4000) and maybe other cards or device (like the MEMORY DISK DRIVE).
+ *
+ * Copyright (C) 2017 Paolo Caroni <kenren89@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with this program.
+ * If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* ------------------------------------------------------------Daemon client--------------------------------------------------------*/
+/* Client of the daemon ("ps3mca-ps1 h socket"), only this header is needed (no libusb).
+   Read in the ring, without copies:
+     ps3mca_client_request(socket, "shm", reply, size)            reply "shm=/ps3mca-ps1-1234 slots=8 ..."
+     ring = ps3mca_client_map_ring("/ps3mca-ps1-1234", &ring_size)
+     ps3mca_client_request(socket, "run r shm", reply, size)      reply "result=ok ... slot=3 sequence=6"
+     image = ps3mca_client_image(ring, 3, &sequence)              use the 128 KiB of image, then
+     ps3mca_client_image_valid(ring, 3, sequence)                 0 if the daemon has written the slot again
+   Write from a buffer of the client:
+     image = ps3mca_client_buffer("/my-restore-worker")           copy or build the image in it
+     ps3mca_client_request(socket, "run w shm:/my-restore-worker", reply, size)
+   The layout of the ring is in Shared memory definitions of ps3mca-ps1-driver.h (the sequence is a uint32_t of the host).*/
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define PS3MCA_CLIENT_IMAGE_SIZE 131072
+#define PS3MCA_CLIENT_RING_HEADER_SIZE 64
+#define PS3MCA_CLIENT_SLOT_HEADER_SIZE 32
+#define PS3MCA_CLIENT_SLOT_GOOD 2
+
+static inline uint32_t ps3mca_client_le32 (const uint8_t *bytes)
+{
+  return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+/* Send a request and wait the reply (the daemon close the connection), return 0 if the reply is arrived*/
+static inline int ps3mca_client_request (const char *socket_name, const char *request, char *reply, size_t reply_size)
+{
+
+  struct sockaddr_un address;
+  size_t size = 0;
+  ssize_t got;
+  int client;
+
+  if (strlen(socket_name) >= sizeof(address.sun_path) || reply_size == 0)
+  {
+    return 1;
+  }
+
+  client = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (client < 0)
+  {
+    return 1;
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, socket_name);
+  if (connect(client, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+      write(client, request, strlen(request)) != (ssize_t)strlen(request) || write(client, "\n", 1) != 1)
+  {
+    close(client);
+    return 1;
+  }
+
+  while (size < reply_size - 1 && (got = read(client, reply + size, reply_size - 1 - size)) > 0)
+  {
+    size += got;
+  }
+  reply[size] = '\0';
+  close(client);
+
+  return size == 0;
+
+}
+
+/* Map the ring of the daemon in reading, NULL on error*/
+static inline const uint8_t *ps3mca_client_map_ring (const char *shm_name, size_t *ring_size)
+{
+
+  struct stat sb;
+  void *ring;
+  int fd;
+
+  fd = shm_open(shm_name, O_RDONLY, 0);
+  if (fd < 0)
+  {
+    return NULL;
+  }
+  if (fstat(fd, &sb) != 0 || sb.st_size < PS3MCA_CLIENT_RING_HEADER_SIZE)
+  {
+    close(fd);
+    return NULL;
+  }
+  ring = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ring == MAP_FAILED || memcmp(ring, "PS1SHMR", 8) != 0)
+  {
+    if (ring != MAP_FAILED)
+    {
+      munmap(ring, sb.st_size);
+    }
+    return NULL;
+  }
+
+  *ring_size = sb.st_size;
+  return ring;
+
+}
+
+/* Image of a slot and its sequence, NULL if the slot hasn't a good image or it is being written*/
+static inline const uint8_t *ps3mca_client_image (const uint8_t *ring, int slot, uint32_t *sequence)
+{
+
+  const uint8_t *header = ring + PS3MCA_CLIENT_RING_HEADER_SIZE + slot*PS3MCA_CLIENT_SLOT_HEADER_SIZE;
+
+  if (slot < 0 || (uint32_t)slot >= ps3mca_client_le32(ring + 8))
+  {
+    return NULL;
+  }
+
+  /* The image and the state are read after the sequence*/
+  *sequence = __atomic_load_n((const uint32_t *)header, __ATOMIC_ACQUIRE);
+  if ((*sequence & 1) || ps3mca_client_le32(header + 4) != PS3MCA_CLIENT_SLOT_GOOD)
+  {
+    return NULL;
+  }
+
+  return ring + ps3mca_client_le32(ring + 16) + (size_t)slot*PS3MCA_CLIENT_IMAGE_SIZE;
+
+}
+
+/* 1 if the image of the slot is still the image of ps3mca_client_image (call it after using the image)*/
+static inline int ps3mca_client_image_valid (const uint8_t *ring, int slot, uint32_t sequence)
+{
+  /* The reads of the image are done before the sequence is read again*/
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n((const uint32_t *)(ring + PS3MCA_CLIENT_RING_HEADER_SIZE + slot*PS3MCA_CLIENT_SLOT_HEADER_SIZE), __ATOMIC_RELAXED) == sequence;
+}
+
+/* Create (or open) a buffer of the client for an image, "shm:name" is its name for the daemon. NULL on error*/
+static inline uint8_t *ps3mca_client_buffer (const char *shm_name)
+{
+
+  void *buffer;
+  int fd;
+
+  fd = shm_open(shm_name, O_RDWR | O_CREAT, 0600);
+  if (fd < 0)
+  {
+    return NULL;
+  }
+  if (ftruncate(fd, PS3MCA_CLIENT_IMAGE_SIZE) != 0)
+  {
+    close(fd);
+    return NULL;
+  }
+  buffer = mmap(NULL, PS3MCA_CLIENT_IMAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  return buffer == MAP_FAILED ? NULL : buffer;
+
+}
+/* --------------------------------------------------------End of Daemon client-----------------------------------------------------*/
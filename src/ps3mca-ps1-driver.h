@@ -20,7 +20,11 @@
 /* Define the USB device (CECHZM1)*/
 uint16_t USB_VENDOR =				0x054c;	/* Sony Corp.*/
 uint16_t USB_PRODUCT =				0x02ea;	/* PlayStation 3 Memory Card Adaptor*/
-unsigned int USB_TIMEOUT = 			5000;	/* USB timeout (milliseconds)*/
+unsigned int USB_TIMEOUT = 			5000;	/* USB timeout (milliseconds), max value of the adaptive timeout*/
+unsigned int USB_TIMEOUT_FIRST = 		1000;	/* USB timeout before the first measure of round-trip time (milliseconds)*/
+unsigned int USB_TIMEOUT_MIN = 			100;	/* Min value of the adaptive timeout (milliseconds)*/
+int USB_TIMEOUT_DEVIATIONS = 			4;	/* Adaptive timeout is mean round-trip time + 4 mean deviations*/
+int USB_MAX_TIMEOUTS = 				3;	/* Timeouts in sequence before abort*/
 
 uint8_t BULK_WRITE_ENDPOINT = 			0x02;	/* bEndpointAddress     0x02  EP 2 OUT (Bulk)*/
 uint8_t BULK_READ_ENDPOINT = 			0x81;	/* bEndpointAddress     0x81  EP 1 IN  (Bulk)*/
@@ -60,6 +64,31 @@ uint8_t checksum;					/* Checksum variable*/
 uint8_t ps1_ram_buffer[256];				/* 256 bytes of RAM on chip*/
 /*int PS1CARD_BLOCK_SIZE = 8192;				/* single block 1024x8=8192 bytes*/
 /*int PS1CARD_MAX_BLOCK = 16;				/* max number of block (however 1 is lost for formatting MC)*/
+int PS1CARD_BLOCKS = 16;				/* Block 0 is the header and directory, block 1 to 15 are for files*/
+int PS1CARD_BLOCK_FRAMES = 64;				/* 8192/128=64 frame for every block*/
+uint16_t PS1CARD_DIRECTORY_LAST_FRAME = 0x000f;		/* Frame 0 is the header, frame 1 to 15 are the directory entries of block 1 to 15*/
+
+/* Directory entry (one frame for every block) allocation state, byte 0 of the frame*/
+uint8_t PS1CARD_DIR_FIRST_BLOCK =		0x51;	/* In use, first or only block of a file*/
+uint8_t PS1CARD_DIR_MIDDLE_BLOCK =		0x52;	/* In use, middle block of a file*/
+uint8_t PS1CARD_DIR_LAST_BLOCK =		0x53;	/* In use, last block of a file*/
+uint8_t PS1CARD_DIR_FREE_BLOCK =		0xa0;	/* Free, freshly formatted*/
+
+/* Directory entry fields, offset in the frame*/
+int PS1CARD_DIR_SIZE_OFFSET = 0x04;			/* 4 bytes file size in bytes (little endian), only on first block*/
+int PS1CARD_DIR_NEXT_OFFSET = 0x08;			/* 2 bytes next block minus 1 (little endian), FFFFh for last block*/
+int PS1CARD_DIR_NAME_OFFSET = 0x0a;			/* 20 bytes file name: region (2) + product code (10) + identifier (8)*/
+int PS1CARD_DIR_NAME_SIZE = 20;				/* Max file name lenght (ASCII, zero terminated if shorter)*/
+int PS1CARD_CHECKSUM_OFFSET = 0x7f;			/* Checksum of header and directory frames (xor of bytes 00h to 7eh)*/
+
+/* Title frame, first frame of the first block of every file*/
+int PS1CARD_TITLE_OFFSET = 0x04;			/* 64 bytes title (Shift-JIS)*/
+int PS1CARD_TITLE_SIZE = 64;
+
+/* Broken frame list, frame 16 to 35: 4 bytes number of a broken frame (little endian), FFFFFFFFh if unused,
+   the replacement of the broken frame is in frame 36 to 55*/
+uint16_t PS1CARD_BROKEN_FIRST_FRAME = 0x0010;
+uint16_t PS1CARD_BROKEN_LAST_FRAME = 0x0023;
 
 /* -------------------------------------------End of PS1 Memory Card definitions------------------------------------------------------*/
 
@@ -95,6 +124,14 @@ uint8_t PS1CARD_REPLY_NUMBER_FRAME_2 = 		0x00;	/* Last two significant digits of
 uint8_t PS1CARD_REPLY_FRAME_SIZE_1 = 		0x00;	/* First two significant digits of the frame size*/
 uint8_t PS1CARD_REPLY_FRAME_SIZE_2 = 		0x80;	/* Last two significant digits of the frame size (0080h=128)*/
 
+/* Templates of read and write packets: ps3mca first command, PS1 type of command, lenght of command (packet size-4), 00h,
+   memory card access, command, ID1, ID2. Frame value (MSB, LSB), data and checksum follow*/
+#define PS1CARD_READ_PACKET_SIZE	144		/* 4+140 (8ch), 134 bytes of 00h after the frame value for the reply*/
+#define PS1CARD_WRITE_PACKET_SIZE	142		/* 4+138 (8ah), frame value, 128 bytes data, checksum, 3 bytes for the reply*/
+#define PS1CARD_WRITE_PACKET_DATA	10		/* Offset of the data in the write packet*/
+uint8_t PS1CARD_READ_PACKET_HEADER[8] =  { 0xaa, 0x42, 0x8c, 0x00, 0x81, 0x52, 0x00, 0x00 };
+uint8_t PS1CARD_WRITE_PACKET_HEADER[8] = { 0xaa, 0x42, 0x8a, 0x00, 0x81, 0x57, 0x00, 0x00 };
+
 
 /* -----------------------------------------------End of PS1 Memory Card commands list------------------------------------------------*/
 
@@ -112,3 +149,243 @@ uint16_t last_frame;					/* Last frame to be wited*/
 
 
 
+
+
+/* ----------------------------------------------------Delta image definitions-------------------------------------------------------*/
+/* Delta image (*.mcdelta), only the frames that differ from a baseline image:
+   8 bytes   magic "PS1DELTA"
+   4 bytes   number of frame records (little endian)
+   4 bytes   fingerprint of the baseline image (little endian)
+   256 bytes baseline image file name (zero padded), relative to the directory of the delta image or full path
+   then for every record 2 bytes frame number (little endian) + 128 bytes Data Frame
+*/
+char DELTA_MAGIC[] = "PS1DELTA";			/* First 8 bytes of a delta image*/
+int DELTA_HEADER_SIZE = 272;				/* 8+4+4+256 bytes*/
+int DELTA_RECORD_SIZE = 130;				/* 2+128 bytes*/
+int DELTA_MAX_DEPTH = 16;				/* Max chain of delta images over other delta images*/
+
+/* ------------------------------------------------End of Delta image definitions----------------------------------------------------*/
+
+
+
+
+
+/* ----------------------------------------------------Quick scan definitions--------------------------------------------------------*/
+/* Every line of the cache is "fingerprint image_file_name", fingerprint (hex) of the sampled frames of a dumped card*/
+char QUICK_SCAN_CACHE[] = "ps3mca-ps1-cache.txt";	/* Cache of the previous dumps, in the working directory*/
+
+/* ------------------------------------------------End of Quick scan definitions-----------------------------------------------------*/
+
+
+
+
+
+/* ----------------------------------------------------Archive scanner definitions---------------------------------------------------*/
+char ARCHIVE_INDEX[] = "ps3mca-ps1-index.tsv";		/* Default index of the saves in the scanned images*/
+
+/* ------------------------------------------------End of Archive scanner definitions------------------------------------------------*/
+
+
+
+
+
+/* ----------------------------------------------------Image formats definitions-----------------------------------------------------*/
+/* Supported memory card images, all have the 128 KiB of Data Frames after the header*/
+#define IMAGE_FORMAT_RAW 0				/* Pure (raw) image: *.psm, *.ps, *.ddf, *.mcr, *.mcd, *.mc*/
+#define IMAGE_FORMAT_VGS 1				/* Connectix Virtual Game Station (*.mem)*/
+#define IMAGE_FORMAT_PSX 2				/* PlayStation Magazine (*.psx)*/
+#define IMAGE_FORMAT_VM1 3				/* PS3 internal HDD (*.vm1), raw image*/
+#define IMAGE_FORMAT_LIBRARY 4				/* Image of a card library (*.mcl, see Card library definitions)*/
+#define IMAGE_FORMAT_SHM 5				/* Image in shared memory (shm, shm:slot, shm:/name, see Shared memory definitions)*/
+
+const char *IMAGE_MAGIC[] = { "", "VgsM", "PSV", "", "PS1MCLIB", "" };	/* First bytes of the header*/
+long IMAGE_HEADER_SIZE[] = { 0, 64, 256, 0, 0, 0 };	/* Bytes before the first Data Frame (library: from the index)*/
+
+/* ------------------------------------------------End of Image formats definitions--------------------------------------------------*/
+
+
+
+
+
+/* ----------------------------------------------------Card library definitions------------------------------------------------------*/
+/* Many card images in one file (*.mcl), "library.mcl@selector" is an image of the library (see Card library).
+   Header: magic (8), version (4), images (4), first index block (8), last index block (8), zeros up to 64 bytes.
+   Index block: used entries (4), entries (4), next index block (8, 0 for the last), entries.
+   Entry: image offset (8), time of the append (8, seconds since 1970), image fingerprint (4), saves (1), zeros (3),
+   card id (8, zeros if unknown), zeros up to 64 bytes, then a record for every save (in block order).
+   Save record: file name (20), title in ASCII (64), first block (1), blocks (1), zeros up to 96 bytes.
+   All numbers are little endian, every image start on a LIBRARY_ALIGN boundary (for mapping it alone).*/
+int LIBRARY_VERSION = 1;
+int LIBRARY_HEADER_SIZE = 64;
+int LIBRARY_BLOCK_HEADER_SIZE = 16;
+int LIBRARY_BLOCK_ENTRIES = 256;			/* Entries of every index block*/
+int LIBRARY_ENTRY_HEADER_SIZE = 64;
+int LIBRARY_ENTRY_SIZE = 1504;				/* 64 + 15 save records*/
+int LIBRARY_SAVE_SIZE = 96;
+int LIBRARY_ALIGN = 4096;
+
+/* ------------------------------------------------End of Card library definitions---------------------------------------------------*/
+
+
+
+
+
+/* ----------------------------------------------------Timing profiles definitions---------------------------------------------------*/
+/* Every line of the profiles is "card_id directory_signature writing_delay read_turnaround":
+   card id (hex) is the get id reply, directory signature (hex) the fingerprint of frame 0 to 15,
+   writing_delay in milliseconds and read_turnaround (time of a frame read) in microseconds.*/
+char TIMING_PROFILES[] = "ps3mca-ps1-profiles.txt";	/* Profiles of the calibrated cards, in the working directory*/
+uint16_t CALIBRATION_FRAME = 0x003f;			/* Frame 63, write test frame of the card (unused by files)*/
+int CALIBRATION_WRITES = 8;				/* Writes with the same delay to declare it reliable*/
+int CALIBRATION_READS = 32;				/* Reads for measure the read turnaround*/
+int CALIBRATION_MARGIN = 5;				/* Milliseconds added to the minimum reliable delay*/
+long read_turnaround = 0;				/* Read turnaround of the card (microseconds), 0 if unknown*/
+
+/* ------------------------------------------------End of Timing profiles definitions------------------------------------------------*/
+
+
+
+
+
+/* -----------------------------------------------------Batch script definitions-----------------------------------------------------*/
+/* Every line of a script is a command without "ps3mca-ps1" (for example "r dump.mcd"), empty lines and lines starting
+   with '#' are skipped. A line starting with '-' don't stop the script if the command fail.*/
+int BATCH_MAX_LINE = 1024;				/* Max length of a line of the script*/
+#define BATCH_MAX_ARGS 8				/* Max words of a command*/
+
+/* -------------------------------------------------End of Batch script definitions--------------------------------------------------*/
+
+
+
+
+
+/* -----------------------------------------------------Frame result definitions----------------------------------------------------*/
+/* Errors of a frame (bits of frame_result.errors), one for every check of PS1_read_frame and PS1_write_frame*/
+#define FRAME_ERROR_SEND	0x0001			/* Command not sent to the ps3mca*/
+#define FRAME_ERROR_NO_REPLY	0x0002			/* No reply (timeout, ps3mca disconnected or session aborted)*/
+#define FRAME_ERROR_SIZE	0x0004			/* Reply longer than the buffer*/
+#define FRAME_ERROR_AUTH	0x0008			/* PS3mca status wrong (autentication failed)*/
+#define FRAME_ERROR_PROTOCOL	0x0010			/* Unknown PS3mca status*/
+#define FRAME_ERROR_ACK		0x0020			/* Bad command acknowledge*/
+#define FRAME_ERROR_ADDRESS	0x0040			/* Confirmed address isn't the frame number*/
+#define FRAME_ERROR_CHECKSUM	0x0080			/* Bad checksum of the read frame*/
+#define FRAME_ERROR_MEB		0x0100			/* Memory End Byte isn't good*/
+#define FRAME_ERROR_REJECTED	0x0200			/* Write rejected by a PocketStation*/
+#define FRAME_ERROR_UNSTABLE	0x0400			/* Good reads with different data (consensus read)*/
+#define FRAME_ERROR_NO_CARD	0x0800			/* There isn't a PS1 card in the ps3mca*/
+#define FRAME_ERRORS		12
+
+char *FRAME_ERROR_NAMES[FRAME_ERRORS] = { "send", "no_reply", "size", "auth", "protocol", "ack", "address", "checksum", "meb", "rejected", "unstable", "no_card" };
+char REPORT_VARIABLE[] = "PS3MCA_REPORT";		/* Environment variable with the report file (JSON, one line for command)*/
+char PROGRESS_VARIABLE[] = "PS3MCA_PROGRESS_FD";	/* Environment variable with the file descriptor of the progress (see Progress)*/
+int PROGRESS_INTERVAL = 250;				/* Milliseconds between two progress lines*/
+
+/* -------------------------------------------------End of Frame result definitions-------------------------------------------------*/
+
+
+
+
+
+/* ----------------------------------------------------Consensus read definitions---------------------------------------------------*/
+int CONSENSUS_READS = 2;				/* Good reads with the same data to accept a frame*/
+#define CONSENSUS_MAX_READS 8				/* Default max reads of a frame before declaring it unstable*/
+#define CONSENSUS_LIMIT_READS 32			/* Max reads of a frame selectable from command line*/
+
+/* ------------------------------------------------End of Consensus read definitions------------------------------------------------*/
+
+
+
+
+
+/* ------------------------------------------------------Read pipeline definitions--------------------------------------------------*/
+/* Frames read by PS1_read wait in a queue of PIPELINE_DEPTH frames for the thread of the sinks (see Read pipeline)*/
+#define PIPELINE_DEPTH 64				/* Power of two*/
+int PIPELINE_WAIT_US = 200;				/* Sleep of the reads waiting the sinks (queue full)*/
+char SINKS_VARIABLE[] = "PS3MCA_SINKS";			/* Sinks after the image, like "index,fingerprint,copy=backup.mcd"*/
+
+/* --------------------------------------------------End of Read pipeline definitions-----------------------------------------------*/
+
+
+
+
+
+/* ----------------------------------------------------Simulated ps3mca definitions-------------------------------------------------*/
+/* With PS3MCA_SIMULATE=image.mcd (or "blank" for a formatted card) every command use a simulated ps3mca with a PS1 card
+   in memory instead of the USB device. The file is never changed, the writes change the card in memory and the next
+   commands of the same process (batch script, daemon) see them. Latency, errors and degradation can be added.*/
+char SIMULATE_VARIABLE[] = "PS3MCA_SIMULATE";
+char SIMULATE_LATENCY_VARIABLE[] = "PS3MCA_SIMULATE_LATENCY";	/* Microseconds for every reply*/
+char SIMULATE_ERRORS_VARIABLE[] = "PS3MCA_SIMULATE_ERRORS";	/* Replies of read every 10000 with a wrong data byte*/
+char SIMULATE_DRIFT_VARIABLE[] = "PS3MCA_SIMULATE_DRIFT";	/* Microseconds added to the latency every 1000 transfers*/
+
+/* ------------------------------------------------End of Simulated ps3mca definitions----------------------------------------------*/
+
+
+
+
+
+/* -----------------------------------------------------------Soak definitions------------------------------------------------------*/
+/* Every cycle: open the ps3mca, get id, read all the card, rewrite the write test frame (CALIBRATION_FRAME) with its data*/
+int SOAK_MAX_FAILED_CYCLES = 3;				/* Failed cycles in sequence before stopping*/
+
+/* -------------------------------------------------------End of Soak definitions--------------------------------------------------*/
+
+
+
+
+
+/* ----------------------------------------------------------Daemon definitions-----------------------------------------------------*/
+/* "ps3mca-ps1 h socket" keep the ps3mca open and answer on a Unix socket, one request (a line) for connection:
+   "metrics" or "GET /metrics" (HTTP) for the counters in Prometheus text format, "run command" for running a command
+   (as a line of a batch script), "urgent command" for running it before the normal jobs, "quit" for stopping the daemon.*/
+int DAEMON_MAX_REQUEST = 1024;				/* Max length of a request*/
+int DAEMON_BACKLOG = 16;				/* Connections waiting*/
+int DAEMON_REQUEST_TIMEOUT = 2000;			/* Milliseconds for receiving a request or sending a reply*/
+int DAEMON_PRIORITY_NORMAL = 0;				/* "run command", in arrival order*/
+int DAEMON_PRIORITY_URGENT = 1;				/* "urgent command", run also between the frames of a normal job*/
+char DAEMON_WRITE_COMMANDS[] = "wuakbf";		/* Commands that can write the card, never run between the frames of a job*/
+
+/* Upper bounds (microseconds) of the buckets of the frame latency histogram*/
+#define METRICS_BUCKETS 9
+long METRICS_LATENCY_BUCKETS[METRICS_BUCKETS] = { 250, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000 };
+
+/* -------------------------------------------------------End of Daemon definitions-------------------------------------------------*/
+
+
+
+
+
+/* ------------------------------------------------------Undo journal definitions---------------------------------------------------*/
+/* Before a write the original content of the frames is saved in the journal, in the order of the write.
+   Header: magic (8), frames (4), frames started (4, updated before every frame), then a record for every frame: frame
+   number (2, little endian), original data (128), fingerprint of the new data (4, little endian). All the official cards
+   reply the same id, so the card is recognized by its frames: a started frame must be the original or the new one.*/
+char UNDO_JOURNAL[] = "ps3mca-ps1-undo.bin";
+char UNDO_MAGIC[] = "PS1UND2";				/* 8 bytes with the final zero*/
+int UNDO_HEADER_SIZE = 16;
+int UNDO_RECORD_SIZE = 134;
+int UNDO_CHECK_FRAMES = 8;				/* Frames not started compared with the journal before the restore*/
+
+/* --------------------------------------------------End of Undo journal definitions------------------------------------------------*/
+
+
+
+
+
+/* -----------------------------------------------------Shared memory definitions---------------------------------------------------*/
+/* Ring of images of the daemon in a POSIX shared memory object, the layout is also in ps3mca-ps1-client.h.
+   Header: magic (8), slots (4), image size (4), offset of the first image (4), next slot of the ring (4).
+   Slot header (from SHM_RING_HEADER_SIZE): sequence (4, odd while the image is written), state (4), fingerprint (4).
+   Images from SHM_DATA_OFFSET, one every 128 KiB. The sequence is an aligned uint32_t in the byte order of the host,
+   updated with atomic stores, all the other numbers are little endian.*/
+char SHM_MAGIC[] = "PS1SHMR";				/* 8 bytes with the final zero*/
+int SHM_SLOTS = 8;
+int SHM_RING_HEADER_SIZE = 64;
+int SHM_SLOT_HEADER_SIZE = 32;
+int SHM_DATA_OFFSET = 4096;
+#define SHM_SLOT_EMPTY 0
+#define SHM_SLOT_WRITING 1
+#define SHM_SLOT_GOOD 2
+#define SHM_SLOT_INCOMPLETE 3				/* Read aborted or failed*/
+
+/* ------------------------------------------------End of Shared memory definitions-------------------------------------------------*/